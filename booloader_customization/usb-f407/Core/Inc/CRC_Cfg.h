@@ -19,6 +19,7 @@
 #define RUNTTIME                            0
 #define TABLE                               1
 #define HARDWARE                            2
+#define SLICING_BY_8                        3   /* 8 tables of 256 entries, PCLMULQDQ on x86 when available */
 
 
 /* ---------- Defines for 8-bit SAE J1850 CRC calculation (Not reflected) ------------------------------------------------------- */
@@ -40,4 +41,11 @@
 #define CRC_32_POLYNOMIAL                   0x04C11DB7u
 #define CRC_32_INIT_VALUE                   0xFFFFFFFFu
 #define CRC_32_XOR_VALUE                    0xFFFFFFFFu
-#define CRC_32_MODE                         RUNTTIME
\ No newline at end of file
+#define CRC_32_MODE                         RUNTTIME
+
+/* ---------- Defines for 32-bit MPEG-2 CRC over little endian words, what the STM32 CRC unit calculates (Not reflected) -------- */
+#define CRC_32_MPEG2_POLYNOMIAL             0x04C11DB7u
+#define CRC_32_MPEG2_INIT_VALUE             0xFFFFFFFFu
+#ifndef CRC_32_MPEG2_MODE
+#define CRC_32_MPEG2_MODE                   HARDWARE    /* the emulator builds this file with TABLE */
+#endif
\ No newline at end of file
@@ -24,9 +24,26 @@
 #define START_LINEAR_ADDR		0X05
 /* PROGRAM ADDR */
 #define PROGRAM_ADDRESS			0x08020000UL
+/* Application region: sectors 5 to 11, 128 KB each, up to the end of the 1 MB flash */
+#define APP_FIRST_SECTOR		FLASH_SECTOR_5
+#define APP_NUM_SECTORS			7
+#define APP_SECTOR_SIZE			0x20000UL
+#define APP_REGION_SIZE			(APP_NUM_SECTORS * APP_SECTOR_SIZE)
+/* Where a valid application's initial stack pointer may be: SRAM1 + SRAM2, CCMRAM */
+#define APP_SRAM_START			0x20000000UL
+#define APP_SRAM_END			0x20020000UL
+#define APP_CCMRAM_START		0x10000000UL
+#define APP_CCMRAM_END			0x10010000UL
+/* Compressed Stream */
+#define LZ_MIN_MATCH			4
+#define LZ_OUT_SIZE				64 /* decoded bytes staged in RAM before flash_write() */
 /* BOOT OPTIONS */
 #define BOOTLOADER_MODE			GPIO_PIN_RESET
 #define APPLICATION_MODE		GPIO_PIN_SET
+/* Code placement, see STM32F407VGTX_FLASH.ld: before the boot decision from flash,
+ * in bootloader mode from the RAM main() loads .ramfunc into */
+#define __BOOT_FUNC				__attribute__((section(".BootFunc")))
+#define __LOADER_FUNC			__attribute__((section(".ramfunc")))
 /* Address Management */
 typedef union {
 	u32 address;
@@ -48,8 +65,12 @@ struct boot_button {
 	u16 pin;
 };
 
-void start_boot_checking(struct boot_button *button);
-void __attribute__((noreturn)) goto_application(u32 p_addr);
+void __BOOT_FUNC start_boot_checking(struct boot_button *button);
+u8 __BOOT_FUNC app_is_valid(u32 p_addr);
+void __BOOT_FUNC __attribute__((noreturn)) goto_application(u32 p_addr);
 err_t hex_line_handler(const u8 *hex_line, u32 length);
+void lz_stream_reset(void);
+err_t lz_stream_handler(const u8 *data, u32 length);
+err_t write_block_handler(const u8 *data, u32 length);
 
 #endif /* INC_BOOTLOADER_H_ */
@@ -9,8 +9,29 @@
 #define INC_FLASH_H_
 #include "stm32f4xx_hal.h"
 
+#define FLASH_STAGE_SIZE		1024	/* bytes collected in RAM before they are programmed, a v2 frame fits */
+#define FLASH_STAGE_BLOCKS		48	/* in CCMRAM: what arrives while a sector is erased */
+#define FLASH_POLL_OPS			4	/* program operations per flash_poll(), 16 us each */
+
+/* Programming and erasing since the last flash_stats_reset(), cycles are DWT->CYCCNT ticks */
+struct flash_stats {
+	u32 bytes;
+	u32 ops;		/* HAL_FLASH_Program() calls */
+	u32 cycles;
+	u32 erased;		/* sectors */
+};
+
+extern struct flash_stats flash_stats;
+
 HAL_StatusTypeDef flash_erase(u32 base_sector, u32 num_sector);
+void flash_erase_defer(u32 sectors);
+u32 flash_erase_pending(u32 *erasing);
 HAL_StatusTypeDef flash_write(u32 address, const u8 *data, u32 len);
+int flash_poll(void);
+HAL_StatusTypeDef flash_sync(void);
+u8 flash_byte(u32 address);
+void flash_stats_reset(void);
 int flash_read(u32 address, void *desc, u32 length);
+u32 flash_crc32(u32 address, u32 length);
 
 #endif /* INC_FLASH_H_ */
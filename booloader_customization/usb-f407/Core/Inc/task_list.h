@@ -22,12 +22,29 @@ struct task_struct {
 	u8 msg_head[2];
 	u16 msg_error;
 	u16 msg_type;
+	u16 seq;			/* sliding window sequence number */
 	u16 data_length;
-	u8 data[52];
-	u16 crc;
+	u8 data[48];
+	u32 crc;			/* CRC-32/MPEG-2 of the whole data field, as 12 words */
 	u8 msg_tail[2];
 };
 
+/* Protocol v2 frame: the same header, data_length bytes of data padded to words,
+ * then crc and tail. It spans several packets, at most half of UserRxBufferFS */
+#define FRAME_V2_MARK		0xFE	/* msg_head[1], 0xFB: a v1 frame */
+#define FRAME_HEAD_SIZE		10
+#define FRAME_V2_MAX		1024
+#define FRAME_V2_SIZE(len)	(FRAME_HEAD_SIZE + (((u32)(len) + 3) & ~3u) + 6)
+#define FRAME_V2_MAX_DATA	(FRAME_V2_MAX - FRAME_HEAD_SIZE - 6)
+
+struct frame_head {
+	u8 msg_head[2];
+	u16 msg_error;
+	u16 msg_type;
+	u16 seq;
+	u16 data_length;
+};
+
 struct task_queue {
 	struct task_struct *task;
 	uint32_t read_index;
@@ -15,14 +15,40 @@
 #define MSG_GOTO_APP		0x2002
 #define MSG_PROGRAM_DATA    0x2003
 #define MSG_DEV_ERASE		0x2004
+#define MSG_SECTOR_CRC		0x2005
+#define MSG_PROGRAM_LZ		0x2006
+#define MSG_VERIFY_IMAGE	0x2007
+#define MSG_READ_MEMORY		0x2008
+#define MSG_HELLO			0x2009
+#define MSG_WRITE_BLOCK		0x200A
+#define MSG_ERASE_STATUS	0x200B
 /* Error Code */
 #define	MSG_SUCCESS			0x3230
 #define MSG_INVALID			0x3231
 #define MSG_WFORMAT			0x3232
 #define MSG_FAILED			0x3233
 #define MSG_WRONG_CRC		0x3234
+/* Sliding Window */
+#define RX_WINDOW_SIZE		32 /* width of the selective ACK bitmap */
+/* Handshake: what MSG_HELLO reports */
+#define PROTOCOL_VERSION	2
+#define FEATURE_LARGE_FRAME	0x01 /* v2 frames of the program messages */
+#define FEATURE_LZ			0x02
+#define FEATURE_READ_MEMORY	0x04
+#define FEATURE_ERASE_MAP	0x08 /* MSG_DEV_ERASE takes a sector bitmap or an address range */
+#define FEATURE_WRITE_BLOCK	0x10
+#define FEATURE_ERASE_DEFER	0x20 /* ERASE_ON_DEMAND and MSG_ERASE_STATUS */
+/* MSG_DEV_ERASE: bit 31 of the bitmap, or a u32 after the range */
+#define ERASE_ON_DEMAND		0x80000000UL
+/* Readback */
+#define READ_BURST_FRAMES	8  /* frames per IN transfer of a MSG_READ_MEMORY stream */
 
 int usb_handle_packet(struct task_struct *task);
 int usb_response_pkt(struct task_struct *task);
+void usb_flush_response(void);
+void usb_rx_reset(void);
+u8 *usb_rx_packet(u8 *buf, u32 len);
+int usb_rx_poll(void);
+u32 usb_rx_dropped(void);
 
 #endif /* INC_USB_HANDLE_H_ */
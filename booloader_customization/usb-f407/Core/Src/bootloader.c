@@ -19,20 +19,12 @@ Record Type = {
 #include "bootloader.h"
 #include <string.h>
 
-void start_boot_checking(struct boot_button *button) {
-	if (HAL_GPIO_ReadPin(button->port, button->pin) == BOOTLOADER_MODE) {
-		//do nothing
-	} else {
-		goto_application(PROGRAM_ADDRESS);
-	}
-}
-
-/* Run application */
-void __attribute__((noreturn)) goto_application(u32 p_addr) {
-	/* Turn off Peripheral, Clear Interrupt Flag*/
-	HAL_RCC_DeInit();
-	/* Clear Pending Interrupt Request, turn off System Tick*/
-	HAL_DeInit();
+/* Hand the core over as reset left it: no SysTick running or pending, the
+ * application's vector table, its stack */
+static void __BOOT_FUNC __attribute__((noreturn)) app_jump(u32 p_addr) {
+	/* Turn off System Tick, the application's handler is not there yet */
+	SysTick->CTRL = 0;
+	SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
 	/* Turn off fault harder*/
 	SCB->SHCSR &= ~(SCB_SHCSR_USGFAULTENA_Msk |
 			SCB_SHCSR_BUSFAULTENA_Msk |
@@ -48,6 +40,49 @@ void __attribute__((noreturn)) goto_application(u32 p_addr) {
 	}
 }
 
+/**
+  * @brief  Jump to the application unless the button asks for the bootloader or
+  * there is no application to run. Called before the clock and USB are set up:
+  * clocks and peripherals are still as reset left them, only the button's GPIO
+  * is configured, so there is nothing to tear down
+  * @param  button: boot button, its pin configured as an input
+*/
+void __BOOT_FUNC start_boot_checking(struct boot_button *button) {
+	if (HAL_GPIO_ReadPin(button->port, button->pin) != BOOTLOADER_MODE && app_is_valid(PROGRAM_ADDRESS)) {
+		app_jump(PROGRAM_ADDRESS);
+	}
+}
+
+/**
+  * @brief  Check the vector table of an application: the initial stack pointer in
+  * RAM, the reset handler a Thumb address inside the application region.
+  * Erased or half written flash fails it
+  * @param  p_addr: vector table of the application
+  * @retval 1: plausible, 0: not an application
+*/
+u8 __BOOT_FUNC app_is_valid(u32 p_addr) {
+	u32 sp = *((volatile u32 *) p_addr);
+	u32 reset = *((volatile u32 *) (p_addr + 4U));
+
+	if (sp & 3) {
+		return 0;
+	}
+	if ((sp <= APP_SRAM_START || sp > APP_SRAM_END) && (sp <= APP_CCMRAM_START || sp > APP_CCMRAM_END)) {
+		return 0;
+	}
+	return (reset & 1) && reset - PROGRAM_ADDRESS < APP_REGION_SIZE;
+}
+
+/* Run application, from the bootloader once it set up the clock and USB */
+void __BOOT_FUNC __attribute__((noreturn)) goto_application(u32 p_addr) {
+	/* Turn off Peripheral, Clear Interrupt Flag. Ends in HAL_InitTick(): SysTick
+	 * runs again on the reset clock until app_jump() stops it */
+	HAL_RCC_DeInit();
+	/* Reset the peripherals, SysTick is left running */
+	HAL_DeInit();
+	app_jump(p_addr);
+}
+
 /* Handle HEX Frame */
 err_t hex_line_handler(const u8 *hex_line, u32 length) {
 	u8 type, checksum;
@@ -63,7 +98,7 @@ err_t hex_line_handler(const u8 *hex_line, u32 length) {
 	switch (type) {
 		case DATA_RECORD:
 			flash.addr.offset = (u16)(hex_line[INDEX_ADDR] << 8) | (u16)hex_line[INDEX_ADDR + 1];
-			if (flash_write(flash.address, &hex_line[INDEX_DATA], hex_line[INDEX_LEN]) < 0) {
+			if (flash_write(flash.address, &hex_line[INDEX_DATA], hex_line[INDEX_LEN]) != HAL_OK) {
 				return HEX_WR_FAILED;
 			}
 			break;
@@ -83,3 +118,196 @@ err_t hex_line_handler(const u8 *hex_line, u32 length) {
 	}
 	return HEX_SUCCESS;
 }
+
+/*
+Binary blocks = { u32 address, u32 length: little endian, data }, back to back.
+Address and length are word aligned and the block lies in the application, so
+the data goes to flash_write() as it is, whatever frame carries it.
+*/
+err_t write_block_handler(const u8 *data, u32 length) {
+	u32 header[2];
+
+	while (length) {
+		if (length < sizeof(header)) {
+			return HEX_INVALID;
+		}
+		memcpy(header, data, sizeof(header));
+		data += sizeof(header);
+		length -= sizeof(header);
+		if (((header[0] | header[1]) & 3) || header[1] > length || header[0] < PROGRAM_ADDRESS ||
+			header[0] - PROGRAM_ADDRESS > APP_REGION_SIZE || header[1] > APP_REGION_SIZE - (header[0] - PROGRAM_ADDRESS)) {
+			return HEX_INVALID;
+		}
+		if (flash_write(header[0], data, header[1]) != HAL_OK) {
+			return HEX_WR_FAILED;
+		}
+		data += header[1];
+		length -= header[1];
+	}
+	return HEX_SUCCESS;
+}
+
+/*
+Compressed stream = blocks of {
+	u32 address, u32 length: little endian
+	LZ4 block: token (literal length << 4 | match length - 4), literals,
+	           u16 offset, lengths of 15 and more continue in extra bytes
+}
+Matches copy from the bytes already decoded: from the RAM window if they
+are still there, otherwise from flash or what flash_write() staged for it.
+They may reach back into earlier blocks, the host only does so within data
+it knows is written.
+*/
+enum lz_state {
+	LZ_HEADER,
+	LZ_TOKEN,
+	LZ_LITERAL_LEN,
+	LZ_LITERAL,
+	LZ_OFFSET,
+	LZ_MATCH_LEN,
+	LZ_ERROR
+};
+
+static struct {
+	enum lz_state state;
+	u8 count;			/* bytes of the header / offset collected */
+	u8 token;
+	u8 header[8];
+	u16 offset;
+	u32 lit_len;
+	u32 match_len;
+	u32 dst;			/* address of out[0] */
+	u32 left;			/* bytes still to decode in the block */
+	u16 out_len;
+	u8 out[LZ_OUT_SIZE];
+} lz;
+
+void lz_stream_reset(void) {
+	lz.state = LZ_HEADER;
+	lz.count = 0;
+	lz.out_len = 0;
+}
+
+static err_t lz_flush(void) {
+	if (lz.out_len && flash_write(lz.dst, lz.out, lz.out_len) != HAL_OK) {
+		return HEX_WR_FAILED;
+	}
+	lz.dst += lz.out_len;
+	lz.out_len = 0;
+	return HEX_SUCCESS;
+}
+
+static err_t lz_put(u8 byte) {
+	if (!lz.left) {
+		return HEX_INVALID;
+	}
+	lz.out[lz.out_len++] = byte;
+	lz.left--;
+	return (lz.out_len == LZ_OUT_SIZE) ? lz_flush() : HEX_SUCCESS;
+}
+
+/* A sequence ends after its literals or after its match */
+static err_t lz_sequence_end(void) {
+	if (lz.left) {
+		lz.state = LZ_TOKEN;
+		return HEX_SUCCESS;
+	}
+	lz.state = LZ_HEADER;
+	lz.count = 0;
+	return lz_flush();
+}
+
+static err_t lz_literals_end(void) {
+	if (!lz.left) {
+		return lz_sequence_end();
+	}
+	lz.state = LZ_OFFSET;
+	lz.count = 0;
+	lz.offset = 0;
+	return HEX_SUCCESS;
+}
+
+static err_t lz_copy_match(void) {
+	err_t res;
+	u32 src = lz.dst + lz.out_len - lz.offset;
+
+	if (!lz.offset || lz.offset > lz.dst + lz.out_len - FLASH_BASE || lz.match_len > lz.left) {
+		return HEX_INVALID;
+	}
+	while (lz.match_len--) {
+		u8 byte = (src >= lz.dst) ? lz.out[src - lz.dst] : flash_byte(src);
+		src++;
+		res = lz_put(byte);
+		if (res != HEX_SUCCESS) {
+			return res;
+		}
+	}
+	return lz_sequence_end();
+}
+
+static err_t lz_byte(u8 c) {
+	err_t res;
+	switch (lz.state) {
+		case LZ_HEADER:
+			lz.header[lz.count++] = c;
+			if (lz.count == sizeof(lz.header)) {
+				memcpy(&lz.dst, &lz.header[0], sizeof(u32));
+				memcpy(&lz.left, &lz.header[4], sizeof(u32));
+				lz.out_len = 0;
+				lz.count = 0;
+				lz.state = lz.left ? LZ_TOKEN : LZ_HEADER;
+			}
+			return HEX_SUCCESS;
+		case LZ_TOKEN:
+			lz.token = c;
+			lz.lit_len = c >> 4;
+			if (lz.lit_len == 15) {
+				lz.state = LZ_LITERAL_LEN;
+				return HEX_SUCCESS;
+			}
+			lz.state = LZ_LITERAL;
+			return lz.lit_len ? HEX_SUCCESS : lz_literals_end();
+		case LZ_LITERAL_LEN:
+			lz.lit_len += c;
+			if (c != 255) {
+				lz.state = LZ_LITERAL;
+			}
+			return HEX_SUCCESS;
+		case LZ_LITERAL:
+			res = lz_put(c);
+			if (res != HEX_SUCCESS) {
+				return res;
+			}
+			return --lz.lit_len ? HEX_SUCCESS : lz_literals_end();
+		case LZ_OFFSET:
+			lz.offset |= (u16)c << (8 * lz.count++);
+			if (lz.count < 2) {
+				return HEX_SUCCESS;
+			}
+			lz.match_len = (lz.token & 0x0F) + LZ_MIN_MATCH;
+			if ((lz.token & 0x0F) == 15) {
+				lz.state = LZ_MATCH_LEN;
+				return HEX_SUCCESS;
+			}
+			return lz_copy_match();
+		case LZ_MATCH_LEN:
+			lz.match_len += c;
+			return (c == 255) ? HEX_SUCCESS : lz_copy_match();
+		default:
+			return HEX_INVALID;
+	}
+}
+
+/* Handle a frame of the compressed stream, frames must come in order */
+err_t lz_stream_handler(const u8 *data, u32 length) {
+	err_t res;
+	for (u32 i = 0; i < length; i++) {
+		res = lz_byte(data[i]);
+		if (res != HEX_SUCCESS) {
+			/* The stream position is lost, refuse everything until the next erase */
+			lz.state = LZ_ERROR;
+			return res;
+		}
+	}
+	return HEX_SUCCESS;
+}
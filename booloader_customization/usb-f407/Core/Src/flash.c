@@ -5,44 +5,389 @@
  *      Author: dinhnamuet
  */
 #include "flash.h"
+#include "CRC.h"
+#include <string.h>
 
-HAL_StatusTypeDef flash_erase(u32 base_sector, u32 num_sector) {
-	HAL_StatusTypeDef res = HAL_ERROR;
-	FLASH_EraseInitTypeDef erase;
+/*
+Writes are collected in a ring of word aligned RAM blocks. A block that is
+full, or that a write does not continue, is handed over to flash_poll(), which
+programs the oldest one from the main loop a few operations at a time while
+the next ones fill from USB: receiving and programming overlap, a frame is
+acknowledged once it is staged. Only a head or tail that does not fill a word
+goes byte by byte. The flash stays unlocked from the first write or erase until
+flash_sync(), which also reports what went wrong in the background.
+
+After flash_erase_defer() a sector is erased only once a block that goes to it
+is next to be programmed, and the one after the sector being written is erased
+ahead while nothing waits to be programmed. Such an erase runs in the
+background and the FLASH interrupt ends it, the ring takes what arrives
+meanwhile: on the single bank nothing is programmed during an erase.
+*/
+struct stage {
+	u32 base;			/* word aligned address of the block's first byte */
+	u16 start;			/* first byte not programmed yet */
+	u16 end;			/* past the last one, 0: empty */
+};
+
+/* Only the CPU touches the staged bytes, CCMRAM serves them */
+static u32 stage_buf[FLASH_STAGE_BLOCKS][FLASH_STAGE_SIZE / sizeof(u32)] __attribute__((section(".ccmram_bss")));
+
+static struct {
+	struct stage block[FLASH_STAGE_BLOCKS];
+	u8 fill;			/* block being filled */
+	u8 head;			/* oldest block handed over, head == fill: none */
+	u8 unlocked;
+	HAL_StatusTypeDef error;	/* of programming in the background, kept until flash_sync() */
+} stage;
+
+/* Deferred erase, bit n: FLASH_SECTOR_n */
+static struct {
+	volatile u32 pending;	/* not erased yet, the one being erased included */
+	volatile u32 busy;		/* being erased in the background, 0: none */
+	u32 next;				/* sector written last, it and the one after are erased ahead */
+} erase;
+
+#define STAGE_NEXT(i)		(((i) + 1) % FLASH_STAGE_BLOCKS)
+
+struct flash_stats flash_stats;
+
+static void flash_unlock(void) {
+	if (!stage.unlocked) {
+		HAL_FLASH_Unlock();
+		stage.unlocked = 1;
+	}
+}
+
+/* Sector holding an address: four of 16 KB, one of 64 KB, then 128 KB each */
+static u32 sector_of(u32 address) {
+	u32 offset = address - FLASH_BASE;
+
+	if (address < FLASH_BASE || address > FLASH_END) {
+		return FLASH_SECTOR_TOTAL;
+	}
+	if (offset < 0x10000) {
+		return offset / 0x4000;
+	}
+	return (offset < 0x20000) ? 4 : 4 + offset / 0x20000;
+}
+
+/* Sectors the bytes of a block not programmed yet go to */
+static u32 block_sectors(const struct stage *b) {
+	u32 first = sector_of(b->base + b->start);
+	u32 last = sector_of(b->base + b->end - 1);
+
+	return ((2UL << last) - 1) & ~((1UL << first) - 1);
+}
+
+/**
+  * @brief  Program up to ops operations of a block: byte wide up to a word boundary,
+  * word wide, then the rest byte wide. A failed block is dropped
+  * @retval HAL_OK or the error of HAL_FLASH_Program()
+*/
+static HAL_StatusTypeDef block_program(struct stage *b, u32 ops) {
+	HAL_StatusTypeDef res = HAL_OK;
+	const u32 *buf = stage_buf[b - stage.block];
+	const u8 *bytes = (const u8 *)buf;
+	u32 start = DWT->CYCCNT;
+	u16 from = b->start;
+
+	flash_unlock();
+	for (; ops && b->start < b->end && res == HAL_OK; ops--, flash_stats.ops++) {
+		if ((b->start & 3) || b->start + sizeof(u32) > b->end) {
+			res = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, b->base + b->start, bytes[b->start]);
+			b->start += 1;
+		} else {
+			res = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, b->base + b->start, buf[b->start / sizeof(u32)]);
+			b->start += sizeof(u32);
+		}
+	}
+	flash_stats.bytes += b->start - from;
+	flash_stats.cycles += DWT->CYCCNT - start;
+	if (b->start >= b->end || res != HAL_OK) {
+		b->end = 0;
+	}
+	return res;
+}
+
+/* Erase sectors and wait, the caller knows no erase runs in the background */
+static HAL_StatusTypeDef sector_erase(u32 base_sector, u32 num_sector) {
+	FLASH_EraseInitTypeDef init;
 	u32 page_err;
 
-	erase.Banks			= FLASH_BANK_1;
-	erase.Sector		= base_sector;
-	erase.NbSectors		= num_sector;
-	erase.TypeErase 	= FLASH_TYPEERASE_SECTORS;
-	erase.VoltageRange	= FLASH_VOLTAGE_RANGE_3;
+	init.Banks			= FLASH_BANK_1;
+	init.Sector			= base_sector;
+	init.NbSectors		= num_sector;
+	init.TypeErase		= FLASH_TYPEERASE_SECTORS;
+	init.VoltageRange	= FLASH_VOLTAGE_RANGE_3;
 
-	HAL_FLASH_Unlock();
-	res = HAL_FLASHEx_Erase(&erase, &page_err);
-	HAL_FLASH_Lock();
+	flash_unlock();
+	flash_stats.erased += num_sector;
+	return HAL_FLASHEx_Erase(&init, &page_err);
+}
+
+/* Start erasing a deferred sector, HAL_FLASH_EndOfOperationCallback() tells when it is done */
+static void erase_start(u32 sector) {
+	FLASH_EraseInitTypeDef init;
+
+	init.Banks			= FLASH_BANK_1;
+	init.Sector			= sector;
+	init.NbSectors		= 1;
+	init.TypeErase		= FLASH_TYPEERASE_SECTORS;
+	init.VoltageRange	= FLASH_VOLTAGE_RANGE_3;
+
+	flash_unlock();
+	erase.busy = 1UL << sector;
+	if (HAL_FLASHEx_Erase_IT(&init) != HAL_OK) {
+		erase.pending &= ~erase.busy;
+		erase.busy = 0;
+		stage.error = HAL_ERROR;
+	}
+}
+
+static void erase_wait(void) {
+	while (erase.busy) {
+		__WFI();
+	}
+}
+
+/* Erase the deferred ones among sectors now, after the erase running in the background */
+static HAL_StatusTypeDef erase_now(u32 sectors) {
+	HAL_StatusTypeDef res = HAL_OK;
+
+	erase_wait();
+	sectors &= erase.pending;
+	for (u32 i = 0; i < FLASH_SECTOR_TOTAL && sectors && res == HAL_OK; i++) {
+		if (sectors & (1UL << i)) {
+			res = sector_erase(i, 1);
+			erase.pending &= ~(1UL << i);
+			sectors &= ~(1UL << i);
+		}
+	}
 	return res;
 }
+
+/* Program a whole block handed over, erasing its deferred sectors first */
+static HAL_StatusTypeDef block_flush(struct stage *b) {
+	HAL_StatusTypeDef res;
+
+	if (!b->end) {
+		return HAL_OK;
+	}
+	if ((res = erase_now(block_sectors(b))) != HAL_OK) {
+		b->end = 0;
+		return res;
+	}
+	return block_program(b, UINT32_MAX);
+}
+
+/* Program every staged byte, the oldest block first */
+static void stage_drain(void) {
+	HAL_StatusTypeDef res;
+
+	for (;;) {
+		if ((res = block_flush(&stage.block[stage.head])) != HAL_OK) {
+			stage.error = res;
+		}
+		if (stage.head == stage.fill) {
+			break;
+		}
+		stage.head = STAGE_NEXT(stage.head);
+	}
+}
+
+HAL_StatusTypeDef flash_erase(u32 base_sector, u32 num_sector) {
+	/* Acknowledged data goes to flash before anything is erased, an erase starts over */
+	stage_drain();
+	stage.error = HAL_OK;
+	erase_wait();
+	erase.pending &= ~(((1UL << num_sector) - 1) << base_sector);
+	return sector_erase(base_sector, num_sector);
+}
+
+/**
+  * @brief  Erase sectors only when they are about to be programmed, or ahead of the
+  * writes while the flash is idle. flash_sync() erases the ones left
+  * @param  sectors: bit n: FLASH_SECTOR_n
+  * @retval none
+*/
+void flash_erase_defer(u32 sectors) {
+	stage_drain();
+	stage.error = HAL_OK;
+	erase_wait();
+	erase.pending |= sectors;
+	erase.next = erase.pending ? __builtin_ctz(erase.pending) : 0;
+}
+
+/**
+  * @brief  Progress of a deferred erase
+  * @param  erasing: gets the sector being erased, bit n: FLASH_SECTOR_n, 0: none
+  * @retval sectors not erased yet, the one being erased included
+*/
+u32 flash_erase_pending(u32 *erasing) {
+	*erasing = erase.busy;
+	return erase.pending;
+}
+
+/* FLASH interrupt: the erase started by erase_start() is done. Programming polls,
+ * only erases interrupt: the HAL reports the end of the last (here the only)
+ * sector as 0xFFFFFFFF, a sector number means more sectors follow */
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue) {
+	if (erase.busy && ReturnValue == 0xFFFFFFFFU) {
+		erase.pending &= ~erase.busy;
+		erase.busy = 0;
+		flash_stats.erased++;
+	}
+}
+
+/* ReturnValue: the faulty sector, the erase is over whichever it names */
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue) {
+	(void)ReturnValue;
+	erase.pending &= ~erase.busy;
+	erase.busy = 0;
+	stage.error = HAL_ERROR;
+}
+
+/**
+  * @brief  Stage data for programming, consecutive writes are programmed together
+  * @param  address: any alignment
+  * @param  data: bytes to program, copied before the call returns
+  * @param  len: number of bytes
+  * @retval HAL_OK, or the error of programming what was staged before
+*/
 HAL_StatusTypeDef flash_write(u32 address, const u8 *data, u32 len) {
-    HAL_StatusTypeDef res;
-    HAL_FLASH_Unlock();
-    for (int i = 0; i < len; i++) {
-    	res = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, address + i, data[i]);
-    	if (res < 0) {
-    		goto exit;
-    	}
-    }
-exit:
-    HAL_FLASH_Lock();
-    return res;
+	struct stage *b = &stage.block[stage.fill];
+	HAL_StatusTypeDef res;
+	u32 n;
+
+	if (stage.error != HAL_OK) {
+		return stage.error;
+	}
+	erase.next = sector_of(address);
+	while (len) {
+		/* Not where the staged bytes end: hand the block over, the oldest one goes to flash if none is free */
+		if (b->end && (address != b->base + b->end || b->end == FLASH_STAGE_SIZE)) {
+			if (STAGE_NEXT(stage.fill) == stage.head) {
+				if ((res = block_flush(&stage.block[stage.head])) != HAL_OK) {
+					stage.error = res;
+					return res;
+				}
+				stage.head = STAGE_NEXT(stage.head);
+			}
+			stage.fill = STAGE_NEXT(stage.fill);
+			b = &stage.block[stage.fill];
+		}
+		if (!b->end) {
+			b->base = address & ~3u;
+			b->start = b->end = address & 3;
+		}
+		n = FLASH_STAGE_SIZE - b->end;
+		n = (n > len) ? len : n;
+		memcpy((u8 *)stage_buf[stage.fill] + b->end, data, n);
+		b->end += n;
+		address += n;
+		data += n;
+		len -= n;
+	}
+	return HAL_OK;
 }
 
+/**
+  * @brief  Program a little of the oldest block handed over, called from the main loop.
+  * Erases what it goes to first, or while nothing is handed over the sector being
+  * written and the next one, in the background
+  * @retval 1: there is more to program, 0: nothing is waiting, or the erase
+*/
+int flash_poll(void) {
+	struct stage *b = &stage.block[stage.head];
+	HAL_StatusTypeDef res;
+	u32 sectors;
+
+	if (erase.busy) {
+		return 0;
+	}
+	sectors = (stage.head == stage.fill) ? (3UL << erase.next) : block_sectors(b);
+	if ((sectors &= erase.pending)) {
+		erase_start(__builtin_ctz(sectors));
+		return 0;
+	}
+	if (stage.head == stage.fill) {
+		return 0;
+	}
+	if ((res = block_program(b, FLASH_POLL_OPS)) != HAL_OK) {
+		stage.error = res;
+	}
+	if (!b->end) {
+		stage.head = STAGE_NEXT(stage.head);
+	}
+	return stage.head != stage.fill;
+}
+
+/**
+  * @brief  Program everything staged, erase what a deferred erase left and lock
+  * the flash, before it is read or left
+  * @retval HAL_OK, or HAL_ERROR if anything staged since the last erase failed
+*/
+HAL_StatusTypeDef flash_sync(void) {
+	HAL_StatusTypeDef res;
+
+	stage_drain();
+	if ((res = erase_now(erase.pending)) != HAL_OK) {
+		stage.error = res;
+	}
+	res = stage.error;
+	stage.error = HAL_OK;
+	if (stage.unlocked) {
+		HAL_FLASH_Lock();
+		stage.unlocked = 0;
+	}
+	return res;
+}
+
+/**
+  * @brief  A byte of flash as it will be once the staged bytes are programmed
+  * @param  address: any address in flash
+  * @retval the byte
+*/
+u8 flash_byte(u32 address) {
+	for (u32 i = 0; i < FLASH_STAGE_BLOCKS; i++) {
+		const struct stage *b = &stage.block[i];
+		if (b->end && address >= b->base + b->start && address < b->base + b->end) {
+			return ((const u8 *)stage_buf[i])[address - b->base];
+		}
+	}
+	return *(volatile u8 *)address;
+}
+
+void flash_stats_reset(void) {
+	memset(&flash_stats, 0, sizeof(flash_stats));
+}
+
+/**
+  * @brief  Copy a flash region with 32-bit loads
+  * @param  address: word aligned start address
+  * @param  desc: destination, any alignment
+  * @param  length: number of bytes, multiple of 4
+  * @retval 0: success, -1: invalid arguments
+*/
 int flash_read(u32 address, void *desc, u32 length) {
 	u8 *ptr = (u8 *)desc;
-	if (!desc) {
+	u32 word;
+	if (!desc || ((address | length) & 3)) {
 		return -1;
 	}
-	for (int i = 0; i < length; i++) {
-		ptr[i] = *(volatile u8*) (address + i);
+	for (u32 i = 0; i < length; i += sizeof(u32)) {
+		word = *(volatile u32 *)(address + i);
+		memcpy(ptr + i, &word, sizeof(u32));
 	}
 	return 0;
 }
+
+/**
+  * @brief  CRC-32/MPEG-2 of a flash region on the CRC unit, fed by DMA
+  * @param  address: word aligned start address
+  * @param  length: number of bytes, multiple of 4
+  * @retval CRC32 (polynomial 0x04C11DB7, init 0xFFFFFFFF, no reflection)
+*/
+u32 flash_crc32(u32 address, u32 length) {
+	return CRC_CalculateCRC32Mpeg2((const u8 *)address, length / 4);
+}
@@ -26,6 +26,7 @@
 #include "usb_handle.h"
 #include "led_bootloader.h"
 #include "bootloader.h"
+#include <string.h>
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -69,10 +70,44 @@ static void MX_GPIO_Init(void);
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
-void HAL_IncTick(void) {
+#define VECTOR_WORDS	(16 + 82)	/* Cortex-M4 exceptions, STM32F407 interrupts */
+
+extern const u32 g_pfnVectors[];
+/* Exceptions taken while the flash is erased would stall fetching their vector */
+static u32 ram_vectors[VECTOR_WORDS] __attribute__((aligned(512)));
+extern u32 _siramfunc[], _sramfunc[], _eramfunc[];
+
+void __LOADER_FUNC HAL_IncTick(void) {
 	uwTick += uwTickFreq;
 	led_increase_counter(&boot_indicator);
 }
+
+/* Load the code of bootloader mode into RAM, see .ramfunc in STM32F407VGTX_FLASH.ld.
+ * Through volatile so that it is not turned into a memcpy() call, memcpy() is part of it */
+static void ramfunc_load(void) {
+	const volatile u32 *src = _siramfunc;
+	volatile u32 *dst = _sramfunc;
+
+	while (dst < _eramfunc) {
+		*dst++ = *src++;
+	}
+	__DSB();
+	__ISB();
+}
+
+/* The main loop, from RAM: the one in main() would stall while the flash is busy */
+static void __LOADER_FUNC __attribute__((noreturn)) bootloader_loop(void) {
+	while (1) {
+		if (!queue_is_empty(&usb_queue)) {
+			usb_handle_packet(get_new_task(&usb_queue));
+		} else if (!usb_rx_poll()) {
+			/* Nothing received: program what is staged */
+			flash_poll();
+		}
+		usb_flush_response();
+		led_ctrl(&boot_indicator);
+	}
+}
 /* USER CODE END 0 */
 
 /**
@@ -83,7 +118,24 @@ int main(void)
 {
 
 	/* USER CODE BEGIN 1 */
+	u32 start;
 
+	/* DWT->CYCCNT runs since Reset_Handler, for flash_stats and for the application:
+	 * it keeps running after the jump, HSI cycles on the fast path */
+	/* Boot decision first, even before HAL_Init(): a normal power-on starts the
+	 * application on the reset clock, .ramfunc is only loaded and the PLL and USB
+	 * only brought up to stay in the bootloader */
+	MX_GPIO_Init();
+	/* Lets the pull-up charge the button line, 10 us */
+	start = DWT->CYCCNT;
+	while (DWT->CYCCNT - start < SystemCoreClock / 100000) {
+	}
+#if defined(BOOT_OPER)
+	/* Hardware Boot Option */
+	start_boot_checking(&button);
+#endif
+	/* Before HAL_Init() starts SysTick, its handler is part of it */
+	ramfunc_load();
 	/* USER CODE END 1 */
 
 	/* MCU Configuration--------------------------------------------------------*/
@@ -99,17 +151,19 @@ int main(void)
 	SystemClock_Config();
 
 	/* USER CODE BEGIN SysInit */
-
+	/* Vector table in RAM, see .ramfunc in STM32F407VGTX_FLASH.ld */
+	memcpy(ram_vectors, g_pfnVectors, sizeof(ram_vectors));
+	SCB->VTOR = (u32)ram_vectors;
+	__DSB();
 	/* USER CODE END SysInit */
 
 	/* Initialize all configured peripherals */
-	MX_GPIO_Init();
-	MX_USB_DEVICE_Init();
 	/* USER CODE BEGIN 2 */
-#if defined(BOOT_OPER)
-	/* Hardware Boot Option */
-	start_boot_checking(&button);
-#endif
+	/* Bootloader mode only, see USER CODE 1 */
+	MX_USB_DEVICE_Init();
+	/* Ends the erases flash_poll() starts in the background */
+	HAL_NVIC_SetPriority(FLASH_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(FLASH_IRQn);
 	/* USB Queue Initialization */
 	if (init_queue(&usb_queue, 10) < 0) {
 		return -1;
@@ -118,15 +172,12 @@ int main(void)
 
 	/* Infinite loop */
 	/* USER CODE BEGIN WHILE */
+	bootloader_loop();
 	while (1)
 	{
 		/* USER CODE END WHILE */
 
 		/* USER CODE BEGIN 3 */
-		if (!queue_is_empty(&usb_queue)) {
-			usb_handle_packet(get_new_task(&usb_queue));
-		}
-		led_ctrl(&boot_indicator);
 	}
 	/* USER CODE END 3 */
 }
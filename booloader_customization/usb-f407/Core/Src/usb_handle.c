@@ -12,17 +12,275 @@
 #include "bootloader.h"
 
 extern u16 adc_val;
+extern struct task_queue usb_queue;
+
+#if APP_RX_DATA_SIZE < 2 * FRAME_V2_MAX
+#error "UserRxBufferFS must hold two v2 frames"
+#endif
+
+/* Receive window of MSG_PROGRAM_DATA frames */
+static struct {
+	u16 expected;	/* next in-order sequence number */
+	u32 sack;		/* bit n set: frame (expected + 1 + n) was already handled */
+} rx_window;
+
+/* Response buffers: one frame on the wire, one waiting for the IN endpoint */
+static struct task_struct tx_frame;
+static struct task_struct tx_pending;
+static u8 tx_has_pending;
+
+/* MSG_READ_MEMORY stream, sent a burst at a time whenever no response is waiting */
+static struct {
+	u32 address;
+	u32 remaining;
+	u16 seq;		/* of the next data frame */
+} rd_stream;
+static struct task_struct rd_burst[READ_BURST_FRAMES];
+
+/* Frames reassembled from the packets of the OUT endpoint in two halves of
+ * UserRxBufferFS: one waits for the main loop while the other fills */
+static struct {
+	volatile u16 len[2];	/* size of the whole frame a slot holds, 0: none */
+	u16 filled;				/* bytes received into the slot being filled */
+	u8 fill;				/* slot being filled */
+	u8 next;				/* oldest waiting slot */
+	volatile u8 paused;		/* both slots hold frames, the OUT endpoint NAKs */
+	u32 dropped;			/* v1 frames lost to a full usb_queue */
+} rx;
+#define RX_SLOT(n)			(UserRxBufferFS + (n) * FRAME_V2_MAX)
+
+/* Frame check, on the CRC unit */
+static u32 usb_crc(const struct task_struct *task) {
+	return CRC_CalculateCRC32Mpeg2(task->data, sizeof(task->data) / 4);
+}
+
+/* Head, tail and frame check of an outgoing frame, the unused data is zeroed */
+static void usb_seal(struct task_struct *task) {
+	task->msg_head[0] = 0xFA;
+	task->msg_head[1] = 0xFB;
+	memset(task->data + task->data_length, 0, sizeof(task->data) - task->data_length);
+	task->crc = usb_crc(task);
+	task->msg_tail[0] = 0xFC;
+	task->msg_tail[1] = 0xFD;
+}
+
+/**
+  * @brief  Erase application sectors
+  * @param  task: data holds a u32 bitmap, bit n: sector APP_FIRST_SECTOR + n,
+  * other bits past the application region are ignored. Or u32 address, u32 length:
+  * every sector the range touches, optionally followed by u32 flags. Without data
+  * every sector is erased. With ERASE_ON_DEMAND the sectors are only erased once
+  * written, the response does not wait for them
+  * @retval MSG_SUCCESS, MSG_FAILED or MSG_INVALID for a range outside the application
+*/
+static u16 erase_sectors(struct task_struct *task) {
+	u32 bitmap = 0xFFFFFFFF;
+	u32 range[3] = { 0, 0, 0 };
+	u32 flags = 0;
+
+	if (task->data_length == sizeof(u32)) {
+		memcpy(&bitmap, task->data, sizeof(u32));
+		flags = bitmap & ERASE_ON_DEMAND;
+	} else if (task->data_length == 2 * sizeof(u32) || task->data_length == sizeof(range)) {
+		memcpy(range, task->data, task->data_length);
+		flags = range[2];
+		if (range[0] < PROGRAM_ADDRESS || range[0] - PROGRAM_ADDRESS >= APP_REGION_SIZE ||
+			range[1] > APP_REGION_SIZE - (range[0] - PROGRAM_ADDRESS)) {
+			return MSG_INVALID;
+		}
+		bitmap = 0;
+		if (range[1]) {
+			u32 first = (range[0] - PROGRAM_ADDRESS) / APP_SECTOR_SIZE;
+			u32 last = (range[0] - PROGRAM_ADDRESS + range[1] - 1) / APP_SECTOR_SIZE;
+			bitmap = ((2UL << last) - 1) & ~((1UL << first) - 1);
+		}
+	}
+	if (flags & ERASE_ON_DEMAND) {
+		flash_erase_defer((bitmap & ((1UL << APP_NUM_SECTORS) - 1)) << APP_FIRST_SECTOR);
+		return MSG_SUCCESS;
+	}
+	for (u32 i = 0; i < APP_NUM_SECTORS; i++) {
+		if ((bitmap & (1UL << i)) && flash_erase(APP_FIRST_SECTOR + i, 1) != HAL_OK) {
+			return MSG_FAILED;
+		}
+	}
+	return MSG_SUCCESS;
+}
+
+/**
+  * @brief  CRC32 of a region of the application, on the CRC unit
+  * @param  task: data holds u32 address, u32 length, both word aligned
+  * @param  response: data gets address, length and the CRC
+  * @retval MSG_SUCCESS, MSG_WFORMAT, MSG_INVALID for a region outside the application
+  * or MSG_FAILED if the staged writes could not be programmed
+*/
+static u16 verify_image(struct task_struct *task, struct task_struct *response) {
+	u32 region[3];
+
+	response->data_length = 0;
+	if (task->data_length != 2 * sizeof(u32)) {
+		return MSG_WFORMAT;
+	}
+	memcpy(region, task->data, 2 * sizeof(u32));
+	if (region[0] < PROGRAM_ADDRESS || region[0] - PROGRAM_ADDRESS > APP_REGION_SIZE ||
+		region[1] > APP_REGION_SIZE - (region[0] - PROGRAM_ADDRESS) || ((region[0] | region[1]) & 3)) {
+		return MSG_INVALID;
+	}
+	if (flash_sync() != HAL_OK) {
+		return MSG_FAILED;
+	}
+	region[2] = flash_crc32(region[0], region[1]);
+	memcpy(response->data, region, sizeof(region));
+	response->data_length = sizeof(region);
+	return MSG_SUCCESS;
+}
+
+/**
+  * @brief  Start streaming a flash region back, a new request replaces a running stream
+  * @param  task: data holds u32 address, u32 length, both word aligned, length 0 stops the stream
+  * @retval MSG_SUCCESS, MSG_WFORMAT, MSG_INVALID for a region outside the flash
+  * or MSG_FAILED if the staged writes could not be programmed
+*/
+static u16 read_memory(struct task_struct *task) {
+	u32 region[2];
+
+	if (task->data_length != sizeof(region)) {
+		return MSG_WFORMAT;
+	}
+	memcpy(region, task->data, sizeof(region));
+	if (region[0] < FLASH_BASE || region[0] > FLASH_END ||
+		region[1] > FLASH_END - region[0] + 1 || ((region[0] | region[1]) & 3)) {
+		return MSG_INVALID;
+	}
+	if (flash_sync() != HAL_OK) {
+		return MSG_FAILED;
+	}
+	rd_stream.address = region[0];
+	rd_stream.remaining = region[1];
+	rd_stream.seq = 0;
+	return MSG_SUCCESS;
+}
+
+/**
+  * @brief  Send the next frames of the stream in one IN transfer
+  * @retval none
+*/
+static void read_memory_burst(void) {
+	u32 address = rd_stream.address;
+	u32 remaining = rd_stream.remaining;
+	u16 seq = rd_stream.seq;
+	u32 n;
+
+	for (n = 0; n < READ_BURST_FRAMES && remaining; n++) {
+		struct task_struct *frame = &rd_burst[n];
+		u16 len = (remaining < sizeof(frame->data)) ? remaining : sizeof(frame->data);
+
+		frame->msg_error = MSG_SUCCESS;
+		frame->msg_type = MSG_READ_MEMORY;
+		frame->seq = seq++;
+		frame->data_length = len;
+		flash_read(address, frame->data, len);
+		usb_seal(frame);
+		address += len;
+		remaining -= len;
+	}
+	/* Kept for the next call if the endpoint did not take it */
+	if (CDC_Transmit_FS((u8 *)rd_burst, n * sizeof(struct task_struct)) == USBD_OK) {
+		rd_stream.address = address;
+		rd_stream.remaining = remaining;
+		rd_stream.seq = seq;
+	}
+}
+
+static void rx_window_reset(void) {
+	rx_window.expected = 0;
+	rx_window.sack = 0;
+}
+
+static void rx_window_advance(void) {
+	u32 handled;
+	do {
+		rx_window.expected++;
+		handled = rx_window.sack & 1u;
+		rx_window.sack >>= 1;
+	} while (handled);
+}
+
+/* HEX records back to back, one per v1 frame, as many as fit in a v2 frame */
+static err_t hex_records_handler(const u8 *data, u16 len, int data_only) {
+	err_t res;
+
+	while (len) {
+		u16 record = data[INDEX_LEN] + 5;
+		if (record > len || (data_only && data[INDEX_TYPE] != DATA_RECORD)) {
+			return HEX_INVALID;
+		}
+		if (!data_only && (res = hex_line_handler(data, record)) != HEX_SUCCESS) {
+			return res;
+		}
+		data += record;
+		len -= record;
+	}
+	return HEX_SUCCESS;
+}
+
+/* Handle a windowed frame at most once, frames may arrive out of order */
+static u16 rx_window_handle(u16 msg_type, u16 seq, const u8 *data, u16 len) {
+	int16_t delta = (int16_t)(seq - rx_window.expected);
+	err_t res;
+
+	if (delta < 0) {
+		return MSG_SUCCESS; /* retransmission of a frame already written */
+	}
+	if (delta > RX_WINDOW_SIZE) {
+		return MSG_INVALID;
+	}
+	if (delta > 0) {
+		if (rx_window.sack & (1UL << (delta - 1))) {
+			return MSG_SUCCESS;
+		}
+		/* Address records and the compressed stream carry decoder state, keep them in order */
+		if (msg_type == MSG_PROGRAM_LZ || (msg_type == MSG_PROGRAM_DATA && hex_records_handler(data, len, 1) != HEX_SUCCESS)) {
+			return MSG_INVALID;
+		}
+	}
+	if (msg_type == MSG_PROGRAM_LZ) {
+		res = lz_stream_handler(data, len);
+	} else if (msg_type == MSG_WRITE_BLOCK) {
+		res = write_block_handler(data, len);
+	} else {
+		res = hex_records_handler(data, len, 0);
+	}
+	if (res != HEX_SUCCESS) {
+		return MSG_FAILED;
+	}
+	if (delta == 0) {
+		rx_window_advance();
+	} else {
+		rx_window.sack |= 1UL << (delta - 1);
+	}
+	return MSG_SUCCESS;
+}
+
+/* Program frame of either version: the ACK is cumulative in seq, selective in data */
+static void program_response(struct task_struct *response, u16 msg_type, u16 seq, const u8 *data, u16 len) {
+	response->msg_error = rx_window_handle(msg_type, seq, data, len);
+	response->seq = rx_window.expected - 1;
+	memcpy(response->data, &rx_window.sack, sizeof(u32));
+	response->data_length = sizeof(u32);
+}
 
 int usb_handle_packet(struct task_struct *task) {
 	struct task_struct response_task;
 	response_task.msg_error = MSG_SUCCESS;
+	response_task.seq = task->seq;
 	int res;
 
 	if (task->msg_head[0] != 0xFA || task->msg_head[1] != 0xFB || task->msg_tail[0] != 0xFC || task->msg_tail[1] != 0xFD) {
 		response_task.msg_error = MSG_WFORMAT;
 		response_task.data_length = 0;
 		goto full_fill_and_response;
-	} else if (CRC_CalculateCRC16(task->data, task->data_length) != task->crc) {
+	} else if (usb_crc(task) != task->crc) {
 		response_task.msg_error = MSG_WRONG_CRC;
 		response_task.data_length = 0;
 		goto full_fill_and_response;
@@ -36,21 +294,79 @@ int usb_handle_packet(struct task_struct *task) {
 			break;
 
 		case MSG_GOTO_APP:
+			response_task.msg_error = (flash_sync() == HAL_OK) ? MSG_SUCCESS : MSG_FAILED;
+			/* Jumping into erased flash would fault, the bootloader stays instead. The
+			 * jump below also needs the last program or erase to have succeeded: the
+			 * vector table alone says nothing about a half-written image */
+			if (response_task.msg_error == MSG_SUCCESS && !app_is_valid(PROGRAM_ADDRESS)) {
+				response_task.msg_error = MSG_INVALID;
+			}
 			response_task.data_length = 0;
 			break;
 
 		case MSG_PROGRAM_DATA:
-			if (hex_line_handler(task->data, task->data_length) != HEX_SUCCESS) {
-				response_task.msg_error = MSG_FAILED;
+		case MSG_PROGRAM_LZ:
+		case MSG_WRITE_BLOCK:
+			program_response(&response_task, task->msg_type, task->seq, task->data, task->data_length);
+			break;
+
+		case MSG_HELLO:
+			/* u16 protocol version, u16 largest frame, u32 features */
+			{
+				u16 info[2] = { PROTOCOL_VERSION, FRAME_V2_MAX };
+				u32 features = FEATURE_LARGE_FRAME | FEATURE_LZ | FEATURE_READ_MEMORY | FEATURE_ERASE_MAP | FEATURE_WRITE_BLOCK |
+								FEATURE_ERASE_DEFER;
+				memcpy(response_task.data, info, sizeof(info));
+				memcpy(response_task.data + sizeof(info), &features, sizeof(features));
+				response_task.data_length = sizeof(info) + sizeof(features);
 			}
-			response_task.data_length = 0;
 			break;
 
 		case MSG_DEV_ERASE:
-			if (flash_erase(FLASH_SECTOR_5, 3) != HAL_OK) {
-				response_task.msg_error = MSG_FAILED;
+			rd_stream.remaining = 0;
+			flash_stats_reset();
+			response_task.msg_error = erase_sectors(task);
+			rx_window_reset();
+			lz_stream_reset();
+			response_task.data_length = 0;
+			break;
+
+		case MSG_ERASE_STATUS:
+			/* u32 sectors not erased yet, u32 the one being erased, bit n: APP_FIRST_SECTOR + n, u32 sectors erased */
+			{
+				u32 info[3];
+				info[0] = flash_erase_pending(&info[1]) >> APP_FIRST_SECTOR;
+				info[1] >>= APP_FIRST_SECTOR;
+				info[2] = flash_stats.erased;
+				memcpy(response_task.data, info, sizeof(info));
+				response_task.data_length = sizeof(info);
+			}
+			break;
+
+		case MSG_SECTOR_CRC:
+			/* Region base, sector size, then one CRC32 per sector */
+			{
+				u32 info[2 + APP_NUM_SECTORS] = { PROGRAM_ADDRESS, APP_SECTOR_SIZE };
+				response_task.msg_error = (flash_sync() == HAL_OK) ? MSG_SUCCESS : MSG_FAILED;
+				for (u32 i = 0; i < APP_NUM_SECTORS; i++) {
+					info[2 + i] = flash_crc32(PROGRAM_ADDRESS + i * APP_SECTOR_SIZE, APP_SECTOR_SIZE);
+				}
+				memcpy(response_task.data, info, sizeof(info));
+				response_task.data_length = sizeof(info);
 			}
+			break;
+
+		case MSG_VERIFY_IMAGE:
+			response_task.msg_error = verify_image(task, &response_task);
+			break;
+
+		case MSG_READ_MEMORY:
+			response_task.msg_error = read_memory(task);
 			response_task.data_length = 0;
+			/* The data frames are the response */
+			if (response_task.msg_error == MSG_SUCCESS && rd_stream.remaining) {
+				return USBD_OK;
+			}
 			break;
 
 		default:
@@ -60,19 +376,165 @@ int usb_handle_packet(struct task_struct *task) {
 	}
 
 full_fill_and_response:
-	response_task.msg_head[0] = 0xFA;
-	response_task.msg_head[1] = 0xFB;
 	response_task.msg_type = task->msg_type;
-	response_task.crc = CRC_CalculateCRC16(response_task.data, response_task.data_length);
-	response_task.msg_tail[0] = 0xFC;
-	response_task.msg_tail[1] = 0xFD;
+	usb_seal(&response_task);
 	res = usb_response_pkt(&response_task);
-	if (task->msg_type == MSG_GOTO_APP) {
+	if (task->msg_type == MSG_GOTO_APP && response_task.msg_error == MSG_SUCCESS) {
 		goto_application(PROGRAM_ADDRESS);
 	}
 	return res;
 }
 
+/**
+  * @brief  Send a response, if the IN endpoint is still busy the response is kept
+  * and replaces any older waiting one (window ACKs are cumulative)
+  * @param  task: response to send
+  * @retval USBD_OK: sent, USBD_BUSY: queued until usb_flush_response()
+*/
 int usb_response_pkt(struct task_struct *task) {
-	return CDC_Transmit_FS((u8 *)task, sizeof(struct task_struct));
+	if (tx_has_pending || CDC_TxBusy_FS()) {
+		tx_pending = *task;
+		tx_has_pending = 1;
+		return USBD_BUSY;
+	}
+	tx_frame = *task;
+	return CDC_Transmit_FS((u8 *)&tx_frame, sizeof(struct task_struct));
+}
+
+/**
+  * @brief  Send the waiting response once the IN endpoint is free, otherwise
+  * the next burst of a MSG_READ_MEMORY stream
+  * @retval none
+*/
+void usb_flush_response(void) {
+	if (CDC_TxBusy_FS()) {
+		return;
+	}
+	if (tx_has_pending) {
+		tx_frame = tx_pending;
+		tx_has_pending = 0;
+		CDC_Transmit_FS((u8 *)&tx_frame, sizeof(struct task_struct));
+	} else if (rd_stream.remaining) {
+		read_memory_burst();
+	}
+}
+
+/**
+  * @brief  Handle a v2 frame, only the program messages use them
+  * @param  frame: the whole frame, as reassembled
+  * @retval USBD_OK, USBD_BUSY: the response waits for the IN endpoint
+*/
+static int usb_handle_large(const u8 *frame) {
+	struct task_struct response_task;
+	struct frame_head head;
+	u32 words, crc;
+	const u8 *tail;
+
+	memcpy(&head, frame, sizeof(head));
+	words = (head.data_length + 3) / 4;
+	memcpy(&crc, frame + FRAME_HEAD_SIZE + words * 4, sizeof(crc));
+	tail = frame + FRAME_HEAD_SIZE + words * 4 + sizeof(crc);
+	response_task.msg_error = MSG_SUCCESS;
+	response_task.seq = head.seq;
+	response_task.data_length = 0;
+	if (tail[0] != 0xFC || tail[1] != 0xFD) {
+		response_task.msg_error = MSG_WFORMAT;
+	} else if (CRC_CalculateCRC32Mpeg2(frame + FRAME_HEAD_SIZE, words) != crc) {
+		response_task.msg_error = MSG_WRONG_CRC;
+	} else if (head.msg_type == MSG_PROGRAM_DATA || head.msg_type == MSG_PROGRAM_LZ || head.msg_type == MSG_WRITE_BLOCK) {
+		program_response(&response_task, head.msg_type, head.seq, frame + FRAME_HEAD_SIZE, head.data_length);
+	} else {
+		response_task.msg_error = MSG_INVALID;
+	}
+	response_task.msg_type = head.msg_type;
+	usb_seal(&response_task);
+	return usb_response_pkt(&response_task);
+}
+
+void usb_rx_reset(void) {
+	rx.len[0] = 0;
+	rx.len[1] = 0;
+	rx.filled = 0;
+	rx.fill = 0;
+	rx.next = 0;
+	rx.paused = 0;
+}
+
+/**
+  * @brief  A packet arrived on the OUT endpoint, called from CDC_Receive_FS().
+  * v1 frames go to usb_queue right away unless frames wait before them
+  * @param  buf: where it was received, the buffer usb_rx_packet() returned last
+  * or CDC_Resume_FS() was given, anything else drops the frame being put together
+  * @param  len: packet length
+  * @retval where to receive the next packet, NULL: none until usb_rx_poll() frees a slot
+*/
+u8 *usb_rx_packet(u8 *buf, u32 len) {
+	u8 *slot = RX_SLOT(rx.fill);
+	struct frame_head head;
+	u32 size;
+
+	/* Received into a buffer armed before usb_rx_reset(): start over in the slot */
+	if (buf != slot + rx.filled) {
+		rx.filled = 0;
+		return slot;
+	}
+	rx.filled += len;
+	memcpy(&head, slot, sizeof(head));
+	/* Not the start of a frame: drop it, the host sends it again */
+	if (rx.filled < FRAME_HEAD_SIZE || head.msg_head[0] != 0xFA ||
+		(head.msg_head[1] != 0xFB && head.msg_head[1] != FRAME_V2_MARK)) {
+		rx.filled = 0;
+		return slot;
+	}
+	size = (head.msg_head[1] == 0xFB) ? sizeof(struct task_struct) : FRAME_V2_SIZE(head.data_length);
+	if (size > FRAME_V2_MAX) {
+		rx.filled = 0;
+		return slot;
+	}
+	if (rx.filled < size) {
+		return slot + rx.filled;
+	}
+	rx.filled = 0;
+	if (size == sizeof(struct task_struct) && !rx.len[rx.fill ^ 1]) {
+		rx.dropped += (put_task_to_queue(&usb_queue, *(struct task_struct *)slot) < 0);
+		return slot;
+	}
+	rx.len[rx.fill] = size;
+	rx.fill ^= 1;
+	if (rx.len[rx.fill]) {
+		rx.paused = 1;
+		return NULL;
+	}
+	return RX_SLOT(rx.fill);
+}
+
+u32 usb_rx_dropped(void) {
+	return rx.dropped;
+}
+
+/**
+  * @brief  Handle the oldest reassembled frame, once usb_queue is empty: it only
+  * holds frames that arrived before
+  * @retval 1: a frame was handled, 0: none waiting
+*/
+int usb_rx_poll(void) {
+	u8 n = rx.next;
+	u8 *slot = RX_SLOT(n);
+
+	if (!rx.len[n]) {
+		return 0;
+	}
+	if (slot[1] == FRAME_V2_MARK) {
+		usb_handle_large(slot);
+	} else {
+		usb_handle_packet((struct task_struct *)slot);
+	}
+	rx.next ^= 1;
+	rx.len[n] = 0;
+	/* The slot being filled was this one, reception goes on there */
+	if (rx.paused) {
+		rx.paused = 0;
+		CDC_Resume_FS(slot);
+	}
+	return 1;
 }
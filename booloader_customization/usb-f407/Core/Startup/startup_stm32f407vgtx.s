@@ -59,6 +59,19 @@ defined in linker script */
   .type  Reset_Handler, %function
 Reset_Handler:  
   ldr   sp, =_estack     /* set stack pointer */
+
+/* Start the cycle counter: boot time is counted from here, the application
+   reads it from DWT->CYCCNT */
+  ldr r0, =0xE000EDFC    /* CoreDebug->DEMCR */
+  ldr r1, [r0]
+  orr r1, r1, #0x01000000  /* TRCENA */
+  str r1, [r0]
+  ldr r0, =0xE0001000    /* DWT->CTRL, DWT->CYCCNT follows it */
+  movs r1, #0
+  str r1, [r0, #4]
+  ldr r1, [r0]
+  orr r1, r1, #1         /* CYCCNTENA */
+  str r1, [r0]
   
 /* Call the clock system initialization function.*/
   bl  SystemInit  
@@ -93,6 +93,7 @@
 extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 
 /* USER CODE BEGIN EXPORTED_VARIABLES */
+extern uint8_t UserRxBufferFS[APP_RX_DATA_SIZE];
 
 /* USER CODE END EXPORTED_VARIABLES */
 
@@ -108,6 +109,8 @@ extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
 
 /* USER CODE BEGIN EXPORTED_FUNCTIONS */
+uint8_t CDC_TxBusy_FS(void);
+void CDC_Resume_FS(uint8_t *Buf);
 
 /* USER CODE END EXPORTED_FUNCTIONS */
 
@@ -42,7 +42,11 @@
 /* Private variables ---------------------------------------------------------*/
 
 /* USER CODE BEGIN PV */
-
+/* Reset to main() through the bootloader, for the debugger (live expressions):
+   the bootloader starts DWT->CYCCNT in its Reset_Handler, HSI clock until
+   SystemClock_Config() */
+volatile uint32_t boot_cycles;
+volatile uint32_t boot_us;
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -65,7 +69,8 @@ int main(void)
 {
 
   /* USER CODE BEGIN 1 */
-
+  boot_cycles = DWT->CYCCNT;
+  boot_us = boot_cycles / (HSI_VALUE / 1000000U);
   /* USER CODE END 1 */
 
   /* MCU Configuration--------------------------------------------------------*/
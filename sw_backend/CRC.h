@@ -27,8 +27,24 @@ extern "C" {
 #endif
 
 
+/* Engines of the CRC16 calculation, see CRC_SelectCRC16() */
+#define CRC_16_ENGINE_AUTO                  -1
+#define CRC_16_ENGINE_BITWISE               0
+#define CRC_16_ENGINE_TABLE                 1
+#define CRC_16_ENGINE_SLICE8                2
+#define CRC_16_ENGINE_CLMUL                 3
+
+
 void CRC_Init(void);
 
+/**
+ * This function selects how CRC16 is calculated, CRC_16_ENGINE_AUTO picks the fastest
+ * one the configuration and the CPU support
+ *
+ * RETURN VALUE: engine in use
+ */
+int CRC_SelectCRC16(int engine);
+
 /**
  * This function makes a CRC8 calculation on Length data bytes with SAEJ1850 parameters
  *
@@ -43,6 +59,14 @@ uint8_t CRC_CalculateCRC8(const uint8_t *Buffer, uint16_t Length);
  */
 uint16_t CRC_CalculateCRC16(const uint8_t *Buffer, uint16_t Length);
 
+/**
+ * This function continues a CRC16 calculation over Length more data bytes, start with
+ * CRC_16_INIT_VALUE, the XOR value is not applied
+ *
+ * RETURN VALUE: 16 bit CRC so far
+ */
+uint16_t CRC_UpdateCRC16(uint16_t crc, const uint8_t *Buffer, uint32_t Length);
+
 /**
  * This function makes a CRC32 calculation on Length data bytes
  *
@@ -50,6 +74,22 @@ uint16_t CRC_CalculateCRC16(const uint8_t *Buffer, uint16_t Length);
  */
 uint32_t CRC_CalculateCRC32(const uint8_t *Buffer, uint16_t Length);
 
+/**
+ * This function makes a CRC-32/MPEG-2 calculation on Words little endian 32 bit words,
+ * bit-exact with the STM32 CRC unit which it uses when the mode is HARDWARE
+ *
+ * RETURN VALUE: 32 bit result of CRC calculation
+ */
+uint32_t CRC_CalculateCRC32Mpeg2(const uint8_t *Buffer, uint32_t Words);
+
+/**
+ * This function continues a CRC-32/MPEG-2 calculation over Words more words in software,
+ * start with CRC_32_MPEG2_INIT_VALUE
+ *
+ * RETURN VALUE: 32 bit CRC so far
+ */
+uint32_t CRC_UpdateCRC32Mpeg2(uint32_t crc, const uint8_t *Buffer, uint32_t Words);
+
 #ifdef __cplusplus
 }
 #endif
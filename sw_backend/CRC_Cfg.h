@@ -19,6 +19,7 @@
 #define RUNTTIME                            0
 #define TABLE                               1
 #define HARDWARE                            2
+#define SLICING_BY_8                        3   /* 8 tables of 256 entries, PCLMULQDQ on x86 when available */
 
 
 /* ---------- Defines for 8-bit SAE J1850 CRC calculation (Not reflected) ------------------------------------------------------- */
@@ -33,11 +34,16 @@
 #define CRC_16_POLYNOMIAL                   0x1021u
 #define CRC_16_INIT_VALUE                   0xFFFFu
 #define CRC_16_XOR_VALUE                    0x0000u
-#define CRC_16_MODE                         RUNTTIME
+#define CRC_16_MODE                         SLICING_BY_8
 
 /* ---------- Defines for 32-bit CCITT CRC calculation (Reflected) -------------------------------------------------------------- */
 #define CRC_32_RESULT_WIDTH                 32u
 #define CRC_32_POLYNOMIAL                   0x04C11DB7u
 #define CRC_32_INIT_VALUE                   0xFFFFFFFFu
 #define CRC_32_XOR_VALUE                    0xFFFFFFFFu
-#define CRC_32_MODE                         RUNTTIME
\ No newline at end of file
+#define CRC_32_MODE                         RUNTTIME
+
+/* ---------- Defines for 32-bit MPEG-2 CRC over little endian words, what the STM32 CRC unit calculates (Not reflected) -------- */
+#define CRC_32_MPEG2_POLYNOMIAL             0x04C11DB7u
+#define CRC_32_MPEG2_INIT_VALUE             0xFFFFFFFFu
+#define CRC_32_MPEG2_MODE                   TABLE
\ No newline at end of file
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "CRC.h"
+#include "CRC_Cfg.h"
+#include "protocol.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC
+#endif
+
+#define BULK_SIZE   (1u << 20)
+#define FRAME_SIZE  (sizeof(((struct task_struct *)0)->data))
+#define FRAMES      (BULK_SIZE / FRAME_SIZE)
+#define ROUNDS      5
+
+static const char *engine_name[] = { "bitwise (legacy)", "table", "slicing-by-8", "pclmulqdq" };
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t cycles(void)
+{
+#if defined(BENCH_HAVE_TSC)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Best of ROUNDS, returns seconds and *cyc reference cycles */
+static double run(const uint8_t *data, int frames, uint16_t *crc, uint64_t *cyc)
+{
+    double best = 1e9;
+
+    for (int r = 0; r < ROUNDS; r++)
+    {
+        uint64_t c = cycles();
+        double t = now();
+        uint16_t sum = 0;
+
+        if (frames)
+        {
+            /* What every frame costs: the data field of a full frame */
+            for (uint32_t i = 0; i < FRAMES; i++)
+            {
+                sum ^= CRC_CalculateCRC16(data + i * FRAME_SIZE, FRAME_SIZE);
+            }
+        }
+        else
+        {
+            sum = CRC_UpdateCRC16(CRC_16_INIT_VALUE, data, BULK_SIZE);
+        }
+        t = now() - t;
+        c = cycles() - c;
+        *crc = sum;
+        if (t < best)
+        {
+            best = t;
+            *cyc = c;
+        }
+    }
+    return best;
+}
+
+int main(void)
+{
+    uint8_t *data = malloc(BULK_SIZE);
+    uint16_t ref[2] = { 0 };
+    uint32_t seed = 1;
+
+    for (uint32_t i = 0; i < BULK_SIZE; i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        data[i] = (uint8_t)(seed >> 16);
+    }
+    /* CRC-16/CCITT-FALSE check value */
+    if (CRC_CalculateCRC16((const uint8_t *)"123456789", 9) != 0x29B1)
+    {
+        puts("check value mismatch");
+        return -1;
+    }
+#if defined(BENCH_HAVE_TSC)
+    puts("Cycles are TSC reference cycles\n");
+#endif
+    printf("%-18s %14s %10s %14s %10s\n", "CRC16 engine", "1 MB, MB/s", "bytes/cyc", "frames, MB/s", "bytes/cyc");
+    for (int engine = CRC_16_ENGINE_BITWISE; engine <= CRC_16_ENGINE_CLMUL; engine++)
+    {
+        double t[2];
+        uint64_t cyc[2];
+        uint16_t crc[2];
+
+        if (CRC_SelectCRC16(engine) != engine)
+        {
+            continue;
+        }
+        for (int frames = 0; frames < 2; frames++)
+        {
+            t[frames] = run(data, frames, &crc[frames], &cyc[frames]);
+            if (engine == CRC_16_ENGINE_BITWISE)
+            {
+                ref[frames] = crc[frames];
+            }
+            else if (crc[frames] != ref[frames])
+            {
+                printf("%s: CRC mismatch\n", engine_name[engine]);
+                return -1;
+            }
+        }
+        printf("%-18s %14.1f %10.3f %14.1f %10.3f\n", engine_name[engine],
+               BULK_SIZE / t[0] / 1e6, cyc[0] ? (double)BULK_SIZE / cyc[0] : 0.0,
+               FRAMES * FRAME_SIZE / t[1] / 1e6, cyc[1] ? (double)(FRAMES * FRAME_SIZE) / cyc[1] : 0.0);
+    }
+    /* Odd lengths and offsets against the reference */
+    for (uint32_t len = 0; len < 300; len++)
+    {
+        uint16_t want;
+        CRC_SelectCRC16(CRC_16_ENGINE_BITWISE);
+        want = CRC_CalculateCRC16(data + 3 + len, len);
+        for (int engine = CRC_16_ENGINE_TABLE; engine <= CRC_16_ENGINE_CLMUL; engine++)
+        {
+            if (CRC_SelectCRC16(engine) == engine && CRC_CalculateCRC16(data + 3 + len, len) != want)
+            {
+                printf("%s: CRC mismatch at length %u\n", engine_name[engine], len);
+                return -1;
+            }
+        }
+    }
+    free(data);
+    return 0;
+}
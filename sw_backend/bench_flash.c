@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emulator.h"
+#include "flash.h"
+
+/*
+The bootloader's flash.c on the emulator's HAL: DWT->CYCCNT counts the
+emulated busy time, PROGRAM_US per HAL_FLASH_Program() call, the typical
+program time of an F407 at 2.7-3.6 V whatever the width.
+*/
+#define PROGRAM_US      16
+#define BENCH_SECTOR    FLASH_SECTOR_11
+#define BENCH_ADDRESS   0x080E0000UL
+#define BENCH_SIZE      0x8000
+
+struct emu_config emu_cfg = { .program_us = PROGRAM_US };
+struct emu_stats emu_stats;
+
+/* hal_mock.c's __set_MSP() needs it, nothing here starts an application */
+void emu_start_app(u32 vtor, u32 msp)
+{
+    (void)vtor;
+    (void)msp;
+    exit(1);
+}
+
+struct layout {
+    const char *name;
+    u32 record;     /* bytes per HEX record */
+    u32 skew;       /* first address past BENCH_ADDRESS */
+};
+
+static const struct layout layouts[] = {
+    { "16 B records", 16, 0 },
+    { "40 B records", 40, 0 },
+    { "13 B, unaligned", 13, 1 },
+};
+
+/* flash_write() before the staging block: a byte per operation, unlocked and locked around each record */
+static void write_bytes(u32 address, const u8 *data, u32 len)
+{
+    HAL_FLASH_Unlock();
+    for (u32 i = 0; i < len; i++)
+    {
+        HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, address + i, data[i]);
+    }
+    HAL_FLASH_Lock();
+}
+
+/* Returns DWT cycles, -1: the flash does not hold the data afterwards */
+static long long bench(const struct layout *l, const u8 *data, int staged, u64 *ops)
+{
+    u32 len = BENCH_SIZE - l->skew, start;
+
+    flash_erase(BENCH_SECTOR, 1);
+    flash_sync();
+    emu_stats.program_ops = 0;
+    start = DWT->CYCCNT;
+    for (u32 off = 0; off < len; off += l->record)
+    {
+        u32 n = (len - off < l->record) ? len - off : l->record;
+        if (staged)
+        {
+            flash_write(BENCH_ADDRESS + l->skew + off, data + off, n);
+        }
+        else
+        {
+            write_bytes(BENCH_ADDRESS + l->skew + off, data + off, n);
+        }
+    }
+    if (staged)
+    {
+        flash_sync();
+    }
+    *ops = emu_stats.program_ops;
+    if (memcmp((const void *)(BENCH_ADDRESS + l->skew), data, len))
+    {
+        return -1;
+    }
+    return (long long)(u32)(DWT->CYCCNT - start);
+}
+
+int main(void)
+{
+    static u8 data[BENCH_SIZE];
+    int ret = 0;
+
+    srand(1);
+    for (u32 i = 0; i < sizeof(data); i++)
+    {
+        data[i] = rand();
+    }
+    if (emu_flash_map(NULL) < 0)
+    {
+        perror("Error mapping flash");
+        return -1;
+    }
+    printf("Programming %u KB at %u us per operation, %u MHz\n", BENCH_SIZE >> 10, PROGRAM_US, EMU_CPU_MHZ);
+    printf("%-16s %-10s %8s %12s %8s\n", "Layout", "Path", "Ops", "Cycles/KB", "us/KB");
+    for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++)
+    {
+        for (int staged = 0; staged < 2; staged++)
+        {
+            u64 ops;
+            long long cyc = bench(&layouts[i], data, staged, &ops);
+            if (cyc < 0)
+            {
+                printf("%-16s %-10s flash differs from the data\n", layouts[i].name, staged ? "word" : "byte");
+                ret = -1;
+                continue;
+            }
+            printf("%-16s %-10s %8lu %12.0f %8.1f\n", layouts[i].name, staged ? "word" : "byte", ops,
+                   cyc * 1024.0 / BENCH_SIZE, cyc * 1024.0 / BENCH_SIZE / EMU_CPU_MHZ);
+        }
+    }
+    printf("\n");
+    return ret;
+}
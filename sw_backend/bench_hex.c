@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "image.h"
+#include "hex_decode.h"
+
+#define IMAGE_SIZE  (16u << 20)
+#define RECORD_LEN  16
+#define ROUNDS      5
+
+static const char *isa_name[] = { "scalar", "sse2", "avx2" };
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Decoder of the original flasher, one sscanf() per byte */
+static void ascii_2_hex(char *asc_code, unsigned char *hex_code, unsigned int len)
+{
+    size_t idx = 0;
+    for (size_t i = 0; i < len; i += 2)
+    {
+        sscanf(&asc_code[i], "%2hhx", &hex_code[idx]);
+        idx++;
+    }
+}
+
+static int legacy_parse(const char *text, size_t len)
+{
+    char line_rd[110];
+    unsigned char hex[55];
+    size_t lineLength = 0;
+    int bad = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (text[i] == '\n')
+        {
+            unsigned char checksum = 0;
+            line_rd[lineLength - 1] = '\0';
+            ascii_2_hex(line_rd, hex, strlen(line_rd));
+            for (size_t j = 0; j < strlen(line_rd) / 2; j++)
+            {
+                checksum += hex[j];
+            }
+            bad += (checksum != 0);
+            lineLength = 0;
+        }
+        else if (text[i] == ':')
+        {
+            lineLength = 0;
+        }
+        else if (lineLength < sizeof(line_rd) - 1)
+        {
+            line_rd[lineLength++] = text[i];
+        }
+    }
+    return bad;
+}
+
+static char *gen_hex(const uint8_t *data, uint32_t size, uint32_t addr, size_t *len)
+{
+    char *text = malloc((size_t)size * 3 + size / 4 + 64);
+    uint8_t rec[RECORD_LEN + 5];
+    size_t pos = 0;
+
+    for (uint32_t off = 0; off < size; off += RECORD_LEN)
+    {
+        uint32_t a = addr + off;
+        int n;
+        if (off == 0 || (a & 0xFFFF) == 0)
+        {
+            uint8_t upper[2] = { (uint8_t)(a >> 24), (uint8_t)(a >> 16) };
+            n = hex_record(rec, HEX_EXTENDED_LINEAR_ADDR, 0, upper, 2);
+            pos += sprintf(text + pos, ":");
+            for (int i = 0; i < n; i++)
+                pos += sprintf(text + pos, "%02X", rec[i]);
+            pos += sprintf(text + pos, "\r\n");
+        }
+        n = hex_record(rec, HEX_DATA_RECORD, (uint16_t)a, data + off, RECORD_LEN);
+        pos += sprintf(text + pos, ":");
+        for (int i = 0; i < n; i++)
+            pos += sprintf(text + pos, "%02X", rec[i]);
+        pos += sprintf(text + pos, "\r\n");
+    }
+    pos += sprintf(text + pos, ":00000001FF\r\n");
+    *len = pos;
+    return text;
+}
+
+int main(void)
+{
+    uint8_t *data = malloc(IMAGE_SIZE);
+    uint8_t *out = malloc(IMAGE_SIZE + HEX_DECODE_SLACK);
+    char *raw = malloc((size_t)IMAGE_SIZE * 2);
+    uint32_t seed = 1;
+    size_t len;
+    char *text;
+    double t, best;
+
+    for (uint32_t i = 0; i < IMAGE_SIZE; i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        data[i] = (uint8_t)(seed >> 16);
+        sprintf(raw + 2 * i, "%02x", data[i]);
+    }
+    text = gen_hex(data, IMAGE_SIZE, 0x08020000, &len);
+    printf("HEX file: %.1f MB, image: %u MB\n\n", len / 1e6, IMAGE_SIZE >> 20);
+
+    t = now();
+    if (legacy_parse(text, len))
+    {
+        puts("legacy: checksum mismatch");
+    }
+    t = now() - t;
+    printf("%-24s %9.1f MB/s\n", "sscanf (legacy)", len / t / 1e6);
+
+    for (int isa = HEX_ISA_SCALAR; isa <= HEX_ISA_AVX2; isa++)
+    {
+        struct fw_image img;
+        char name[32];
+
+        if (hex_decode_select(isa) != isa)
+        {
+            continue;
+        }
+        best = 1e9;
+        for (int r = 0; r < ROUNDS; r++)
+        {
+            t = now();
+            if (image_from_hex(&img, text, len) < 0)
+            {
+                return -1;
+            }
+            t = now() - t;
+            best = (t < best) ? t : best;
+            if (img.n_seg != 1 || img.size != IMAGE_SIZE || memcmp(img.seg[0].data, data, IMAGE_SIZE))
+            {
+                printf("%s: image mismatch\n", isa_name[isa]);
+                return -1;
+            }
+            image_free(&img);
+        }
+        snprintf(name, sizeof(name), "image_from_hex (%s)", isa_name[isa]);
+        printf("%-24s %9.1f MB/s\n", name, len / best / 1e6);
+
+        best = 1e9;
+        for (int r = 0; r < ROUNDS; r++)
+        {
+            uint8_t sum = 0;
+            t = now();
+            if (hex_decode(out, raw, (size_t)IMAGE_SIZE * 2, &sum) != IMAGE_SIZE)
+            {
+                return -1;
+            }
+            t = now() - t;
+            best = (t < best) ? t : best;
+        }
+        if (memcmp(out, data, IMAGE_SIZE))
+        {
+            printf("%s: decode mismatch\n", isa_name[isa]);
+            return -1;
+        }
+        snprintf(name, sizeof(name), "hex_decode (%s)", isa_name[isa]);
+        printf("%-24s %9.1f MB/s\n", name, IMAGE_SIZE * 2.0 / best / 1e6);
+    }
+    free(text);
+    free(raw);
+    free(out);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "image.h"
+#include "plan.h"
+#include "session.h"
+#include "readback.h"
+#include "CRC.h"
+
+#define EMULATOR        "./stm32_emu"
+#define IMAGE_SIZE      (3 * 0x20000)
+#define ROUND_TRIPS     2000
+/* Erase and program times of an F407 behind a link slower than it programs: where erasing on demand pays */
+#define ERASE_TIMING    "-e", "250", "-p", "16", "-b", "150000"
+/* Program frames and their ACKs the emulator loses and corrupts: the retransmissions have to recover */
+#define LINK_FAULTS     "-d", "97", "-c", "131"
+
+struct transfer {
+    const char *mode;
+    int compress;
+    int records;    /* HEX records rather than binary blocks */
+    int backend;
+    u16 window;
+    u16 frame;      /* 64: v1 frames only */
+    int erase_first;    /* even if the device could erase on demand */
+};
+
+static const struct transfer transfers[] = {
+    { .mode = "hex", .compress = 0, .records = 1, .backend = USB_BACKEND_EPOLL, .window = 1, .frame = 64 },
+    { .mode = "hex", .compress = 0, .records = 1, .backend = USB_BACKEND_EPOLL, .window = 4, .frame = 64 },
+    { .mode = "hex", .compress = 0, .records = 1, .backend = USB_BACKEND_EPOLL, .window = WINDOW_DEFAULT, .frame = 64 },
+    { .mode = "hex", .compress = 0, .records = 1, .backend = USB_BACKEND_URING, .window = WINDOW_DEFAULT, .frame = 64 },
+    { .mode = "block", .compress = 0, .records = 0, .backend = USB_BACKEND_EPOLL, .window = WINDOW_DEFAULT, .frame = 64 },
+    { .mode = "block", .compress = 0, .records = 0, .backend = USB_BACKEND_URING, .window = WINDOW_DEFAULT, .frame = 64 },
+    { .mode = "lz", .compress = 1, .records = 0, .backend = USB_BACKEND_EPOLL, .window = WINDOW_DEFAULT, .frame = 64 },
+    { .mode = "lz", .compress = 1, .records = 0, .backend = USB_BACKEND_URING, .window = WINDOW_DEFAULT, .frame = 64 },
+    { .mode = "hex", .compress = 0, .records = 1, .backend = USB_BACKEND_EPOLL, .window = WINDOW_DEFAULT, .frame = FRAME_V2_MAX },
+    { .mode = "hex", .compress = 0, .records = 1, .backend = USB_BACKEND_URING, .window = WINDOW_DEFAULT, .frame = FRAME_V2_MAX },
+    { .mode = "block", .compress = 0, .records = 0, .backend = USB_BACKEND_EPOLL, .window = 1, .frame = FRAME_V2_MAX },
+    { .mode = "block", .compress = 0, .records = 0, .backend = USB_BACKEND_EPOLL, .window = WINDOW_DEFAULT, .frame = FRAME_V2_MAX },
+    { .mode = "block", .compress = 0, .records = 0, .backend = USB_BACKEND_URING, .window = WINDOW_DEFAULT, .frame = FRAME_V2_MAX },
+    { .mode = "lz", .compress = 1, .records = 0, .backend = USB_BACKEND_EPOLL, .window = WINDOW_DEFAULT, .frame = FRAME_V2_MAX },
+    { .mode = "lz", .compress = 1, .records = 0, .backend = USB_BACKEND_URING, .window = WINDOW_DEFAULT, .frame = FRAME_V2_MAX },
+};
+
+/* Run against an emulator that erases and programs as slowly as the chip */
+static const struct transfer erases[] = {
+    { .mode = "block", .compress = 0, .records = 0, .backend = USB_BACKEND_EPOLL, .window = WINDOW_DEFAULT, .frame = FRAME_V2_MAX, .erase_first = 1 },
+    { .mode = "block", .compress = 0, .records = 0, .backend = USB_BACKEND_EPOLL, .window = WINDOW_DEFAULT, .frame = FRAME_V2_MAX, .erase_first = 0 },
+    { .mode = "lz", .compress = 1, .records = 0, .backend = USB_BACKEND_EPOLL, .window = WINDOW_DEFAULT, .frame = FRAME_V2_MAX, .erase_first = 1 },
+    { .mode = "lz", .compress = 1, .records = 0, .backend = USB_BACKEND_EPOLL, .window = WINDOW_DEFAULT, .frame = FRAME_V2_MAX, .erase_first = 0 },
+};
+
+/* Run against an emulator that loses and corrupts frames: selective resend, go back N */
+static const struct transfer faults[] = {
+    { .mode = "hex", .compress = 0, .records = 1, .backend = USB_BACKEND_EPOLL, .window = WINDOW_DEFAULT, .frame = 64 },
+    { .mode = "block", .compress = 0, .records = 0, .backend = USB_BACKEND_EPOLL, .window = WINDOW_DEFAULT, .frame = FRAME_V2_MAX },
+    { .mode = "block", .compress = 0, .records = 0, .backend = USB_BACKEND_URING, .window = WINDOW_DEFAULT, .frame = FRAME_V2_MAX },
+    { .mode = "lz", .compress = 1, .records = 0, .backend = USB_BACKEND_EPOLL, .window = WINDOW_DEFAULT, .frame = FRAME_V2_MAX },
+};
+
+static int cmp_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Start the emulator on a pty, its first line of output names it */
+static pid_t emulator_start(char *const argv[], char *path, size_t len)
+{
+    int pipefd[2];
+    pid_t pid;
+    FILE *out;
+
+    if (pipe(pipefd) < 0)
+    {
+        return -1;
+    }
+    pid = fork();
+    if (pid == 0)
+    {
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execv(EMULATOR, argv);
+        perror("Error starting " EMULATOR);
+        _exit(127);
+    }
+    close(pipefd[1]);
+    out = fdopen(pipefd[0], "r");
+    if (pid < 0 || !out || !fgets(path, len, out))
+    {
+        return -1;
+    }
+    path[strcspn(path, "\n")] = '\0';
+    fclose(out);
+    return pid;
+}
+
+/* A firmware-like image: a small vocabulary of instruction words with some noise */
+static int image_make(struct fw_image *img)
+{
+    int fd = memfd_create("bench_image", 0);
+    uint32_t seed = 1, vocab[256];
+    uint32_t *data;
+
+    if (fd < 0 || ftruncate(fd, IMAGE_SIZE) < 0)
+    {
+        return -1;
+    }
+    data = mmap(NULL, IMAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        return -1;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        vocab[i] = seed;
+    }
+    for (uint32_t i = 0; i < IMAGE_SIZE / 4; i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        data[i] = ((seed >> 24) < 32) ? seed : vocab[(seed >> 16) & 0xFF];
+    }
+    /* Initial stack pointer and reset handler: MSG_GOTO_APP only starts a valid application */
+    data[0] = 0x20020000;
+    data[1] = IMAGE_BIN_BASE + 0x1C5;
+    munmap(data, IMAGE_SIZE);
+    return image_from_bin(img, fd, IMAGE_BIN_BASE);
+}
+
+static int recv_frame(int fd, struct task_struct *task)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    size_t got = 0;
+
+    while (got < sizeof(*task))
+    {
+        ssize_t ret;
+        if (poll(&pfd, 1, SESSION_TIMEOUT_MS) <= 0)
+        {
+            return -1;
+        }
+        ret = read(fd, (u8 *)task + got, sizeof(*task) - got);
+        if (ret <= 0)
+        {
+            return -1;
+        }
+        got += ret;
+    }
+    return 0;
+}
+
+/* Stop-and-wait MSG_REQUEST_DATA: the round trip through host, link and bootloader */
+static int bench_latency(const char *path, int rounds)
+{
+    struct task_struct send_task, recv_task;
+    int64_t *rtt = calloc(rounds, sizeof(*rtt));
+    int64_t total = 0;
+    struct timespec t0, t1;
+    int fd = open(path, O_RDWR);
+
+    if (fd < 0 || !rtt)
+    {
+        perror("Error: ");
+        return -1;
+    }
+    for (int i = 0; i < rounds; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (usb_request(fd, &send_task, MSG_REQUEST_DATA, 0, NULL, 0) < 0 || recv_frame(fd, &recv_task) < 0 ||
+            usb_err_check(&recv_task) < 0)
+        {
+            printf("Round trip %d failed\n", i);
+            close(fd);
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        rtt[i] = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+        total += rtt[i];
+    }
+    close(fd);
+    qsort(rtt, rounds, sizeof(*rtt), cmp_i64);
+    printf("Round trip (%d x MSG_REQUEST_DATA): min %ld us, p50 %ld us, p99 %ld us, max %ld us, %.0f frames/s\n\n",
+           rounds, rtt[0], rtt[rounds / 2], rtt[rounds * 99 / 100], rtt[rounds - 1], rounds * 1e6 / total);
+    free(rtt);
+    return 0;
+}
+
+/* Rewrite every sector, returns frames per second, -1: failed. retries: of the window, may be NULL */
+static double bench_transfer(const char *path, const struct fw_image *img, const struct transfer *t, u64 *retries)
+{
+    struct session_opts opts = { .full = 1, .compress = t->compress, .records = t->records, .window_size = t->window,
+                                 .frame_size = t->frame, .backend = t->backend, .erase_first = t->erase_first };
+    struct session s;
+    struct plan plan;
+    double sec, fps;
+
+    if (plan_build(&plan, img, t->compress) < 0)
+    {
+        return -1;
+    }
+    session_open(&s, path);
+    if (session_run(&s, 1, &plan, &opts) != 0)
+    {
+        printf("%-6s %-8s %6u %6u  %s\n", t->mode, (t->backend == USB_BACKEND_URING) ? "io_uring" : "epoll", t->window,
+               t->frame, s.status ? s.status : "failed");
+        fps = -1;
+        goto exit;
+    }
+    sec = (s.end - s.start) / 1000.0;
+    fps = (sec > 0) ? s.win.frames / sec : 0;
+    printf("%-6s %-8s %6u %6u %8lu %6lu %9.3f %9.0f %8.1f %8lu %8lu\n", t->mode, (t->backend == USB_BACKEND_URING) ? "io_uring" : "epoll",
+           t->window, t->frame, s.win.frames, s.win.retries, sec, fps, (sec > 0) ? s.written / sec / 1024 : 0,
+           hist_percentile(&s.win.rtt, 50), hist_percentile(&s.win.rtt, 99));
+    if (retries)
+    {
+        *retries = s.win.retries;
+    }
+exit:
+    if (s.fd >= 0)
+    {
+        close(s.fd);
+    }
+    plan_free(&plan);
+    return fps;
+}
+
+/* Stream the image back with one MSG_READ_MEMORY, returns KB/s, -1: failed or not what was written */
+static double bench_readback(const char *path, const struct fw_image *img)
+{
+    u8 *data = malloc(IMAGE_SIZE);
+    double sec, kbps = -1;
+    struct session s;
+    int64_t start;
+
+    if (!data || session_open(&s, path) < 0)
+    {
+        free(data);
+        return -1;
+    }
+    start = usb_now();
+    if (usb_read_memory(s.fd, IMAGE_BIN_BASE, IMAGE_SIZE, data) < 0)
+    {
+        perror("Readback failed");
+    }
+    else if (CRC_CalculateCRC32Mpeg2(data, IMAGE_SIZE / 4) != image_crc32(img, IMAGE_BIN_BASE, IMAGE_SIZE))
+    {
+        puts("Readback differs from the image");
+    }
+    else
+    {
+        sec = (usb_now() - start) / 1000.0;
+        kbps = (sec > 0) ? IMAGE_SIZE / sec / 1024 : 0;
+        printf("\nReading the image back (MSG_READ_MEMORY): %.3f s, %.1f KB/s\n", sec, kbps);
+    }
+    close(s.fd);
+    free(data);
+    return kbps;
+}
+
+/* Erasing up front against erasing on demand, while the image arrives */
+static int bench_erase(const struct fw_image *img)
+{
+    char *emu_argv[] = { EMULATOR, ERASE_TIMING, NULL };
+    char path[256];
+    int ret = 0;
+    pid_t pid;
+
+    pid = emulator_start(emu_argv, path, sizeof(path));
+    if (pid < 0)
+    {
+        perror("Error: ");
+        return -1;
+    }
+    printf("\nRewriting it with flash timing (%s %s %s %s %s %s), erase up front then on demand\n", ERASE_TIMING);
+    for (size_t i = 0; i < sizeof(erases) / sizeof(erases[0]); i++)
+    {
+        if (bench_transfer(path, img, &erases[i], NULL) < 0)
+        {
+            ret = -1;
+        }
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return ret;
+}
+
+/* Every transfer has to go through, and lost frames have to be sent again */
+static int bench_faults(const struct fw_image *img)
+{
+    char *emu_argv[] = { EMULATOR, LINK_FAULTS, NULL };
+    char path[256];
+    int ret = 0;
+    u64 retries;
+    pid_t pid;
+
+    pid = emulator_start(emu_argv, path, sizeof(path));
+    if (pid < 0)
+    {
+        perror("Error: ");
+        return -1;
+    }
+    printf("\nRewriting it over a faulty link (%s %s %s %s)\n", LINK_FAULTS);
+    for (size_t i = 0; i < sizeof(faults) / sizeof(faults[0]); i++)
+    {
+        if (bench_transfer(path, img, &faults[i], &retries) < 0)
+        {
+            ret = -1;
+        }
+        else if (!retries)
+        {
+            puts("No retransmission, the faults were not injected");
+            ret = -1;
+        }
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    char *emu_argv[32] = { EMULATOR };
+    int rounds = ROUND_TRIPS, opt, ret = 0;
+    double min_fps = 0;
+    struct fw_image img;
+    char path[256];
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "n:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        case 'm':
+            min_fps = atof(optarg);
+            break;
+        default:
+            puts("./bench_link [-n round-trips] [-m min-frames-per-s] [-- stm32_emu options]");
+            return -1;
+        }
+    }
+    for (int i = 1; optind < argc && i < 31; i++)
+    {
+        emu_argv[i] = argv[optind++];
+    }
+    if (rounds <= 0 || image_make(&img) < 0)
+    {
+        perror("Error: ");
+        return -1;
+    }
+    pid = emulator_start(emu_argv, path, sizeof(path));
+    if (pid < 0)
+    {
+        perror("Error: ");
+        return -1;
+    }
+    printf("Emulated bootloader on %s\n", path);
+    if (bench_latency(path, rounds) < 0)
+    {
+        ret = -1;
+        goto exit;
+    }
+    printf("Rewriting a %u KB image\n", IMAGE_SIZE >> 10);
+    printf("%-6s %-8s %6s %6s %8s %6s %9s %9s %8s %8s %8s\n", "Mode", "Backend", "Window", "Frame", "Frames", "Retx", "Time (s)", "Frames/s", "KB/s",
+           "p50 us", "p99 us");
+    for (size_t i = 0; i < sizeof(transfers) / sizeof(transfers[0]); i++)
+    {
+        double fps = bench_transfer(path, &img, &transfers[i], NULL);
+        if (fps < 0)
+        {
+            ret = -1;
+        }
+        /* The default configuration guards against regressions */
+        else if (transfers[i].records && transfers[i].backend == USB_BACKEND_EPOLL &&
+                 transfers[i].window == WINDOW_DEFAULT && transfers[i].frame == 64 && fps < min_fps)
+        {
+            printf("%.0f frames/s is below the %.0f required\n", fps, min_fps);
+            ret = -1;
+        }
+    }
+    if (bench_readback(path, &img) < 0)
+    {
+        ret = -1;
+    }
+    ret |= bench_erase(&img);
+    ret |= bench_faults(&img);
+exit:
+    fflush(stdout);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    image_free(&img);
+    return ret;
+}
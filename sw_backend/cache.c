@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "hex_decode.h"
+
+#define CACHE_ALIGN(x)		(((x) + 7) & ~(u64)7)
+
+/* FNV-1a over 64 bit words, the source is only hashed, never trusted by its name */
+static u64 cache_hash(const char *data, size_t len) {
+    u64 hash = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        u64 word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+    for (; i < len; i++) {
+        hash = (hash ^ (u8)data[i]) * 0x100000001b3ULL;
+    }
+    return (hash ^ len) * 0x100000001b3ULL;
+}
+
+/* Directory of the cache files, created on demand */
+static int cache_dir(char *dir, size_t size) {
+    const char *env = getenv(CACHE_ENV);
+    int n;
+
+    if (env && *env) {
+        n = snprintf(dir, size, "%s", env);
+    } else if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+        n = snprintf(dir, size, "%s/" CACHE_DIR, env);
+    } else if ((env = getenv("HOME")) && *env) {
+        n = snprintf(dir, size, "%s/.cache/" CACHE_DIR, env);
+    } else {
+        errno = ENOENT;
+        return -1;
+    }
+    if (n < 0 || (size_t)n >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    for (char *p = dir + 1; ; p++) {
+        if (*p == '/' || !*p) {
+            char c = *p;
+            *p = '\0';
+            if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+                return -1;
+            }
+            *p = c;
+            if (!c) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *data, size_t len, u64 *offset) {
+    const u8 *p = data;
+    static const u8 zero[8];
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+        *offset += n;
+    }
+    /* Keep whatever follows aligned */
+    return (*offset & 7) ? write_all(fd, zero, CACHE_ALIGN(*offset) - *offset, offset) : 0;
+}
+
+/* Header and tables are laid out before anything is written */
+static void cache_layout(struct cache_header *hdr, const struct fw_image *img, const struct plan *plan) {
+    u64 offset = CACHE_ALIGN(sizeof(*hdr));
+
+    hdr->magic = CACHE_MAGIC;
+    hdr->version = CACHE_VERSION;
+    hdr->record_size = sizeof(struct plan_record);
+    hdr->entry = img->entry;
+    hdr->size = img->size;
+    hdr->n_seg = img->n_seg;
+    hdr->n_record = plan->n_record;
+    hdr->n_block = plan->n_block;
+    hdr->n_sector = plan->n_sector;
+    hdr->seg_offset = offset;
+    offset += CACHE_ALIGN((u64)img->n_seg * sizeof(struct cache_segment));
+    hdr->block_offset = offset;
+    offset += CACHE_ALIGN((u64)plan->n_block * sizeof(struct cache_block));
+    hdr->record_offset = offset;
+    offset += CACHE_ALIGN((u64)plan->n_record * sizeof(struct plan_record));
+    hdr->pool_offset = offset;
+    hdr->pool_len = plan->n_block ? (u64)(plan->block[plan->n_block - 1].data + plan->block[plan->n_block - 1].size - plan->pool) : 0;
+    offset += CACHE_ALIGN(hdr->pool_len);
+    for (u32 i = 0; i < img->n_seg; i++) {
+        offset += CACHE_ALIGN(img->seg[i].len);
+    }
+    hdr->file_len = offset;
+    hdr->verify_addr = plan->verify_addr;
+    hdr->verify_len = plan->verify_len;
+    hdr->verify_crc = plan->verify_crc;
+    hdr->sector_base = plan->sector_base;
+    hdr->sector_size = plan->sector_size;
+    hdr->footprint = plan->footprint;
+    memcpy(hdr->sector_crc, plan->sector_crc, sizeof(hdr->sector_crc));
+}
+
+/**
+  * @brief  Store a parsed image and its plan, written to a temporary file first
+  * so a reader never sees half of it
+  * @retval 0: success, -1: failed
+*/
+static int cache_store(const char *dir, const char *file, struct cache_header *hdr,
+                       const struct fw_image *img, const struct plan *plan) {
+    char tmp[PATH_MAX];
+    u64 offset = 0, data_offset;
+    int fd, ret = -1;
+
+    if (snprintf(tmp, sizeof(tmp), "%s/.%s.XXXXXX", dir, strrchr(file, '/') + 1) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        return -1;
+    }
+    cache_layout(hdr, img, plan);
+    if (write_all(fd, hdr, sizeof(*hdr), &offset) < 0) {
+        goto exit;
+    }
+    data_offset = hdr->pool_offset + CACHE_ALIGN(hdr->pool_len);
+    for (u32 i = 0; i < img->n_seg; i++) {
+        struct cache_segment seg = { img->seg[i].addr, img->seg[i].len, data_offset };
+        data_offset += CACHE_ALIGN(seg.len);
+        if (write_all(fd, &seg, sizeof(seg), &offset) < 0) {
+            goto exit;
+        }
+    }
+    for (u32 i = 0; i < plan->n_block; i++) {
+        struct cache_block block = { plan->block[i].addr, plan->block[i].len, plan->block[i].size, 0,
+                                     (u64)(plan->block[i].data - plan->pool) };
+        if (write_all(fd, &block, sizeof(block), &offset) < 0) {
+            goto exit;
+        }
+    }
+    if (write_all(fd, plan->record, (size_t)plan->n_record * sizeof(*plan->record), &offset) < 0 ||
+        write_all(fd, plan->pool, hdr->pool_len, &offset) < 0) {
+        goto exit;
+    }
+    for (u32 i = 0; i < img->n_seg; i++) {
+        if (write_all(fd, img->seg[i].data, img->seg[i].len, &offset) < 0) {
+            goto exit;
+        }
+    }
+    if (offset != hdr->file_len) {
+        errno = EIO;
+        goto exit;
+    }
+    ret = rename(tmp, file);
+exit:
+    close(fd);
+    if (ret < 0) {
+        unlink(tmp);
+    }
+    return ret;
+}
+
+static int cache_range(const struct cache_header *hdr, u64 offset, u64 len) {
+    return offset <= hdr->file_len && len <= hdr->file_len - offset;
+}
+
+/**
+  * @brief  Take the image and plan from a mapped cache file, both point into the mapping
+  * @retval 0: success, -1: the file does not fit the request or is damaged
+*/
+static int cache_map(struct fw_image *img, struct plan *plan, const char *map, size_t map_len,
+                     const struct cache_header *want) {
+    const struct cache_header *hdr = (const struct cache_header *)map;
+    const struct cache_segment *seg;
+    const struct cache_block *block;
+
+    if (map_len < sizeof(*hdr) || hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION ||
+        hdr->hash != want->hash || hdr->source_len != want->source_len || hdr->base != want->base ||
+        hdr->compress != want->compress || hdr->record_size != sizeof(struct plan_record) ||
+        hdr->file_len != map_len || hdr->n_sector > PLAN_SECTORS ||
+        !cache_range(hdr, hdr->seg_offset, (u64)hdr->n_seg * sizeof(*seg)) ||
+        !cache_range(hdr, hdr->block_offset, (u64)hdr->n_block * sizeof(*block)) ||
+        !cache_range(hdr, hdr->record_offset, (u64)hdr->n_record * sizeof(struct plan_record)) ||
+        !cache_range(hdr, hdr->pool_offset, hdr->pool_len)) {
+        errno = EINVAL;
+        return -1;
+    }
+    seg = (const struct cache_segment *)(map + hdr->seg_offset);
+    block = (const struct cache_block *)(map + hdr->block_offset);
+    img->seg = (struct fw_segment *)calloc(hdr->n_seg + 1, sizeof(*img->seg));
+    plan->block = (struct plan_block *)calloc(hdr->n_block + 1, sizeof(*plan->block));
+    if (!img->seg || !plan->block) {
+        return -1;
+    }
+    for (u32 i = 0; i < hdr->n_seg; i++) {
+        if (!cache_range(hdr, seg[i].offset, seg[i].len)) {
+            errno = EINVAL;
+            return -1;
+        }
+        img->seg[i].addr = seg[i].addr;
+        img->seg[i].len = seg[i].len;
+        img->seg[i].data = (const u8 *)map + seg[i].offset;
+    }
+    for (u32 i = 0; i < hdr->n_block; i++) {
+        if (block[i].offset > hdr->pool_len || block[i].size > hdr->pool_len - block[i].offset) {
+            errno = EINVAL;
+            return -1;
+        }
+        plan->block[i].addr = block[i].addr;
+        plan->block[i].len = block[i].len;
+        plan->block[i].size = block[i].size;
+        plan->block[i].data = (const u8 *)map + hdr->pool_offset + block[i].offset;
+    }
+    img->n_seg = hdr->n_seg;
+    img->entry = hdr->entry;
+    img->size = hdr->size;
+    plan->img = img;
+    plan->borrowed = 1;
+    plan->record = (struct plan_record *)(map + hdr->record_offset);
+    plan->n_record = hdr->n_record;
+    plan->n_block = hdr->n_block;
+    plan->pool = (u8 *)(map + hdr->pool_offset);
+    plan->pool_len = hdr->pool_len;
+    plan->verify_addr = hdr->verify_addr;
+    plan->verify_len = hdr->verify_len;
+    plan->verify_crc = hdr->verify_crc;
+    plan->sector_base = hdr->sector_base;
+    plan->sector_size = hdr->sector_size;
+    plan->n_sector = hdr->n_sector;
+    plan->footprint = hdr->footprint;
+    memcpy(plan->sector_crc, hdr->sector_crc, sizeof(plan->sector_crc));
+    return 0;
+}
+
+/**
+  * @brief  Load a firmware file and build its plan, or map both from the cache when
+  * a file with the same content was seen before: no parsing, merging, compressing or CRCs
+  * @param  name: file name, only used to recognize raw binaries
+  * @param  base: load address of raw binaries
+  * @param  compress: 0: HEX records, 1: compressed blocks
+  * @retval 1: from the cache, 0: parsed (and stored when possible), -1: failed
+*/
+int cache_load(struct fw_image *img, struct plan *plan, int fd, const char *name, u32 base, int compress) {
+    struct cache_header want;
+    char dir[PATH_MAX], file[PATH_MAX];
+    const char *source, *map;
+    size_t source_len, map_len;
+    int cache_fd, ret;
+
+    memset(&want, 0, sizeof(want));
+    source = file_map(fd, &source_len);
+    if (!source || cache_dir(dir, sizeof(dir)) < 0) {
+        file_unmap(source, source_len);
+        goto parse;
+    }
+    want.hash = cache_hash(source, source_len);
+    want.source_len = source_len;
+    want.base = base;
+    want.compress = compress;
+    file_unmap(source, source_len);
+    if (snprintf(file, sizeof(file), "%s/%016llx-%08x-%s", dir, (unsigned long long)want.hash, base,
+                 compress ? "lz" : "hex") >= (int)sizeof(file)) {
+        goto parse;
+    }
+    cache_fd = open(file, O_RDONLY);
+    if (cache_fd >= 0) {
+        map = file_map(cache_fd, &map_len);
+        close(cache_fd);
+        memset(img, 0, sizeof(*img));
+        memset(plan, 0, sizeof(*plan));
+        if (map && cache_map(img, plan, map, map_len, &want) == 0) {
+            img->map = map;
+            img->map_len = map_len;
+            return 1;
+        }
+        free(img->seg);
+        free(plan->block);
+        file_unmap(map, map_len);
+    }
+    if (image_load(img, fd, name, base) < 0) {
+        return -1;
+    }
+    if (plan_build(plan, img, compress) < 0) {
+        image_free(img);
+        return -1;
+    }
+    /* A damaged or stale entry is simply replaced, failing to store costs nothing */
+    cache_store(dir, file, &want, img, plan);
+    return 0;
+parse:
+    if (image_load(img, fd, name, base) < 0) {
+        return -1;
+    }
+    ret = plan_build(plan, img, compress);
+    if (ret < 0) {
+        image_free(img);
+    }
+    return ret;
+}
@@ -0,0 +1,58 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+#include "image.h"
+#include "plan.h"
+
+/* Parsed images and their plans, stored by content so any change of the source misses */
+#define CACHE_MAGIC			0x48435453	/* "STCH" */
+#define CACHE_VERSION		2
+#define CACHE_DIR			"stm32_flash"	/* below $XDG_CACHE_HOME or ~/.cache */
+#define CACHE_ENV			"STM32_IMAGE_CACHE"	/* overrides the directory */
+
+/* Layout of a cache file: header, segments, blocks, records, then the data, all 8 byte aligned */
+struct cache_header {
+	u32 magic;
+	u32 version;
+	u64 hash;			/* of the source file */
+	u64 source_len;
+	u32 base;			/* load address of a .bin file */
+	u32 compress;
+	u64 file_len;
+	u32 record_size;	/* sizeof(struct plan_record) of the writer */
+	u32 entry;
+	u64 size;
+	u32 n_seg;
+	u32 n_record;
+	u32 n_block;
+	u32 n_sector;
+	u64 seg_offset;
+	u64 block_offset;
+	u64 record_offset;
+	u64 pool_offset;
+	u64 pool_len;
+	u32 verify_addr;
+	u32 verify_len;
+	u32 verify_crc;
+	u32 sector_base;
+	u32 sector_size;
+	u32 footprint;
+	u32 sector_crc[PLAN_SECTORS];
+};
+
+struct cache_segment {
+	u32 addr;
+	u32 len;
+	u64 offset;			/* of the data from the start of the file */
+};
+
+struct cache_block {
+	u32 addr;
+	u32 len;
+	u32 size;
+	u32 reserved;
+	u64 offset;			/* of the data within the pool */
+};
+
+int cache_load(struct fw_image *img, struct plan *plan, int fd, const char *name, u32 base, int compress);
+
+#endif
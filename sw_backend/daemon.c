@@ -0,0 +1,793 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+#include "daemon.h"
+#include "cache.h"
+
+/* One thread: hotplug, clients and every running job share one event loop */
+static struct {
+    struct usb_loop loop;
+    const char *socket_path;
+    struct usb_watch listen_watch;
+    struct usb_watch uevent_watch;
+    struct usb_watch signal_watch;
+    struct daemon_device device[DAEMON_DEVICES];
+    struct daemon_client client[DAEMON_CLIENTS];
+    struct daemon_image image[DAEMON_IMAGES];
+    u64 clock;          /* orders waiting clients and image use */
+    int verbose;
+} flashd;
+
+static void client_reply(struct daemon_client *c, const char *fmt, ...) {
+    va_list ap;
+
+    if (c->gone) {
+        return;
+    }
+    va_start(ap, fmt);
+    vdprintf(c->fd, fmt, ap);
+    va_end(ap);
+}
+
+static void image_release(struct daemon_image *image) {
+    for (int i = 0; i < 2; i++) {
+        if (image->has_plan[i]) {
+            plan_free(&image->plan[i]);
+        }
+    }
+    image_free(&image->img);
+    memset(image, 0, sizeof(*image));
+}
+
+static void image_put(struct daemon_image *image) {
+    if (image && --image->refs == 0 && image->stale) {
+        image_release(image);
+    }
+}
+
+/**
+  * @brief  A parsed image, from memory while the file is unchanged
+  * @param  base: load address of a .bin file
+  * @retval the image, one more reference held, NULL: failed (errno)
+*/
+static struct daemon_image *image_get(const char *path, u32 base) {
+    struct daemon_image *image = NULL, *lru = NULL;
+    struct stat st;
+    int fd, ret;
+
+    if (strlen(path) >= sizeof(image->path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    if (stat(path, &st) < 0) {
+        return NULL;
+    }
+    for (int i = 0; i < DAEMON_IMAGES; i++) {
+        struct daemon_image *it = &flashd.image[i];
+        if (!it->used || it->stale || it->base != base || strcmp(it->path, path)) {
+            continue;
+        }
+        if (it->dev == st.st_dev && it->ino == st.st_ino && it->size == st.st_size &&
+            it->mtime.tv_sec == st.st_mtim.tv_sec && it->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            image = it;
+            break;
+        }
+        /* Rewritten since: jobs still running keep the old one */
+        it->stale = 1;
+        if (!it->refs) {
+            image_release(it);
+        }
+    }
+    for (int i = 0; !image && i < DAEMON_IMAGES; i++) {
+        struct daemon_image *it = &flashd.image[i];
+        if (!it->used) {
+            lru = it;
+            break;
+        }
+        if (!it->refs && (!lru || it->last_use < lru->last_use)) {
+            lru = it;
+        }
+    }
+    if (!image) {
+        if (!lru) {
+            errno = EBUSY;
+            return NULL;
+        }
+        if (lru->used) {
+            image_release(lru);
+        }
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return NULL;
+        }
+        ret = (fstat(fd, &st) < 0) ? -1 : cache_load(&lru->img, &lru->plan[0], fd, path, base, 0);
+        close(fd);
+        if (ret < 0) {
+            memset(lru, 0, sizeof(*lru));
+            return NULL;
+        }
+        image = lru;
+        strcpy(image->path, path);
+        image->base = base;
+        image->dev = st.st_dev;
+        image->ino = st.st_ino;
+        image->size = st.st_size;
+        image->mtime = st.st_mtim;
+        image->used = 1;
+        /* The HEX records come with the image, from the on-disk cache when possible */
+        image->has_plan[0] = 1;
+        if (flashd.verbose) {
+            fprintf(stderr, "%s %s: %lu bytes in %u segment(s)\n", ret ? "mapped" : "parsed", path,
+                    image->img.size, image->img.n_seg);
+        }
+    }
+    image->refs++;
+    image->last_use = ++flashd.clock;
+    return image;
+}
+
+/* Records or compressed blocks, built once per image */
+static const struct plan *image_plan(struct daemon_image *image, int compress) {
+    if (!image->has_plan[compress]) {
+        if (plan_build(&image->plan[compress], &image->img, compress) < 0) {
+            return NULL;
+        }
+        image->has_plan[compress] = 1;
+    }
+    return &image->plan[compress];
+}
+
+static void client_free(struct daemon_client *c) {
+    usb_watch_remove(&c->watch);
+    if (!c->gone) {
+        close(c->fd);
+    }
+    image_put(c->image);
+    memset(c, 0, sizeof(*c));
+}
+
+/* Every job of the request ended: the last line of the reply */
+static void client_finish(struct daemon_client *c) {
+    if (c->n_job) {
+        client_reply(c, "done %d/%d failed\n", c->failed, c->n_job);
+    }
+    client_free(c);
+}
+
+static void job_end(struct daemon_device *d, int failed) {
+    struct daemon_client *c = d->client;
+
+    if (d->s.fd >= 0) {
+        close(d->s.fd);
+        d->s.fd = -1;
+    }
+    d->job = JOB_NONE;
+    d->client = NULL;
+    c->failed += failed;
+    if (--c->pending == 0 && !c->waiting) {
+        client_finish(c);
+    }
+}
+
+static void flash_done(struct session *s) {
+    struct daemon_device *d = s->ctx;
+    double sec = (s->end > s->start) ? (s->end - s->start) / 1000.0 : 0.0;
+
+    client_reply(d->client, "%s %s %s, %lu frames, %lu retx, %lu nacks, p50 %lu us, p99 %lu us, %.3f s\n",
+                 (s->state == SESSION_FAILED) ? "failed" : "ok", d->path, s->status ? s->status : "-",
+                 s->win.frames, s->win.retries, s->win.nacks, hist_percentile(&s->win.rtt, 50),
+                 hist_percentile(&s->win.rtt, 99), sec);
+    job_end(d, s->state == SESSION_FAILED);
+}
+
+static void job_flash(struct daemon_client *c, struct daemon_device *d) {
+    const struct plan *plan = image_plan(c->image, c->opts.compress);
+
+    d->job = JOB_FLASH;
+    d->client = c;
+    c->pending++;
+    c->n_job++;
+    if (d->plugged) {
+        client_reply(c, "start %s %ld ms after hotplug\n", d->path, usb_now() - d->plugged);
+    } else {
+        client_reply(c, "start %s\n", d->path);
+    }
+    session_open(&d->s, d->path);
+    d->s.on_done = flash_done;
+    d->s.ctx = d;
+    if (!plan && d->s.state != SESSION_FAILED) {
+        d->s.state = SESSION_FAILED;
+        d->s.status = strerror(errno);
+    }
+    if (d->s.state == SESSION_FAILED) {
+        flash_done(&d->s);
+        return;
+    }
+    session_attach(&d->s, &flashd.loop, plan, &c->opts);
+}
+
+static void sample_recv(struct usb_link *link, struct task_struct *recv) {
+    struct daemon_device *d = link->ctx;
+    u16 value;
+
+    /* Late responses to an earlier job */
+    if (recv->msg_type != MSG_REQUEST_DATA) {
+        return;
+    }
+    usb_link_remove(link);
+    if (usb_err_check(recv) < 0 || recv->data_length != sizeof(u16)) {
+        client_reply(d->client, "failed %s bad response\n", d->path);
+        job_end(d, 1);
+        return;
+    }
+    memcpy(&value, recv->data, sizeof(u16));
+    client_reply(d->client, "sample %s %u\n", d->path, value);
+    job_end(d, 0);
+}
+
+static void sample_timeout(struct usb_link *link) {
+    struct daemon_device *d = link->ctx;
+
+    usb_link_remove(link);
+    client_reply(d->client, "failed %s timed out\n", d->path);
+    job_end(d, 1);
+}
+
+static void sample_error(struct usb_link *link, const char *status) {
+    struct daemon_device *d = link->ctx;
+
+    client_reply(d->client, "failed %s %s\n", d->path, status);
+    job_end(d, 1);
+}
+
+static const struct usb_link_ops sample_ops = {
+    .recv = sample_recv,
+    .timeout = sample_timeout,
+    .error = sample_error,
+};
+
+/* One MSG_REQUEST_DATA round trip */
+static void job_sample(struct daemon_client *c, struct daemon_device *d) {
+    d->job = JOB_SAMPLE;
+    d->client = c;
+    c->pending++;
+    c->n_job++;
+    if (session_open(&d->s, d->path) < 0) {
+        client_reply(c, "failed %s %s\n", d->path, d->s.status);
+        job_end(d, 1);
+        return;
+    }
+    if (usb_link_add(&flashd.loop, &d->s.link, d->s.fd, &sample_ops, d) < 0 ||
+        (usb_link_send(&d->s.link, MSG_REQUEST_DATA, 0, NULL, 0) < 0 && errno != EAGAIN)) {
+        usb_link_remove(&d->s.link);
+        client_reply(c, "failed %s %s\n", d->path, strerror(errno));
+        job_end(d, 1);
+        return;
+    }
+    usb_link_expire(&d->s.link, SESSION_TIMEOUT_MS);
+}
+
+static struct daemon_device *device_find(const char *path) {
+    for (int i = 0; i < DAEMON_DEVICES; i++) {
+        if (flashd.device[i].path[0] && !strcmp(flashd.device[i].path, path)) {
+            return &flashd.device[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+  * @brief  A device showed up, the oldest client waiting for one gets it right away
+  * @param  plugged: usb_now() of the hotplug event, 0: added by a client
+  * @retval the device, NULL: no room
+*/
+static struct daemon_device *device_plug(const char *path, int64_t plugged) {
+    struct daemon_device *d = device_find(path);
+    struct daemon_client *next = NULL;
+
+    for (int i = 0; !d && i < DAEMON_DEVICES; i++) {
+        if (!flashd.device[i].path[0] || (!flashd.device[i].present && flashd.device[i].job == JOB_NONE)) {
+            d = &flashd.device[i];
+            memset(d, 0, sizeof(*d));
+            d->s.fd = -1;
+            snprintf(d->path, sizeof(d->path), "%s", path);
+        }
+    }
+    if (!d) {
+        return NULL;
+    }
+    d->present = 1;
+    d->plugged = plugged;
+    if (flashd.verbose) {
+        fprintf(stderr, "%s plugged in\n", path);
+    }
+    if (d->job != JOB_NONE) {
+        return d;
+    }
+    for (int i = 0; i < DAEMON_CLIENTS; i++) {
+        struct daemon_client *c = &flashd.client[i];
+        if (c->used && c->waiting && (!next || c->order < next->order)) {
+            next = c;
+        }
+    }
+    if (next) {
+        next->waiting = 0;
+        job_flash(next, d);
+    }
+    return d;
+}
+
+static void device_unplug(const char *path) {
+    struct daemon_device *d = device_find(path);
+
+    if (d) {
+        /* A running job fails on its own once the driver reports the disconnect */
+        d->present = 0;
+        if (flashd.verbose) {
+            fprintf(stderr, "%s removed\n", path);
+        }
+    }
+}
+
+/* Whether the sysfs device is an interface of the bootloader */
+static int device_matches(const char *sysdir) {
+    char path[PATH_MAX], uevent[1024], product[32];
+    int fd = -1;
+    ssize_t len;
+
+    snprintf(product, sizeof(product), "PRODUCT=%x/%x/", DAEMON_VENDOR_ID, DAEMON_PRODUCT_ID);
+    if (snprintf(path, sizeof(path), "%s/device/uevent", sysdir) < (int)sizeof(path)) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        return 0;
+    }
+    len = read(fd, uevent, sizeof(uevent) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    uevent[len] = '\0';
+    return strstr(uevent, product) != NULL;
+}
+
+/* Boards plugged in before the daemon started */
+static void device_scan(void) {
+    DIR *dir = opendir("/sys/class/usbmisc");
+    struct dirent *ent;
+    char sysdir[PATH_MAX], path[PATH_MAX];
+
+    while (dir && (ent = readdir(dir))) {
+        if (strncmp(ent->d_name, "stm32-", 6)) {
+            continue;
+        }
+        snprintf(sysdir, sizeof(sysdir), "/sys/class/usbmisc/%s", ent->d_name);
+        snprintf(path, sizeof(path), "/dev/%s", ent->d_name);
+        if (device_matches(sysdir)) {
+            device_plug(path, 0);
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+}
+
+/* Kernel uevents: the device node exists before udev even sees the event */
+static void uevent_ready(struct usb_watch *watch) {
+    char buf[DAEMON_UEVENT], sysdir[PATH_MAX], path[PATH_MAX];
+    struct sockaddr_nl from;
+    socklen_t from_len;
+    ssize_t len;
+
+    for (;;) {
+        const char *action = NULL, *subsystem = NULL, *devname = NULL, *devpath = NULL;
+
+        from_len = sizeof(from);
+        len = recvfrom(watch->fd, buf, sizeof(buf) - 1, MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+        if (len <= 0) {
+            return;
+        }
+        /* Only the kernel, nobody else may fake a device */
+        if (from.nl_pid != 0) {
+            continue;
+        }
+        buf[len] = '\0';
+        /* "action@devpath" then NUL separated KEY=value */
+        for (char *p = buf + strlen(buf) + 1; p < buf + len; p += strlen(p) + 1) {
+            if (!strncmp(p, "ACTION=", 7)) {
+                action = p + 7;
+            } else if (!strncmp(p, "SUBSYSTEM=", 10)) {
+                subsystem = p + 10;
+            } else if (!strncmp(p, "DEVNAME=", 8)) {
+                devname = p + 8;
+            } else if (!strncmp(p, "DEVPATH=", 8)) {
+                devpath = p + 8;
+            }
+        }
+        if (!action || !subsystem || !devname || !devpath || strcmp(subsystem, "usbmisc") ||
+            strncmp(devname, "stm32-", 6)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/dev/%s", devname);
+        snprintf(sysdir, sizeof(sysdir), "/sys%s", devpath);
+        if (!strcmp(action, "add") && device_matches(sysdir)) {
+            device_plug(path, usb_now());
+        } else if (!strcmp(action, "remove")) {
+            device_unplug(path);
+        }
+    }
+}
+
+static int uevent_open(void) {
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* A device named by a request, one without hotplug (emulator, socket) is added if it exists */
+static struct daemon_device *device_known(struct daemon_client *c, const char *path) {
+    struct daemon_device *d = device_find(path);
+
+    if (!d && access(path, F_OK) < 0) {
+        client_reply(c, "error %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    d = d ? d : device_plug(path, 0);
+    if (!d) {
+        client_reply(c, "error no room for %s\n", path);
+    }
+    return d;
+}
+
+/**
+  * @brief  flash [-f] [-z] [-H] [-E] [-w window-size] [-F frame-size] [-b bin-base-address] <device|next|all> <hex|bin|elf-file>
+  * "next" waits for the next board plugged in, "all" takes every idle one
+*/
+static void request_flash(struct daemon_client *c, int argc, char *argv[]) {
+    struct daemon_device *d;
+    u32 base = IMAGE_BIN_BASE;
+    int i;
+
+    c->opts.window_size = WINDOW_DEFAULT;
+    c->opts.backend = USB_BACKEND_EPOLL;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-f")) {
+            c->opts.full = 1;
+        } else if (!strcmp(argv[i], "-z")) {
+            c->opts.compress = 1;
+        } else if (!strcmp(argv[i], "-H")) {
+            c->opts.records = 1;
+        } else if (!strcmp(argv[i], "-E")) {
+            c->opts.erase_first = 1;
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            c->opts.window_size = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-F") && i + 1 < argc) {
+            c->opts.frame_size = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+            base = strtoul(argv[++i], NULL, 0);
+        } else {
+            break;
+        }
+    }
+    if (argc - i != 2) {
+        client_reply(c, "error usage: flash [-f] [-z] [-H] [-E] [-w window-size] [-F frame-size] [-b bin-base-address] <device|next|all> <file>\n");
+        return;
+    }
+    /* Parsed and planned now, a board plugged in later starts without waiting for it */
+    c->image = image_get(argv[i + 1], base);
+    if (!c->image || !image_plan(c->image, c->opts.compress)) {
+        client_reply(c, "error %s: %s\n", argv[i + 1], strerror(errno));
+        return;
+    }
+    if (!strcmp(argv[i], "next")) {
+        c->waiting = 1;
+        c->order = ++flashd.clock;
+        client_reply(c, "waiting\n");
+        return;
+    }
+    if (!strcmp(argv[i], "all")) {
+        for (int n = 0; n < DAEMON_DEVICES; n++) {
+            d = &flashd.device[n];
+            if (d->present && d->job == JOB_NONE) {
+                job_flash(c, d);
+            }
+        }
+        if (!c->n_job) {
+            client_reply(c, "error no idle device\n");
+        }
+    } else {
+        d = device_known(c, argv[i]);
+        if (!d) {
+            return;
+        }
+        if (d->job != JOB_NONE) {
+            client_reply(c, "error %s busy\n", argv[i]);
+        } else {
+            job_flash(c, d);
+        }
+    }
+}
+
+/* sample <device|any>: the bootloader's MSG_REQUEST_DATA value */
+static void request_sample(struct daemon_client *c, int argc, char *argv[]) {
+    struct daemon_device *d = NULL;
+
+    if (argc != 2) {
+        client_reply(c, "error usage: sample <device|any>\n");
+        return;
+    }
+    if (!strcmp(argv[1], "any")) {
+        for (int i = 0; !d && i < DAEMON_DEVICES; i++) {
+            if (flashd.device[i].present && flashd.device[i].job == JOB_NONE) {
+                d = &flashd.device[i];
+            }
+        }
+        if (!d) {
+            client_reply(c, "error no idle device\n");
+            return;
+        }
+    } else {
+        d = device_known(c, argv[1]);
+        if (!d) {
+            return;
+        }
+    }
+    if (d->job != JOB_NONE) {
+        client_reply(c, "error %s busy\n", argv[1]);
+        return;
+    }
+    job_sample(c, d);
+}
+
+static void request_list(struct daemon_client *c) {
+    static const char *job_name[] = { "idle", "flashing", "sampling" };
+
+    for (int i = 0; i < DAEMON_DEVICES; i++) {
+        struct daemon_device *d = &flashd.device[i];
+        if (d->path[0] && (d->present || d->job != JOB_NONE)) {
+            client_reply(c, "device %s %s\n", d->path, job_name[d->job]);
+        }
+    }
+    for (int i = 0; i < DAEMON_IMAGES; i++) {
+        struct daemon_image *image = &flashd.image[i];
+        if (image->used && !image->stale) {
+            client_reply(c, "image %s %lu bytes, %d job(s)\n", image->path, image->img.size, image->refs);
+        }
+    }
+}
+
+static void client_request(struct daemon_client *c, char *line) {
+    char *argv[16], *save = NULL;
+    int argc = 0;
+
+    for (char *tok = strtok_r(line, " \t\r", &save); tok && argc < 16; tok = strtok_r(NULL, " \t\r", &save)) {
+        argv[argc++] = tok;
+    }
+    if (!argc) {
+        client_reply(c, "error empty request\n");
+    } else if (!strcmp(argv[0], "flash")) {
+        request_flash(c, argc, argv);
+    } else if (!strcmp(argv[0], "sample")) {
+        request_sample(c, argc, argv);
+    } else if (!strcmp(argv[0], "list")) {
+        request_list(c);
+    } else if (!strcmp(argv[0], "add") && argc == 2) {
+        /* Devices without hotplug: emulators, sockets */
+        client_reply(c, device_plug(argv[1], 0) ? "ok\n" : "error no room\n");
+    } else if (!strcmp(argv[0], "remove") && argc == 2) {
+        device_unplug(argv[1]);
+        client_reply(c, "ok\n");
+    } else {
+        client_reply(c, "error unknown request %s\n", argv[0]);
+    }
+}
+
+static void client_ready(struct usb_watch *watch) {
+    struct daemon_client *c = watch->ctx;
+    char discard[64], *nl;
+    ssize_t len;
+
+    if (c->handled) {
+        len = read(c->fd, discard, sizeof(discard));
+    } else {
+        len = read(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len);
+    }
+    if (len < 0 && errno == EAGAIN) {
+        return;
+    }
+    if (len <= 0) {
+        /* Hung up: a waiting request is dropped, running jobs still finish */
+        if (c->pending) {
+            usb_watch_remove(&c->watch);
+            close(c->fd);
+            c->gone = 1;
+        } else {
+            client_free(c);
+        }
+        return;
+    }
+    if (c->handled) {
+        return;
+    }
+    c->len += len;
+    c->line[c->len] = '\0';
+    nl = strchr(c->line, '\n');
+    if (!nl && c->len < sizeof(c->line) - 1) {
+        return;
+    }
+    if (nl) {
+        *nl = '\0';
+    }
+    c->handled = 1;
+    /* Held until every job started, one failing at once must not end the request */
+    c->pending++;
+    client_request(c, c->line);
+    if (--c->pending == 0 && !c->waiting) {
+        client_finish(c);
+    }
+}
+
+static void listen_ready(struct usb_watch *watch) {
+    int fd = accept4(watch->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0) {
+        return;
+    }
+    for (int i = 0; i < DAEMON_CLIENTS; i++) {
+        struct daemon_client *c = &flashd.client[i];
+        if (c->used) {
+            continue;
+        }
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        c->used = 1;
+        if (usb_watch_add(&flashd.loop, &c->watch, fd, client_ready, c) < 0) {
+            close(fd);
+            c->used = 0;
+        }
+        return;
+    }
+    dprintf(fd, "error too many clients\n");
+    close(fd);
+}
+
+static int listen_open(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, DAEMON_CLIENTS) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* SIGINT, SIGTERM: no new requests, the loop ends once running jobs did */
+static void signal_ready(struct usb_watch *watch) {
+    struct signalfd_siginfo info;
+
+    if (read(watch->fd, &info, sizeof(info)) != sizeof(info)) {
+        return;
+    }
+    usb_watch_remove(&flashd.listen_watch);
+    usb_watch_remove(&flashd.uevent_watch);
+    usb_watch_remove(&flashd.signal_watch);
+    unlink(flashd.socket_path);
+    for (int i = 0; i < DAEMON_CLIENTS; i++) {
+        struct daemon_client *c = &flashd.client[i];
+        if (c->used && !c->pending) {
+            client_reply(c, "error shutting down\n");
+            client_free(c);
+        } else if (c->used) {
+            usb_watch_remove(&c->watch);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *static_dev[DAEMON_DEVICES];
+    int n_static = 0, opt, fd;
+    sigset_t mask;
+
+    flashd.socket_path = DAEMON_SOCKET;
+    while ((opt = getopt(argc, argv, "s:d:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            flashd.socket_path = optarg;
+            break;
+        case 'd':
+            if (n_static < DAEMON_DEVICES)
+            {
+                static_dev[n_static++] = optarg;
+            }
+            break;
+        case 'v':
+            flashd.verbose = 1;
+            break;
+        default:
+            puts("./stm32_flashd [-s socket-path] [-d device-without-hotplug]... [-v]");
+            return -1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    if (usb_loop_init(&flashd.loop, USB_BACKEND_EPOLL) < 0)
+    {
+        perror("Error: ");
+        return -1;
+    }
+    fd = listen_open(flashd.socket_path);
+    if (fd < 0 || usb_watch_add(&flashd.loop, &flashd.listen_watch, fd, listen_ready, NULL) < 0)
+    {
+        perror("Error opening socket");
+        return -1;
+    }
+    fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0 || usb_watch_add(&flashd.loop, &flashd.signal_watch, fd, signal_ready, NULL) < 0)
+    {
+        perror("Error: ");
+        return -1;
+    }
+    /* Without hotplug (containers, no netlink) devices are still added by -d or "add" */
+    fd = uevent_open();
+    if (fd < 0 || usb_watch_add(&flashd.loop, &flashd.uevent_watch, fd, uevent_ready, NULL) < 0)
+    {
+        fprintf(stderr, "No hotplug events (%s)\n", strerror(errno));
+    }
+    device_scan();
+    for (int i = 0; i < n_static; i++)
+    {
+        device_plug(static_dev[i], 0);
+    }
+    printf("%s\n", flashd.socket_path);
+    fflush(stdout);
+    if (usb_loop_run(&flashd.loop) < 0)
+    {
+        perror("Error: ");
+        return -1;
+    }
+    for (int i = 0; i < DAEMON_IMAGES; i++)
+    {
+        if (flashd.image[i].used)
+        {
+            image_release(&flashd.image[i]);
+        }
+    }
+    usb_loop_close(&flashd.loop);
+    return 0;
+}
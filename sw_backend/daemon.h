@@ -0,0 +1,72 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+#include <limits.h>
+#include <sys/stat.h>
+#include "image.h"
+#include "plan.h"
+#include "session.h"
+
+#define DAEMON_SOCKET		"/tmp/stm32_flashd.sock"
+#define DAEMON_VENDOR_ID	0x1979	/* what usb_driver binds to */
+#define DAEMON_PRODUCT_ID	0x2002
+#define DAEMON_DEVICES		16
+#define DAEMON_CLIENTS		32
+#define DAEMON_IMAGES		8		/* parsed images kept in memory */
+#define DAEMON_LINE			512		/* longest request */
+#define DAEMON_UEVENT		8192
+
+/* A parsed image and its plans, reused while the file stays the same */
+struct daemon_image {
+	char path[PATH_MAX];
+	u32 base;			/* of a .bin file */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct fw_image img;
+	struct plan plan[2];	/* HEX records, compressed blocks: built on first use */
+	u8 has_plan[2];
+	u8 used;
+	u8 stale;			/* the file changed, freed once no job uses it */
+	int refs;			/* jobs using it */
+	u64 last_use;
+};
+
+enum daemon_job {
+	JOB_NONE,
+	JOB_FLASH,
+	JOB_SAMPLE
+};
+
+struct daemon_client;
+
+/* A bootloader, plugged in or added by a client */
+struct daemon_device {
+	char path[PATH_MAX];
+	u8 present;
+	enum daemon_job job;
+	struct daemon_client *client;	/* who the job is for */
+	struct daemon_image *image;
+	struct session s;
+	int64_t plugged;	/* usb_now() of the hotplug event */
+};
+
+/* One connection, one request: the job's results are the reply */
+struct daemon_client {
+	int fd;
+	struct usb_watch watch;
+	char line[DAEMON_LINE];
+	u16 len;
+	u8 used;
+	u8 handled;			/* the request line arrived, the rest is ignored */
+	u8 gone;			/* hung up while its jobs still run */
+	u8 waiting;			/* for the next device plugged in */
+	u64 order;			/* of the waiting clients, the oldest goes first */
+	struct session_opts opts;
+	struct daemon_image *image;
+	int pending;		/* jobs still running */
+	int failed;
+	int n_job;
+};
+
+#endif
@@ -0,0 +1,468 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "emulator.h"
+#include "task_list.h"
+#include "usb_handle.h"
+#include "usbd_cdc_if.h"
+#include "bootloader.h"
+
+/* USB packets between the host and the device, due: when they arrive at the other end */
+struct emu_line {
+    struct {
+        int64_t due;
+        u16 len;
+        struct task_struct frame;   /* a v1 frame or a packet of a v2 frame */
+    } slot[EMU_LINE_FRAMES];
+    u32 head;
+    u32 tail;
+};
+
+struct emu_config emu_cfg;
+struct emu_stats emu_stats;
+/* What the firmware's main.c defines */
+u16 adc_val;
+struct task_queue usb_queue;
+uint8_t UserRxBufferFS[APP_RX_DATA_SIZE];
+
+static struct {
+    int fd;             /* pty master or connected client, -1: none */
+    int listen_fd;      /* Unix socket mode */
+    int slave_fd;       /* kept open so the pty survives the host closing it */
+    u8 partial[FRAME_V2_MAX];
+    u16 partial_len;
+    u8 *rx_buf;         /* where the OUT endpoint receives the next packet */
+    int rx_paused;      /* the firmware holds it off until a slot is free */
+    struct emu_line rx; /* host to device */
+    struct emu_line tx; /* device to host */
+    int64_t rx_free;    /* the wire is free again at */
+    int64_t tx_free;
+    int tx_started;     /* the firmware transmitted since the last wait, it may have more to send */
+    int rx_polled;      /* the firmware handled a reassembled frame or programmed flash, more may wait */
+    jmp_buf reset;
+    int64_t reset_us;   /* when the firmware last started */
+    const char *socket_path;
+    u64 faults;         /* program frames and responses seen by -d and -c */
+} emu = { .fd = -1, .listen_fd = -1, .slave_fd = -1 };
+
+static volatile sig_atomic_t emu_quit;
+
+static int line_empty(const struct emu_line *line) {
+    return line->head == line->tail;
+}
+
+static int line_push(struct emu_line *line, int64_t due, const void *frame, u16 len) {
+    if (line->tail - line->head == EMU_LINE_FRAMES) {
+        return -1;
+    }
+    line->slot[line->tail % EMU_LINE_FRAMES].due = due;
+    line->slot[line->tail % EMU_LINE_FRAMES].len = len;
+    memcpy(&line->slot[line->tail % EMU_LINE_FRAMES].frame, frame, len);
+    line->tail++;
+    return 0;
+}
+
+/* -d and -c: only the program window retransmits, other requests are left alone.
+ * Returns -1: lose the frame, 1: corrupt it, 0: deliver it as it is */
+static int emu_fault(const u8 *frame) {
+    const struct frame_head *head = (const struct frame_head *)frame;
+
+    if ((!emu_cfg.drop_every && !emu_cfg.corrupt_every) || (head->msg_type != MSG_PROGRAM_DATA &&
+        head->msg_type != MSG_PROGRAM_LZ && head->msg_type != MSG_WRITE_BLOCK)) {
+        return 0;
+    }
+    emu.faults++;
+    if (emu_cfg.drop_every && emu.faults % emu_cfg.drop_every == 0) {
+        emu_stats.lost++;
+        return -1;
+    }
+    if (emu_cfg.corrupt_every && emu.faults % emu_cfg.corrupt_every == 0) {
+        emu_stats.corrupted++;
+        return 1;
+    }
+    return 0;
+}
+
+/* The first data byte, v1 and v2 frames alike: covered by the frame check */
+static void emu_corrupt(u8 *frame) {
+    frame[FRAME_HEAD_SIZE] ^= 0x01;
+}
+
+/* Serialization time of len bytes at the configured bandwidth */
+static int64_t wire_us(u32 len) {
+    return emu_cfg.bandwidth ? (int64_t)len * 1000000 / emu_cfg.bandwidth : 0;
+}
+
+/* A frame leaves one end: it arrives after the wire is free, plus its length and the latency */
+static int64_t wire_due(int64_t *wire_free, int64_t now, u32 len) {
+    *wire_free = ((*wire_free > now) ? *wire_free : now) + wire_us(len);
+    return *wire_free + emu_cfg.latency_us;
+}
+
+uint8_t CDC_TxBusy_FS(void) {
+    return emu_now_us() < emu.tx_free;
+}
+
+/* One IN transfer may carry several frames back to back, each arrives once it is on the wire */
+uint8_t CDC_Transmit_FS(uint8_t *Buf, uint16_t Len) {
+    u32 frames = Len / sizeof(struct task_struct);
+    int64_t now = emu_now_us();
+
+    if (now < emu.tx_free || EMU_LINE_FRAMES - (emu.tx.tail - emu.tx.head) < frames) {
+        return USBD_BUSY;
+    }
+    for (u32 i = 0; i < frames; i++) {
+        int64_t due = wire_due(&emu.tx_free, now, sizeof(struct task_struct));
+        int fault = emu_fault(Buf + i * sizeof(struct task_struct));
+        if (fault < 0) {
+            continue;
+        }
+        line_push(&emu.tx, due, Buf + i * sizeof(struct task_struct), sizeof(struct task_struct));
+        if (fault) {
+            emu_corrupt((u8 *)&emu.tx.slot[(emu.tx.tail - 1) % EMU_LINE_FRAMES].frame);
+        }
+    }
+    emu.tx_started = 1;
+    return USBD_OK;
+}
+
+static void emu_disconnect(void) {
+    if (emu.listen_fd >= 0 && emu.fd >= 0) {
+        close(emu.fd);
+        emu.fd = -1;
+    }
+    /* What the host sent before it left still reaches the device */
+    emu.partial_len = 0;
+    emu.tx.head = emu.tx.tail;
+}
+
+/* The firmware frees a slot after it paused reception */
+void CDC_Resume_FS(uint8_t *Buf) {
+    emu.rx_buf = Buf;
+    emu.rx_paused = 0;
+}
+
+/* Packets the host sent that reached the device: what CDC_Receive_FS() does,
+ * while reception is paused they wait on the wire like NAKed packets */
+static void emu_deliver(int64_t now) {
+    while (!emu.rx_paused && !line_empty(&emu.rx) && emu.rx.slot[emu.rx.head % EMU_LINE_FRAMES].due <= now) {
+        u16 len = emu.rx.slot[emu.rx.head % EMU_LINE_FRAMES].len;
+        u8 *next;
+
+        memcpy(emu.rx_buf, &emu.rx.slot[emu.rx.head % EMU_LINE_FRAMES].frame, len);
+        next = usb_rx_packet(emu.rx_buf, len);
+        if (next) {
+            emu.rx_buf = next;
+        } else {
+            emu.rx_paused = 1;
+        }
+        emu.rx.head++;
+    }
+}
+
+/* Size of the frame in partial, known once its header is in */
+static u32 emu_frame_size(void) {
+    const struct frame_head *head = (const struct frame_head *)emu.partial;
+
+    if (emu.partial_len < FRAME_HEAD_SIZE || head->msg_head[1] != FRAME_V2_MARK ||
+        FRAME_V2_SIZE(head->data_length) > FRAME_V2_MAX) {
+        return sizeof(struct task_struct);
+    }
+    return FRAME_V2_SIZE(head->data_length);
+}
+
+/* Responses that reached the host */
+static void emu_send(int64_t now) {
+    while (!line_empty(&emu.tx) && emu.tx.slot[emu.tx.head % EMU_LINE_FRAMES].due <= now) {
+        if (emu.fd >= 0 && write(emu.fd, &emu.tx.slot[emu.tx.head % EMU_LINE_FRAMES].frame, sizeof(struct task_struct)) < 0) {
+            emu_disconnect();
+            return;
+        }
+        emu_stats.tx_frames++;
+        emu.tx.head++;
+    }
+}
+
+static void emu_receive(int64_t now) {
+    u8 buf[16 * sizeof(struct task_struct)];
+    ssize_t ret = read(emu.fd, buf, sizeof(buf));
+
+    if (ret <= 0) {
+        if (ret == 0 || errno != EAGAIN) {
+            emu_disconnect();
+        }
+        return;
+    }
+    /* The byte stream is cut into frames, then frames into packets of at most 64 bytes */
+    for (ssize_t i = 0; i < ret; ) {
+        u32 size = (emu.partial_len < FRAME_HEAD_SIZE) ? FRAME_HEAD_SIZE : emu_frame_size();
+        u32 n = size - emu.partial_len;
+        n = (n > ret - i) ? (u32)(ret - i) : n;
+        memcpy(emu.partial + emu.partial_len, buf + i, n);
+        emu.partial_len += n;
+        i += n;
+        if (emu.partial_len < FRAME_HEAD_SIZE || emu.partial_len < emu_frame_size()) {
+            continue;
+        }
+        emu_stats.rx_frames++;
+        switch (emu_fault(emu.partial)) {
+        case -1:
+            emu.partial_len = 0;
+            continue;
+        case 1:
+            emu_corrupt(emu.partial);
+            break;
+        }
+        for (u32 off = 0; off < emu.partial_len; off += sizeof(struct task_struct)) {
+            u16 len = (emu.partial_len - off > sizeof(struct task_struct)) ? sizeof(struct task_struct) : emu.partial_len - off;
+            if (line_push(&emu.rx, wire_due(&emu.rx_free, now, len), emu.partial + off, len) < 0) {
+                emu_stats.dropped++;
+            }
+        }
+        emu.partial_len = 0;
+    }
+}
+
+static int emu_open_pty(void) {
+    struct termios tio;
+    const char *name;
+
+    emu.fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (emu.fd < 0 || grantpt(emu.fd) < 0 || unlockpt(emu.fd) < 0 || !(name = ptsname(emu.fd))) {
+        return -1;
+    }
+    emu.slave_fd = open(name, O_RDWR | O_NOCTTY);
+    if (emu.slave_fd < 0 || tcgetattr(emu.slave_fd, &tio) < 0) {
+        return -1;
+    }
+    /* Frames are binary */
+    cfmakeraw(&tio);
+    if (tcsetattr(emu.slave_fd, TCSANOW, &tio) < 0) {
+        return -1;
+    }
+    printf("%s\n", name);
+    return 0;
+}
+
+static int emu_open_socket(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    emu.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (emu.listen_fd < 0 || bind(emu.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(emu.listen_fd, 1) < 0) {
+        return -1;
+    }
+    printf("%s\n", path);
+    return 0;
+}
+
+static void emu_report(void) {
+    fprintf(stderr, "rx %lu frames, tx %lu frames, %lu dropped, %lu sector(s) erased, %lu bytes programmed in %lu operations, "
+            "%lu application start(s)\n", emu_stats.rx_frames, emu_stats.tx_frames, emu_stats.dropped + usb_rx_dropped(),
+            emu_stats.erased, emu_stats.programmed, emu_stats.program_ops, emu_stats.app_starts);
+    if (emu_cfg.drop_every || emu_cfg.corrupt_every) {
+        fprintf(stderr, "%lu frame(s) lost and %lu corrupted on purpose\n", emu_stats.lost, emu_stats.corrupted);
+    }
+}
+
+/**
+  * @brief  The bootloader jumped to the application: report it, then reset into the bootloader
+  * @param  vtor: vector table of the application
+  * @param  msp: its initial stack pointer
+*/
+void __attribute__((noreturn)) emu_start_app(u32 vtor, u32 msp) {
+    u32 reset = *(volatile u32 *)(uintptr_t)(vtor + 4);
+
+    emu_stats.app_starts++;
+    if (SysTick->CTRL & SysTick_CTRL_ENABLE_Msk) {
+        fprintf(stderr, "application at 0x%08x started with SysTick running\n", vtor);
+    }
+    if (emu_cfg.verbose || emu_cfg.power_on) {
+        fprintf(stderr, "application at 0x%08x: SP 0x%08x, reset handler 0x%08x, %ld us after reset\n", vtor, msp, reset,
+                emu_now_us() - emu.reset_us);
+    }
+    /* The GOTO_APP response is still on the wire */
+    while (!line_empty(&emu.tx)) {
+        int64_t wait = emu.tx.slot[emu.tx.head % EMU_LINE_FRAMES].due - emu_now_us();
+        if (wait > 0) {
+            usleep(wait);
+        }
+        emu_send(emu_now_us());
+    }
+    if (emu_cfg.exit_on_app) {
+        emu_flash_sync();
+        emu_report();
+        exit(0);
+    }
+    longjmp(emu.reset, 1);
+}
+
+static void emu_signal(int sig) {
+    (void)sig;
+    emu_quit = 1;
+}
+
+/* Sleep until the next frame is due or the host sends something */
+static void emu_wait(int64_t now) {
+    struct pollfd pfd = { .fd = (emu.fd >= 0) ? emu.fd : emu.listen_fd, .events = POLLIN };
+    int64_t next = -1, due;
+    struct timespec ts;
+
+    if (!queue_is_empty(&usb_queue) || emu.tx_started || emu.rx_polled) {
+        next = now;
+    }
+    /* The end of a background erase */
+    due = emu_flash_poll(now);
+    if (due >= 0) {
+        next = (next < 0 || due < next) ? due : next;
+    }
+    emu.tx_started = 0;
+    if (!emu.rx_paused && !line_empty(&emu.rx)) {
+        due = emu.rx.slot[emu.rx.head % EMU_LINE_FRAMES].due;
+        next = (next < 0 || due < next) ? due : next;
+    }
+    if (!line_empty(&emu.tx)) {
+        due = emu.tx.slot[emu.tx.head % EMU_LINE_FRAMES].due;
+        next = (next < 0 || due < next) ? due : next;
+    }
+    /* A response may wait for the IN endpoint */
+    if (emu.tx_free > now) {
+        next = (next < 0 || emu.tx_free < next) ? emu.tx_free : next;
+    }
+    if (next >= 0) {
+        next = (next > now) ? next - now : 0;
+        ts.tv_sec = next / 1000000;
+        ts.tv_nsec = (next % 1000000) * 1000;
+    }
+    if (ppoll(&pfd, 1, (next >= 0) ? &ts : NULL, NULL) <= 0) {
+        return;
+    }
+    if (emu.fd < 0) {
+        emu.fd = accept4(emu.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    } else if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+        emu_receive(emu_now_us());
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct sigaction sa = { .sa_handler = emu_signal };
+    const char *flash_path = NULL;
+    u32 queue_size = EMU_QUEUE_SIZE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:s:q:l:b:e:p:d:c:axv")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            flash_path = optarg;
+            break;
+        case 's':
+            emu.socket_path = optarg;
+            break;
+        case 'q':
+            queue_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            emu_cfg.latency_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            emu_cfg.bandwidth = strtoul(optarg, NULL, 0);
+            break;
+        case 'e':
+            emu_cfg.erase_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            emu_cfg.program_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            emu_cfg.drop_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            emu_cfg.corrupt_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'a':
+            emu_cfg.power_on = 1;
+            break;
+        case 'x':
+            emu_cfg.exit_on_app = 1;
+            break;
+        case 'v':
+            emu_cfg.verbose = 1;
+            break;
+        default:
+            puts("./stm32_emu [-f flash-file] [-s socket-path] [-q task-queue-size] [-l latency-us] [-b bytes-per-s] [-e erase-ms] [-p program-us] [-d drop-every] [-c corrupt-every] [-a] [-x] [-v]");
+            return -1;
+        }
+    }
+    if (emu_flash_map(flash_path) < 0)
+    {
+        perror("Error mapping flash");
+        return -1;
+    }
+    if (!queue_size || init_queue(&usb_queue, queue_size) < 0 || (emu.socket_path ? emu_open_socket(emu.socket_path) : emu_open_pty()) < 0)
+    {
+        perror("Error: ");
+        return -1;
+    }
+    fflush(stdout);
+    signal(SIGPIPE, SIG_IGN);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    /* Back here after every MSG_GOTO_APP, like a reset with the boot button held */
+    setjmp(emu.reset);
+    emu.reset_us = emu_now_us();
+    SysTick->CTRL = 0;
+    if (emu_cfg.power_on && !emu_stats.app_starts)
+    {
+        /* The boot decision of the firmware's main.c, before USB is up */
+        start_boot_checking(&(struct boot_button){ .pin = GPIO_PIN_1 });
+        fprintf(stderr, "no valid application at 0x%08lx, staying in the bootloader\n", PROGRAM_ADDRESS);
+    }
+    lz_stream_reset();
+    usb_rx_reset();
+    emu.rx_buf = UserRxBufferFS;
+    emu.rx_paused = 0;
+    while (!emu_quit)
+    {
+        int64_t now = emu_now_us();
+        emu_flash_poll(now);
+        emu_deliver(now);
+        /* The firmware's main loop */
+        if (!queue_is_empty(&usb_queue))
+        {
+            usb_handle_packet(get_new_task(&usb_queue));
+        }
+        else
+        {
+            emu.rx_polled = usb_rx_poll() || flash_poll();
+        }
+        usb_flush_response();
+        emu_send(emu_now_us());
+        emu_wait(emu_now_us());
+    }
+    emu_flash_sync();
+    emu_report();
+    if (emu.socket_path)
+    {
+        unlink(emu.socket_path);
+    }
+    return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef __EMULATOR_H__
+#define __EMULATOR_H__
+#include "stm32f4xx_hal.h"
+
+#define EMU_LINE_FRAMES		256	/* packets on the wire in each direction */
+#define EMU_QUEUE_SIZE		10	/* USB task queue of the firmware's main.c */
+#define EMU_SECTOR_REF		0x20000UL	/* erase_ms is for a sector of this size */
+#define EMU_CPU_MHZ			168		/* DWT->CYCCNT ticks per emulated microsecond */
+
+/* Timing of the emulated device and link, 0 disables a delay */
+struct emu_config {
+	u32 latency_us;		/* one-way delay of the link */
+	u32 bandwidth;		/* bytes per second each way, 0: unlimited */
+	u32 erase_ms;		/* per 128 KB sector, smaller sectors take proportionally less */
+	u32 program_us;		/* per HAL_FLASH_Program() call */
+	int exit_on_app;	/* exit instead of going back to the bootloader */
+	int power_on;		/* start with the boot button released: into a valid application */
+	u32 drop_every;		/* lose every n-th program frame or its response, 0: none */
+	u32 corrupt_every;	/* flip a data bit of every n-th one, the frame check fails */
+	int verbose;
+};
+
+struct emu_stats {
+	u64 rx_frames;
+	u64 dropped;		/* task queue or link full */
+	u64 lost;			/* by -d on purpose */
+	u64 corrupted;		/* by -c */
+	u64 tx_frames;
+	u64 erased;			/* sectors */
+	u64 programmed;		/* bytes */
+	u64 program_ops;	/* HAL_FLASH_Program() calls */
+	u64 app_starts;
+};
+
+extern struct emu_config emu_cfg;
+extern struct emu_stats emu_stats;
+
+int64_t emu_now_us(void);
+void emu_delay_us(u64 us);
+int emu_flash_map(const char *path);
+void emu_flash_sync(void);
+int64_t emu_flash_poll(int64_t now);
+void __attribute__((noreturn)) emu_start_app(u32 vtor, u32 msp);
+
+#endif
@@ -0,0 +1,10 @@
+/*
+ * stm32f4xx.h
+ *
+ * Host stand-in, see stm32f4xx_hal.h
+ */
+#ifndef __STM32F4xx_H
+#define __STM32F4xx_H
+#include "stm32f4xx_hal.h"
+
+#endif /* __STM32F4xx_H */
@@ -0,0 +1,124 @@
+/*
+ * stm32f4xx_hal.h
+ *
+ * Host stand-in for the STM32F4 HAL: just what the bootloader sources use,
+ * backed by the emulator (flash is a 1 MB mapping at FLASH_BASE).
+ */
+#ifndef __STM32F4xx_HAL_H
+#define __STM32F4xx_HAL_H
+#include <stdint.h>
+
+typedef uint8_t		u8;
+typedef uint16_t	u16;
+typedef uint32_t	u32;
+typedef uint64_t	u64;
+
+typedef enum {
+	HAL_OK			= 0x00U,
+	HAL_ERROR		= 0x01U,
+	HAL_BUSY		= 0x02U,
+	HAL_TIMEOUT		= 0x03U
+} HAL_StatusTypeDef;
+
+/* Flash: STM32F407VG, 4 x 16 KB, 64 KB, 7 x 128 KB */
+#define FLASH_BASE					0x08000000UL
+#define FLASH_SIZE					0x00100000UL
+#define FLASH_END					(FLASH_BASE + FLASH_SIZE - 1)
+#define FLASH_SECTOR_TOTAL			12
+#define FLASH_SECTOR_0				0U
+#define FLASH_SECTOR_1				1U
+#define FLASH_SECTOR_2				2U
+#define FLASH_SECTOR_3				3U
+#define FLASH_SECTOR_4				4U
+#define FLASH_SECTOR_5				5U
+#define FLASH_SECTOR_6				6U
+#define FLASH_SECTOR_7				7U
+#define FLASH_SECTOR_8				8U
+#define FLASH_SECTOR_9				9U
+#define FLASH_SECTOR_10				10U
+#define FLASH_SECTOR_11				11U
+#define FLASH_BANK_1				1U
+#define FLASH_TYPEERASE_SECTORS		0x00000000U
+#define FLASH_TYPEERASE_MASSERASE	0x00000001U
+#define FLASH_VOLTAGE_RANGE_3		0x00000002U
+#define FLASH_TYPEPROGRAM_BYTE		0x00000000U
+#define FLASH_TYPEPROGRAM_HALFWORD	0x00000001U
+#define FLASH_TYPEPROGRAM_WORD		0x00000002U
+#define FLASH_TYPEPROGRAM_DOUBLEWORD	0x00000003U
+
+typedef struct {
+	uint32_t TypeErase;
+	uint32_t Banks;
+	uint32_t Sector;
+	uint32_t NbSectors;
+	uint32_t VoltageRange;
+} FLASH_EraseInitTypeDef;
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_Lock(void);
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data);
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *SectorError);
+/* Ends with a callback from emu_flash_poll(), what the FLASH interrupt does on the chip */
+HAL_StatusTypeDef HAL_FLASHEx_Erase_IT(FLASH_EraseInitTypeDef *pEraseInit);
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue);
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue);
+
+/* GPIO: the boot button reads "stay in the bootloader", released with -a */
+typedef struct {
+	volatile uint32_t IDR;
+} GPIO_TypeDef;
+
+typedef enum {
+	GPIO_PIN_RESET = 0,
+	GPIO_PIN_SET
+} GPIO_PinState;
+
+#define GPIO_PIN_1					((uint16_t)0x0002)
+#define GPIO_PIN_15					((uint16_t)0x8000)
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+
+/* Core: starting the application hands control back to the emulator */
+typedef struct {
+	volatile uint32_t ICSR;
+	volatile uint32_t VTOR;
+	volatile uint32_t SHCSR;
+} SCB_Type;
+
+extern SCB_Type emu_scb;
+#define SCB							(&emu_scb)
+#define SCB_ICSR_PENDSTCLR_Msk		(1UL << 25)
+
+/* SysTick: the emulator checks it is stopped when the application starts */
+typedef struct {
+	volatile uint32_t CTRL;
+	volatile uint32_t LOAD;
+	volatile uint32_t VAL;
+} SysTick_Type;
+
+extern SysTick_Type emu_systick;
+#define SysTick						(&emu_systick)
+#define SysTick_CTRL_ENABLE_Msk		(1UL << 0)
+#define SysTick_CTRL_TICKINT_Msk	(1UL << 1)
+
+/* Cycle counter: advances with the emulated busy time at EMU_CPU_MHZ, not the host's */
+typedef struct {
+	volatile uint32_t CTRL;
+	volatile uint32_t CYCCNT;
+} DWT_Type;
+
+extern DWT_Type emu_dwt;
+#define DWT							(&emu_dwt)
+#define SCB_SHCSR_USGFAULTENA_Msk	(1UL << 18)
+#define SCB_SHCSR_BUSFAULTENA_Msk	(1UL << 17)
+#define SCB_SHCSR_MEMFAULTENA_Msk	(1UL << 16)
+
+HAL_StatusTypeDef HAL_DeInit(void);
+HAL_StatusTypeDef HAL_RCC_DeInit(void);
+uint32_t HAL_GetTick(void);
+void __set_MSP(uint32_t topOfMainStack);
+#define __NOP()						do { } while (0)
+void emu_wfi(void);
+#define __WFI()						emu_wfi()
+
+#endif /* __STM32F4xx_HAL_H */
@@ -0,0 +1,21 @@
+/*
+ * usbd_cdc_if.h
+ *
+ * Host stand-in for the CDC interface: the IN endpoint is the emulated link
+ */
+#ifndef __USBD_CDC_IF_H__
+#define __USBD_CDC_IF_H__
+#include <stdint.h>
+
+#define USBD_OK						0U
+#define USBD_BUSY					1U
+#define USBD_FAIL					3U
+#define APP_RX_DATA_SIZE			2048
+
+extern uint8_t UserRxBufferFS[APP_RX_DATA_SIZE];
+
+uint8_t CDC_Transmit_FS(uint8_t *Buf, uint16_t Len);
+uint8_t CDC_TxBusy_FS(void);
+void CDC_Resume_FS(uint8_t *Buf);
+
+#endif /* __USBD_CDC_IF_H__ */
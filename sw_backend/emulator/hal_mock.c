@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "emulator.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE		0x100000
+#endif
+
+SCB_Type emu_scb;
+SysTick_Type emu_systick;
+DWT_Type emu_dwt;
+
+/* Flash lives at its real address, so the firmware's pointer casts just work */
+static u8 *const flash = (u8 *)FLASH_BASE;
+static int flash_unlocked;
+static int flash_fd = -1;
+static u64 delay_debt_us;
+/* Sectors erased in the background, done at erase_due */
+static u32 erase_first;
+static u32 erase_n;
+static int64_t erase_due;
+
+static const u32 sector_start[FLASH_SECTOR_TOTAL + 1] = {
+    0x00000, 0x04000, 0x08000, 0x0C000, 0x10000, 0x20000, 0x40000,
+    0x60000, 0x80000, 0xA0000, 0xC0000, 0xE0000, FLASH_SIZE
+};
+
+int64_t emu_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Busy time of the device, short delays add up until they are worth a sleep */
+void emu_delay_us(u64 us) {
+    struct timespec ts;
+
+    emu_dwt.CYCCNT += (u32)(us * EMU_CPU_MHZ);
+    delay_debt_us += us;
+    if (delay_debt_us < 1000) {
+        return;
+    }
+    ts.tv_sec = delay_debt_us / 1000000;
+    ts.tv_nsec = (delay_debt_us % 1000000) * 1000;
+    delay_debt_us = 0;
+    nanosleep(&ts, NULL);
+}
+
+/**
+  * @brief  Map the 1 MB flash at FLASH_BASE, read-only until HAL_FLASH_Unlock()
+  * @param  path: file keeping the content between runs, NULL: erased RAM
+  * @retval 0: success, -1: failed
+*/
+int emu_flash_map(const char *path) {
+    struct stat st = { 0 };
+    int flags = MAP_FIXED_NOREPLACE;
+    void *p;
+
+    if (path) {
+        flash_fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (flash_fd < 0 || fstat(flash_fd, &st) < 0 || ftruncate(flash_fd, FLASH_SIZE) < 0) {
+            return -1;
+        }
+        flags |= MAP_SHARED;
+    } else {
+        flags |= MAP_PRIVATE | MAP_ANONYMOUS;
+    }
+    p = mmap(flash, FLASH_SIZE, PROT_READ | PROT_WRITE, flags, flash_fd, 0);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+    if (p != flash) {
+        /* Kernels before 4.17 take the address as a hint only */
+        munmap(p, FLASH_SIZE);
+        errno = EEXIST;
+        return -1;
+    }
+    /* What the file did not cover yet is erased flash */
+    if ((u64)st.st_size < FLASH_SIZE) {
+        memset(flash + st.st_size, 0xFF, FLASH_SIZE - st.st_size);
+    }
+    return mprotect(flash, FLASH_SIZE, PROT_READ);
+}
+
+void emu_flash_sync(void) {
+    if (flash_fd >= 0) {
+        msync(flash, FLASH_SIZE, MS_SYNC);
+    }
+}
+
+/* Erase time of a sector, erase_ms is for a 128 KB one */
+static u64 erase_us(u32 sector) {
+    return (u64)emu_cfg.erase_ms * 1000 * (sector_start[sector + 1] - sector_start[sector]) / EMU_SECTOR_REF;
+}
+
+static void erase_sector(u32 sector) {
+    memset(flash + sector_start[sector], 0xFF, sector_start[sector + 1] - sector_start[sector]);
+    emu_stats.erased++;
+}
+
+/**
+  * @brief  The FLASH interrupt: end the background erase once it is due
+  * @param  now: emu_now_us()
+  * @retval when the background erase ends, now if it just did, -1: none runs
+*/
+int64_t emu_flash_poll(int64_t now) {
+    if (!erase_n) {
+        return -1;
+    }
+    if (now < erase_due) {
+        return erase_due;
+    }
+    for (u32 s = erase_first; s < erase_first + erase_n; s++) {
+        erase_sector(s);
+    }
+    erase_n = 0;
+    HAL_FLASH_EndOfOperationCallback(0xFFFFFFFFU);
+    return now;
+}
+
+/* Sleep until the interrupt that ends the background erase, the only one flash.c waits for */
+void emu_wfi(void) {
+    int64_t now = emu_now_us();
+    int64_t due = emu_flash_poll(now);
+
+    if (due > now) {
+        usleep(due - now);
+        emu_flash_poll(due);
+    }
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void) {
+    if (!flash_unlocked && mprotect(flash, FLASH_SIZE, PROT_READ | PROT_WRITE) < 0) {
+        return HAL_ERROR;
+    }
+    flash_unlocked = 1;
+    return HAL_OK;
+}
+
+/* A stray write to locked flash faults, as it would on the chip */
+HAL_StatusTypeDef HAL_FLASH_Lock(void) {
+    if (flash_unlocked && mprotect(flash, FLASH_SIZE, PROT_READ) < 0) {
+        return HAL_ERROR;
+    }
+    flash_unlocked = 0;
+    return HAL_OK;
+}
+
+/* Programming only clears bits, like NOR flash */
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data) {
+    u32 size = 1U << TypeProgram;
+    u32 offset = Address - FLASH_BASE;
+
+    if (erase_n) {
+        return HAL_BUSY;
+    }
+    if (!flash_unlocked || TypeProgram > FLASH_TYPEPROGRAM_DOUBLEWORD ||
+        Address < FLASH_BASE || offset > FLASH_SIZE - size || (Address & (size - 1))) {
+        return HAL_ERROR;
+    }
+    for (u32 i = 0; i < size; i++) {
+        flash[offset + i] &= (u8)(Data >> (8 * i));
+    }
+    emu_stats.programmed += size;
+    emu_stats.program_ops++;
+    emu_delay_us(emu_cfg.program_us);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *SectorError) {
+    u32 first = pEraseInit->Sector, n = pEraseInit->NbSectors;
+
+    *SectorError = 0xFFFFFFFFU;
+    if (erase_n) {
+        return HAL_BUSY;
+    }
+    if (pEraseInit->TypeErase == FLASH_TYPEERASE_MASSERASE) {
+        first = 0;
+        n = FLASH_SECTOR_TOTAL;
+    }
+    if (!flash_unlocked || first >= FLASH_SECTOR_TOTAL || n > FLASH_SECTOR_TOTAL - first) {
+        *SectorError = first;
+        return HAL_ERROR;
+    }
+    for (u32 s = first; s < first + n; s++) {
+        erase_sector(s);
+        emu_delay_us(erase_us(s));
+    }
+    return HAL_OK;
+}
+
+/* The CPU goes on, the sectors read erased once emu_flash_poll() ends the erase */
+HAL_StatusTypeDef HAL_FLASHEx_Erase_IT(FLASH_EraseInitTypeDef *pEraseInit) {
+    u32 first = pEraseInit->Sector, n = pEraseInit->NbSectors;
+
+    if (erase_n || !flash_unlocked || pEraseInit->TypeErase != FLASH_TYPEERASE_SECTORS ||
+        first >= FLASH_SECTOR_TOTAL || !n || n > FLASH_SECTOR_TOTAL - first) {
+        return HAL_ERROR;
+    }
+    erase_first = first;
+    erase_n = n;
+    erase_due = emu_now_us();
+    for (u32 s = first; s < first + n; s++) {
+        erase_due += erase_us(s);
+    }
+    return HAL_OK;
+}
+
+/* The boot button reads "stay in the bootloader", released with -a: only main() reads it */
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin) {
+    (void)GPIOx;
+    (void)GPIO_Pin;
+    return emu_cfg.power_on ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+HAL_StatusTypeDef HAL_DeInit(void) {
+    return HAL_OK;
+}
+
+/* Like the real one, it ends in HAL_InitTick() */
+HAL_StatusTypeDef HAL_RCC_DeInit(void) {
+    SysTick->CTRL = SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+    return HAL_OK;
+}
+
+uint32_t HAL_GetTick(void) {
+    return (uint32_t)(emu_now_us() / 1000);
+}
+
+/* goto_application() sets the stack right before it jumps: the application starts here */
+void __set_MSP(uint32_t topOfMainStack) {
+    emu_start_app(SCB->VTOR, topOfMainStack);
+}
@@ -0,0 +1,202 @@
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hex_decode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEX_HAVE_X86
+#endif
+
+typedef size_t (*hex_decode_fn)(uint8_t *out, const char *in, size_t len, uint8_t *sum);
+
+/* Nibble value of an ASCII character, -1 if it is not a hex digit */
+static const int8_t hex_value[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+static size_t hex_decode_scalar(uint8_t *out, const char *in, size_t len, uint8_t *sum) {
+    size_t n = 0;
+    uint8_t s = *sum;
+
+    while (2 * n + 1 < len) {
+        int hi = hex_value[(uint8_t)in[2 * n]];
+        int lo = hex_value[(uint8_t)in[2 * n + 1]];
+        if ((hi | lo) < 0) {
+            break;
+        }
+        out[n] = (uint8_t)(hi << 4 | lo);
+        s += out[n];
+        n++;
+    }
+    *sum = s;
+    return n;
+}
+
+#if defined(HEX_HAVE_X86)
+/* loadu(hex_keep + 32 - n) keeps the first n bytes of a vector */
+static const uint8_t hex_keep[64] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+/* 16 characters to 8 bytes per step */
+__attribute__((target("sse2")))
+static size_t hex_decode_sse2(uint8_t *out, const char *in, size_t len, uint8_t *sum) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    size_t n = 0, pairs = 8;
+
+    while (pairs == 8 && 2 * n + 16 <= len) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(in + 2 * n));
+        __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+        __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                         _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+        __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                         _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+        __m128i val = _mm_or_si128(_mm_and_si128(is_digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                                   _mm_and_si128(is_alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+        unsigned valid = (unsigned)_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha));
+        /* Even characters are the high nibble, odd ones the low nibble */
+        __m128i hi = _mm_slli_epi16(_mm_and_si128(val, _mm_set1_epi16(0x00FF)), 4);
+        __m128i lo = _mm_srli_epi16(val, 8);
+        __m128i bytes = _mm_packus_epi16(_mm_or_si128(hi, lo), zero);
+
+        pairs = (valid == 0xFFFF) ? 8 : (size_t)__builtin_ctz(~valid) / 2;
+        _mm_storel_epi64((__m128i *)(out + n), bytes);
+        bytes = _mm_and_si128(bytes, _mm_loadu_si128((const __m128i *)(hex_keep + 32 - pairs)));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(bytes, zero));
+        n += pairs;
+    }
+    *sum += (uint8_t)_mm_cvtsi128_si32(acc);
+    if (pairs < 8) {
+        return n;
+    }
+    return n + hex_decode_scalar(out + n, in + 2 * n, len - 2 * n, sum);
+}
+
+/* 32 characters to 16 bytes per step */
+__attribute__((target("avx2")))
+static size_t hex_decode_avx2(uint8_t *out, const char *in, size_t len, uint8_t *sum) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m128i acc = _mm_setzero_si128();
+    size_t n = 0, pairs = 16;
+
+    while (pairs == 16 && 2 * n + 32 <= len) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(in + 2 * n));
+        __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+        __m256i is_digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                                            _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+        __m256i is_alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                            _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+        __m256i val = _mm256_or_si256(_mm256_and_si256(is_digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0'))),
+                                      _mm256_and_si256(is_alpha, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10))));
+        unsigned valid = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha));
+        __m256i hi = _mm256_slli_epi16(_mm256_and_si256(val, _mm256_set1_epi16(0x00FF)), 4);
+        __m256i lo = _mm256_srli_epi16(val, 8);
+        /* packus works per 128-bit lane, gather both halves in the low lane */
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_or_si256(hi, lo), zero), 0xD8);
+        __m128i bytes = _mm256_castsi256_si128(packed);
+
+        pairs = (valid == 0xFFFFFFFFu) ? 16 : (size_t)__builtin_ctz(~valid) / 2;
+        _mm_storeu_si128((__m128i *)(out + n), bytes);
+        bytes = _mm_and_si128(bytes, _mm_loadu_si128((const __m128i *)(hex_keep + 32 - pairs)));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+        n += pairs;
+    }
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+    *sum += (uint8_t)_mm_cvtsi128_si32(acc);
+    if (pairs < 16) {
+        return n;
+    }
+    return n + hex_decode_sse2(out + n, in + 2 * n, len - 2 * n, sum);
+}
+#endif
+
+static hex_decode_fn decode_fn;
+
+/**
+  * @brief  Select the decoder implementation
+  * @param  isa: HEX_ISA_AUTO picks the best one the CPU supports
+  * @retval instruction set in use
+*/
+int hex_decode_select(int isa) {
+#if defined(HEX_HAVE_X86)
+    __builtin_cpu_init();
+    if (isa == HEX_ISA_AUTO) {
+        isa = __builtin_cpu_supports("avx2") ? HEX_ISA_AVX2 :
+              __builtin_cpu_supports("sse2") ? HEX_ISA_SSE2 : HEX_ISA_SCALAR;
+    }
+    if (isa == HEX_ISA_AVX2 && __builtin_cpu_supports("avx2")) {
+        decode_fn = hex_decode_avx2;
+        return HEX_ISA_AVX2;
+    }
+    if (isa >= HEX_ISA_SSE2 && __builtin_cpu_supports("sse2")) {
+        decode_fn = hex_decode_sse2;
+        return HEX_ISA_SSE2;
+    }
+#endif
+    decode_fn = hex_decode_scalar;
+    return HEX_ISA_SCALAR;
+}
+
+/**
+  * @brief  Decode hex digit pairs until the first non hex character
+  * @param  out: destination, needs HEX_DECODE_SLACK spare bytes
+  * @param  in: characters to decode
+  * @param  len: number of characters available in 'in'
+  * @param  sum: every decoded byte is added to *sum
+  * @retval number of bytes decoded
+*/
+size_t hex_decode(uint8_t *out, const char *in, size_t len, uint8_t *sum) {
+    if (!decode_fn) {
+        hex_decode_select(HEX_ISA_AUTO);
+    }
+    return decode_fn(out, in, len, sum);
+}
+
+/**
+  * @brief  Map a whole file read-only
+  * @retval address of the mapping, NULL on failure
+*/
+const char *file_map(int fd, size_t *len) {
+    struct stat st;
+    void *addr;
+
+    if (fstat(fd, &st) < 0) {
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        errno = ENODATA;
+        return NULL;
+    }
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    *len = st.st_size;
+    return (const char *)addr;
+}
+
+void file_unmap(const char *addr, size_t len) {
+    if (addr) {
+        munmap((void *)addr, len);
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef __HEX_DECODE_H__
+#define __HEX_DECODE_H__
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Instruction set used by hex_decode() */
+#define HEX_ISA_AUTO		-1
+#define HEX_ISA_SCALAR		0
+#define HEX_ISA_SSE2		1
+#define HEX_ISA_AVX2		2
+
+/* hex_decode() may write up to this many bytes past the decoded data */
+#define HEX_DECODE_SLACK	32
+
+int hex_decode_select(int isa);
+size_t hex_decode(uint8_t *out, const char *in, size_t len, uint8_t *sum);
+const char *file_map(int fd, size_t *len);
+void file_unmap(const char *addr, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <elf.h>
+#include <unistd.h>
+#include "image.h"
+#include "hex_decode.h"
+#include "CRC.h"
+
+/* Data record as found in the file, before merging */
+struct hex_chunk {
+    uint32_t addr;
+    uint32_t len;
+    uint32_t order;
+    const uint8_t *data;
+};
+
+static uint32_t hex_line(const char *text, size_t pos) {
+    uint32_t line = 1;
+    for (size_t i = 0; i < pos; i++) {
+        line += (text[i] == '\n');
+    }
+    return line;
+}
+
+static int chunk_cmp(const void *a, const void *b) {
+    const struct hex_chunk *x = (const struct hex_chunk *)a;
+    const struct hex_chunk *y = (const struct hex_chunk *)b;
+    if (x->addr != y->addr) {
+        return (x->addr < y->addr) ? -1 : 1;
+    }
+    return (x->order < y->order) ? -1 : 1;
+}
+
+static struct fw_segment *image_find(struct fw_image *img, uint32_t addr) {
+    uint32_t lo = 0, hi = img->n_seg;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (addr < img->seg[mid].addr) {
+            hi = mid;
+        } else if (addr >= img->seg[mid].addr + img->seg[mid].len) {
+            lo = mid + 1;
+        } else {
+            return &img->seg[mid];
+        }
+    }
+    return NULL;
+}
+
+/* Merge records into non-overlapping segments, later records win on overlap */
+static int image_build(struct fw_image *img, struct hex_chunk *chunk, uint32_t n_chunk) {
+    struct hex_chunk *sorted = chunk;
+    struct fw_segment *seg = NULL;
+    uint64_t end = 0;
+    int in_order = 1;
+
+    img->seg = (struct fw_segment *)calloc(n_chunk + 1, sizeof(*img->seg));
+    if (!img->seg) {
+        return -1;
+    }
+    /* Linkers emit records in ascending order, sort only when needed */
+    for (uint32_t i = 1; i < n_chunk && in_order; i++) {
+        in_order = ((uint64_t)chunk[i - 1].addr + chunk[i - 1].len <= chunk[i].addr);
+    }
+    if (!in_order) {
+        sorted = (struct hex_chunk *)malloc(n_chunk * sizeof(*sorted));
+        if (!sorted) {
+            return -1;
+        }
+        memcpy(sorted, chunk, n_chunk * sizeof(*sorted));
+        qsort(sorted, n_chunk, sizeof(*sorted), chunk_cmp);
+    }
+    for (uint32_t i = 0; i < n_chunk; i++) {
+        uint64_t chunk_end = (uint64_t)sorted[i].addr + sorted[i].len;
+        if (img->n_seg && sorted[i].addr <= end) {
+            if (chunk_end > end) {
+                seg = &img->seg[img->n_seg - 1];
+                end = chunk_end;
+                seg->len = (uint32_t)(end - seg->addr);
+            }
+        } else {
+            seg = &img->seg[img->n_seg++];
+            seg->addr = sorted[i].addr;
+            seg->len = sorted[i].len;
+            end = chunk_end;
+        }
+    }
+    if (sorted != chunk) {
+        free(sorted);
+    }
+    img->size = 0;
+    for (uint32_t i = 0; i < img->n_seg; i++) {
+        img->seg[i].data = (uint8_t *)malloc(img->seg[i].len);
+        if (!img->seg[i].data) {
+            return -1;
+        }
+        img->size += img->seg[i].len;
+    }
+    for (uint32_t i = 0; i < n_chunk; i++) {
+        if (!seg || chunk[i].addr < seg->addr || chunk[i].addr >= seg->addr + seg->len) {
+            seg = image_find(img, chunk[i].addr);
+        }
+        memcpy((uint8_t *)seg->data + (chunk[i].addr - seg->addr), chunk[i].data, chunk[i].len);
+    }
+    return 0;
+}
+
+/**
+  * @brief  Compile Intel HEX text into a sparse memory image
+  * @param  img: image to fill, release with image_free()
+  * @param  text: content of the HEX file
+  * @param  len: length of text
+  * @retval 0: success, -1: failed (errno = EINVAL on malformed input)
+*/
+int image_from_hex(struct fw_image *img, const char *text, size_t len) {
+    struct hex_chunk *chunk = NULL;
+    uint8_t *pool = NULL, *rec;
+    uint32_t n_chunk = 0;
+    uint32_t base = 0;
+    size_t pos = 0, used = 0;
+    int ret = -1;
+
+    memset(img, 0, sizeof(*img));
+    /* Every data byte costs at least two characters */
+    pool = (uint8_t *)malloc(len / 2 + HEX_DECODE_SLACK + 1);
+    chunk = (struct hex_chunk *)malloc((len / 11 + 1) * sizeof(*chunk));
+    if (!pool || !chunk) {
+        goto exit;
+    }
+    while (pos < len) {
+        const char *colon = (const char *)memchr(text + pos, ':', len - pos);
+        uint32_t count;
+        uint8_t checksum = 0;
+
+        if (!colon) {
+            break;
+        }
+        pos = colon - text + 1;
+        rec = pool + used;
+        /* Decode and sum the record in one pass, it stops at the line end */
+        count = (uint32_t)hex_decode(rec, text + pos, len - pos, &checksum);
+        pos += 2 * (size_t)count;
+        if (count < 5 || count != (uint32_t)rec[0] + 5 || checksum) {
+            fprintf(stderr, "Invalid HEX record at line %u\n", hex_line(text, pos));
+            errno = EINVAL;
+            goto exit;
+        }
+        switch (rec[3]) {
+        case HEX_DATA_RECORD:
+            chunk[n_chunk].addr = base + ((uint32_t)rec[1] << 8 | rec[2]);
+            chunk[n_chunk].len = rec[0];
+            chunk[n_chunk].order = n_chunk;
+            chunk[n_chunk].data = rec + 4;
+            n_chunk += (rec[0] != 0);
+            used += count;
+            break;
+        case HEX_END_OF_RECORD:
+            pos = len;
+            break;
+        case HEX_EXTENDED_SEG_ADDR:
+            base = ((uint32_t)rec[4] << 8 | rec[5]) << 4;
+            break;
+        case HEX_START_SEG_ADDR:
+            img->entry = ((uint32_t)rec[4] << 8 | rec[5]) * 16 + ((uint32_t)rec[6] << 8 | rec[7]);
+            break;
+        case HEX_EXTENDED_LINEAR_ADDR:
+            base = ((uint32_t)rec[4] << 8 | rec[5]) << 16;
+            break;
+        case HEX_START_LINEAR_ADDR:
+            img->entry = (uint32_t)rec[4] << 24 | (uint32_t)rec[5] << 16 | (uint32_t)rec[6] << 8 | rec[7];
+            break;
+        default:
+            fprintf(stderr, "Unknown HEX record type %02X at line %u\n", rec[3], hex_line(text, pos));
+            errno = EINVAL;
+            goto exit;
+        }
+    }
+    ret = image_build(img, chunk, n_chunk);
+exit:
+    free(chunk);
+    free(pool);
+    if (ret < 0) {
+        image_free(img);
+    }
+    return ret;
+}
+
+/**
+  * @brief  Map a raw binary, the image points straight into the mapping
+  * @param  base: address of the first byte
+  * @retval 0: success, -1: failed
+*/
+int image_from_bin(struct fw_image *img, int fd, uint32_t base) {
+    memset(img, 0, sizeof(*img));
+    img->map = file_map(fd, &img->map_len);
+    if (!img->map) {
+        return -1;
+    }
+    if ((uint64_t)base + img->map_len > 0x100000000ULL) {
+        image_free(img);
+        errno = EFBIG;
+        return -1;
+    }
+    img->seg = (struct fw_segment *)calloc(1, sizeof(*img->seg));
+    if (!img->seg) {
+        image_free(img);
+        return -1;
+    }
+    img->seg[0].addr = base;
+    img->seg[0].len = (uint32_t)img->map_len;
+    img->seg[0].data = (const uint8_t *)img->map;
+    img->n_seg = 1;
+    img->size = img->map_len;
+    img->entry = base;
+    return 0;
+}
+
+static int segment_cmp(const void *a, const void *b) {
+    const struct fw_segment *x = (const struct fw_segment *)a;
+    const struct fw_segment *y = (const struct fw_segment *)b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/**
+  * @brief  Map a 32-bit little endian ELF file, every PT_LOAD segment with
+  * file content becomes an image segment at its load (physical) address
+  * @retval 0: success, -1: failed (errno = ENOEXEC on unsupported files)
+*/
+int image_from_elf(struct fw_image *img, int fd) {
+    const Elf32_Ehdr *ehdr;
+    const Elf32_Phdr *phdr;
+
+    memset(img, 0, sizeof(*img));
+    img->map = file_map(fd, &img->map_len);
+    if (!img->map) {
+        return -1;
+    }
+    ehdr = (const Elf32_Ehdr *)img->map;
+    if (img->map_len < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+            ehdr->e_ident[EI_CLASS] != ELFCLASS32 || ehdr->e_ident[EI_DATA] != ELFDATA2LSB ||
+            ehdr->e_phentsize != sizeof(*phdr) ||
+            (uint64_t)ehdr->e_phoff + (uint64_t)ehdr->e_phnum * sizeof(*phdr) > img->map_len) {
+        goto invalid;
+    }
+    img->seg = (struct fw_segment *)calloc(ehdr->e_phnum + 1, sizeof(*img->seg));
+    if (!img->seg) {
+        image_free(img);
+        return -1;
+    }
+    phdr = (const Elf32_Phdr *)(img->map + ehdr->e_phoff);
+    for (uint32_t i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type != PT_LOAD || phdr[i].p_filesz == 0) {
+            continue;
+        }
+        if ((uint64_t)phdr[i].p_offset + phdr[i].p_filesz > img->map_len) {
+            goto invalid;
+        }
+        img->seg[img->n_seg].addr = phdr[i].p_paddr;
+        img->seg[img->n_seg].len = phdr[i].p_filesz;
+        img->seg[img->n_seg].data = (const uint8_t *)img->map + phdr[i].p_offset;
+        img->size += phdr[i].p_filesz;
+        img->n_seg++;
+    }
+    qsort(img->seg, img->n_seg, sizeof(*img->seg), segment_cmp);
+    for (uint32_t i = 1; i < img->n_seg; i++) {
+        if ((uint64_t)img->seg[i - 1].addr + img->seg[i - 1].len > img->seg[i].addr) {
+            goto invalid;
+        }
+    }
+    img->entry = ehdr->e_entry;
+    return 0;
+invalid:
+    image_free(img);
+    errno = ENOEXEC;
+    return -1;
+}
+
+/**
+  * @brief  Load a firmware file: ELF (by content), raw binary (*.bin) or Intel HEX
+  * @param  name: file name, only used to recognize raw binaries
+  * @param  base: load address of raw binaries
+  * @retval 0: success, -1: failed
+*/
+int image_load(struct fw_image *img, int fd, const char *name, uint32_t base) {
+    size_t name_len = strlen(name);
+    char magic[SELFMAG];
+    const char *text;
+    size_t len;
+    int ret;
+
+    if (pread(fd, magic, SELFMAG, 0) == SELFMAG && !memcmp(magic, ELFMAG, SELFMAG)) {
+        return image_from_elf(img, fd);
+    }
+    if (name_len > 4 && !strcmp(name + name_len - 4, ".bin")) {
+        return image_from_bin(img, fd, base);
+    }
+    memset(img, 0, sizeof(*img));
+    text = file_map(fd, &len);
+    if (!text) {
+        return -1;
+    }
+    ret = image_from_hex(img, text, len);
+    file_unmap(text, len);
+    return ret;
+}
+
+void image_free(struct fw_image *img) {
+    for (uint32_t i = 0; !img->map && img->seg && i < img->n_seg; i++) {
+        free((uint8_t *)img->seg[i].data);
+    }
+    free(img->seg);
+    file_unmap(img->map, img->map_len);
+    memset(img, 0, sizeof(*img));
+}
+
+/**
+  * @brief  CRC32 of a flash region once the image is written to it, bytes the
+  * image does not cover read as erased (0xFF)
+  * @param  addr: word aligned start of the region
+  * @param  len: length of the region, multiple of 4
+  * @retval CRC-32/MPEG-2 of the region
+*/
+uint32_t image_crc32(const struct fw_image *img, uint32_t addr, uint32_t len) {
+    uint32_t crc = 0xFFFFFFFF;
+    uint32_t i = 0;
+
+    for (uint64_t a = addr; a < (uint64_t)addr + len; a += 4) {
+        uint32_t word = 0xFFFFFFFF;
+
+        while (i < img->n_seg && (uint64_t)img->seg[i].addr + img->seg[i].len <= a) {
+            i++;
+        }
+        if (i < img->n_seg && img->seg[i].addr <= a && a + 4 <= (uint64_t)img->seg[i].addr + img->seg[i].len) {
+            /* Every whole word of the segment at once */
+            uint64_t seg_end = (uint64_t)img->seg[i].addr + img->seg[i].len;
+            uint32_t n = (((seg_end < (uint64_t)addr + len) ? seg_end : (uint64_t)addr + len) - a) / 4;
+            crc = CRC_UpdateCRC32Mpeg2(crc, img->seg[i].data + (a - img->seg[i].addr), n);
+            a += 4 * (uint64_t)(n - 1);
+            continue;
+        }
+        /* Word on a segment edge or erased, gather it byte by byte */
+        for (uint32_t j = i; j < img->n_seg && img->seg[j].addr < a + 4; j++) {
+            for (uint64_t b = a; b < a + 4; b++) {
+                if (b >= img->seg[j].addr && b < (uint64_t)img->seg[j].addr + img->seg[j].len) {
+                    ((uint8_t *)&word)[b - a] = img->seg[j].data[b - img->seg[j].addr];
+                }
+            }
+        }
+        crc = CRC_UpdateCRC32Mpeg2(crc, (const uint8_t *)&word, 1);
+    }
+    return crc;
+}
+
+/**
+  * @brief  Encode one Intel HEX record in binary form (without ':')
+  * @param  out: buffer of at least len + 5 bytes
+  * @retval number of bytes written
+*/
+int hex_record(uint8_t *out, uint8_t type, uint16_t offset, const uint8_t *data, uint8_t len) {
+    uint8_t checksum = 0;
+    out[0] = len;
+    out[1] = (uint8_t)(offset >> 8);
+    out[2] = (uint8_t)offset;
+    out[3] = type;
+    if (len) {
+        memcpy(&out[4], data, len);
+    }
+    for (int i = 0; i < len + 4; i++) {
+        checksum += out[i];
+    }
+    out[len + 4] = (uint8_t)(0x100 - checksum);
+    return len + 5;
+}
+
+/**
+  * @brief  Cut the image into HEX records of up to block data bytes
+  * @param  block: data bytes per record, records start word aligned
+  * @param  emit: called for each record, a negative return stops the walk
+  * @retval 0: success, otherwise the failing emit() result
+*/
+int image_to_hex(const struct fw_image *img, uint32_t block, hex_emit_t emit, void *ctx) {
+    uint8_t record[HEX_MAX_DATA + 5];
+    uint8_t upper[2];
+    uint32_t base = 0xFFFFFFFF;
+    uint64_t done = 0;
+    int len, ret;
+
+    if (block > HEX_MAX_DATA) {
+        block = HEX_MAX_DATA;
+    }
+    for (uint32_t i = 0; i < img->n_seg; i++) {
+        uint32_t addr = img->seg[i].addr;
+        const uint8_t *data = img->seg[i].data;
+        uint32_t remaining = img->seg[i].len;
+
+        while (remaining) {
+            uint32_t chunk = block - (addr & 3);
+            if (chunk > remaining) {
+                chunk = remaining;
+            }
+            if ((addr & 0xFFFF) + chunk > 0x10000) {
+                chunk = 0x10000 - (addr & 0xFFFF);
+            }
+            if ((addr >> 16) != base) {
+                base = addr >> 16;
+                upper[0] = (uint8_t)(base >> 8);
+                upper[1] = (uint8_t)base;
+                len = hex_record(record, HEX_EXTENDED_LINEAR_ADDR, 0, upper, sizeof(upper));
+                if ((ret = emit(ctx, record, len, done)) < 0) {
+                    return ret;
+                }
+            }
+            len = hex_record(record, HEX_DATA_RECORD, (uint16_t)addr, data, (uint8_t)chunk);
+            addr += chunk;
+            data += chunk;
+            remaining -= chunk;
+            done += chunk;
+            if ((ret = emit(ctx, record, len, done)) < 0) {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Intel HEX record type */
+#define HEX_DATA_RECORD				0x00
+#define HEX_END_OF_RECORD			0x01
+#define HEX_EXTENDED_SEG_ADDR		0x02
+#define HEX_START_SEG_ADDR			0x03
+#define HEX_EXTENDED_LINEAR_ADDR	0x04
+#define HEX_START_LINEAR_ADDR		0x05
+#define HEX_MAX_DATA				255
+/* Load address of raw binaries unless told otherwise */
+#define IMAGE_BIN_BASE				0x08020000UL
+
+/* Contiguous run of bytes at an absolute address */
+struct fw_segment {
+	uint32_t addr;
+	uint32_t len;
+	const uint8_t *data;
+};
+
+/* Called for every synthesized record, done: image bytes covered so far */
+typedef int (*hex_emit_t)(void *ctx, const uint8_t *record, int len, uint64_t done);
+
+/* Sparse memory image, segments sorted by address and never overlapping */
+struct fw_image {
+	struct fw_segment *seg;
+	uint32_t n_seg;
+	uint32_t entry;
+	uint64_t size;		/* total number of data bytes */
+	const char *map;	/* file mapping the segments point into, if any */
+	size_t map_len;
+};
+
+int image_from_hex(struct fw_image *img, const char *text, size_t len);
+int image_from_bin(struct fw_image *img, int fd, uint32_t base);
+int image_from_elf(struct fw_image *img, int fd);
+int image_load(struct fw_image *img, int fd, const char *name, uint32_t base);
+void image_free(struct fw_image *img);
+uint32_t image_crc32(const struct fw_image *img, uint32_t addr, uint32_t len);
+int hex_record(uint8_t *out, uint8_t type, uint16_t offset, const uint8_t *data, uint8_t len);
+int image_to_hex(const struct fw_image *img, uint32_t block, hex_emit_t emit, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
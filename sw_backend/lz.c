@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lz.h"
+
+#define LZ_HASH_BITS		15
+#define LZ_CHAIN_DEPTH		32
+#define LZ_NONE				0xFFFFFFFFu
+
+static uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(const uint8_t *p) {
+    return (lz_read32(p) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_length(uint8_t *op, uint32_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/* Emit one sequence, match_len 0 ends the block */
+static uint8_t *lz_sequence(uint8_t *op, const uint8_t *lit, uint32_t lit_len, uint32_t offset, uint32_t match_len) {
+    uint8_t *token = op++;
+
+    *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15) {
+        op = lz_length(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len) {
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        match_len -= LZ_MIN_MATCH;
+        *token |= (uint8_t)(match_len >= 15 ? 15 : match_len);
+        if (match_len >= 15) {
+            op = lz_length(op, match_len - 15);
+        }
+    }
+    return op;
+}
+
+/**
+  * @brief  Compress a block, greedy parsing over hash chains
+  * @param  prefix: bytes right before src the decoder already holds, matches may
+  * reach back into them (up to LZ_MAX_OFFSET)
+  * @param  dst: buffer of at least LZ_BOUND(len) bytes
+  * @retval size of the compressed block, -1: out of memory
+*/
+int lz_compress(const uint8_t *src, uint32_t len, uint32_t prefix, uint8_t *dst) {
+    uint32_t *head, *prev;
+    uint32_t pos, anchor;
+    uint8_t *op = dst;
+
+    /* Positions count from the start of the prefix */
+    prefix = (prefix > LZ_MAX_OFFSET) ? LZ_MAX_OFFSET : prefix;
+    src -= prefix;
+    len += prefix;
+    head = (uint32_t *)malloc(sizeof(*head) << LZ_HASH_BITS);
+    prev = (uint32_t *)malloc(sizeof(*prev) * (len ? len : 1));
+    if (!head || !prev) {
+        free(head);
+        free(prev);
+        return -1;
+    }
+    memset(head, 0xFF, sizeof(*head) << LZ_HASH_BITS);
+    for (pos = 0; pos < prefix && pos + LZ_MIN_MATCH <= len; pos++) {
+        uint32_t h = lz_hash(src + pos);
+        prev[pos] = head[h];
+        head[h] = pos;
+    }
+    pos = anchor = prefix;
+    while (pos + LZ_MF_LIMIT <= len) {
+        uint32_t h = lz_hash(src + pos);
+        uint32_t max = len - LZ_LAST_LITERALS - pos;
+        uint32_t best_len = 0, best_off = 0;
+        uint32_t cand = head[h];
+
+        for (int depth = LZ_CHAIN_DEPTH; cand != LZ_NONE && pos - cand <= LZ_MAX_OFFSET && depth; depth--) {
+            if (lz_read32(src + cand) == lz_read32(src + pos)) {
+                uint32_t l = LZ_MIN_MATCH;
+                while (l < max && src[cand + l] == src[pos + l]) {
+                    l++;
+                }
+                if (l > best_len) {
+                    best_len = l;
+                    best_off = pos - cand;
+                    if (l == max) {
+                        break;
+                    }
+                }
+            }
+            cand = prev[cand];
+        }
+        prev[pos] = head[h];
+        head[h] = pos;
+        if (best_len < LZ_MIN_MATCH) {
+            pos++;
+            continue;
+        }
+        op = lz_sequence(op, src + anchor, pos - anchor, best_off, best_len);
+        /* Index the positions inside the match too */
+        for (uint32_t i = pos + 1; i < pos + best_len; i++) {
+            h = lz_hash(src + i);
+            prev[i] = head[h];
+            head[h] = i;
+        }
+        pos += best_len;
+        anchor = pos;
+    }
+    op = lz_sequence(op, src + anchor, len - anchor, 0, 0);
+    free(head);
+    free(prev);
+    return (int)(op - dst);
+}
@@ -0,0 +1,25 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* LZ4 block format: token (literal length << 4 | match length - 4),
+ * literals, 16-bit little endian offset, lengths of 15 and more continue
+ * in extra bytes. The last sequence holds literals only */
+#define LZ_MIN_MATCH		4
+#define LZ_MAX_OFFSET		65535
+#define LZ_MF_LIMIT			12	/* no match starts in the last 12 bytes */
+#define LZ_LAST_LITERALS	5	/* and no match covers the last 5 bytes */
+/* Worst case size of a compressed block */
+#define LZ_BOUND(n)			((n) + (n) / 255 + 16)
+
+int lz_compress(const uint8_t *src, uint32_t len, uint32_t prefix, uint8_t *dst);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,152 +3,196 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <glob.h>
 #include <sys/stat.h>
 #include "protocol.h"
+#include "image.h"
+#include "plan.h"
+#include "session.h"
+#include "readback.h"
+#include "cache.h"
 
-#define BUFFER_SIZE 1024
-
-void ascii_2_hex(char *asc_code, unsigned char *hex_code, unsigned int len)
+/* Dump a flash region of one device to a .bin file */
+static int read_back(const char *path, const char *file, u32 addr, u32 len)
 {
-    int idx = 0;
-    for (int i = 0; i < len; i += 2)
+    struct session dev;
+    int out_fd, ret = -1;
+    u8 *data = malloc(len);
+    int64_t start;
+
+    if (!data || session_open(&dev, path) < 0)
+    {
+        perror("Error opening device");
+        free(data);
+        return -1;
+    }
+    out_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (-1 == out_fd)
+    {
+        perror("Error opening file");
+        goto exit;
+    }
+    start = usb_now();
+    if (usb_read_memory(dev.fd, addr, len, data) < 0)
     {
-        sscanf(&asc_code[i], "%2hhx", &hex_code[idx]);
-        idx++;
+        perror("Error reading memory");
+        goto close_file;
     }
+    start = usb_now() - start;
+    if (write(out_fd, data, len) != (ssize_t)len)
+    {
+        perror("Error writing file");
+        goto close_file;
+    }
+    printf("Read %u bytes at 0x%08x in %.3f s, %.1f KB/s\n", len, addr, start / 1000.0,
+           start ? len / 1.024 / start : 0.0);
+    ret = 0;
+close_file:
+    close(out_fd);
+exit:
+    close(dev.fd);
+    free(data);
+    return ret;
 }
 
 int main(int argc, char *argv[])
 {
-    char buffer[BUFFER_SIZE];
-    char line_rd[50] = {0};
-    ssize_t bytesRead;
-    int lineLength = 0;
-    struct task_struct send_task, recv_task;
-    int stm32_fd, hex_fd;
-    u8 buf[54];
-    u8 hex[50];
-    u64 total_len = 0x00;
-    struct stat hex_file;
+    struct session_opts opts = { .window_size = WINDOW_DEFAULT };
+    struct session *dev = NULL;
+    struct fw_image img;
+    struct plan plan;
+    glob_t devices;
+    int hex_fd, n_dev, opt, json = 0, use_cache = 1, cached, failed = -1;
+    uint32_t base = IMAGE_BIN_BASE, read_len = 0;
+    int64_t start;
 
-    if (argc < 3)
+    while ((opt = getopt(argc, argv, "w:F:b:r:fzHEuvjn")) != -1)
     {
-        puts("./update_firmware + <path-to-device-file> + <hex-file-name>");
-        return -1;
+        switch (opt)
+        {
+        case 'f':
+            opts.full = 1;
+            break;
+        case 'z':
+            opts.compress = 1;
+            break;
+        case 'H':
+            opts.records = 1;
+            break;
+        case 'E':
+            opts.erase_first = 1;
+            break;
+        case 'u':
+            opts.backend = USB_BACKEND_URING;
+            break;
+        case 'v':
+            opts.verbose = 1;
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'n':
+            use_cache = 0;
+            break;
+        case 'w':
+            opts.window_size = atoi(optarg);
+            break;
+        case 'F':
+            opts.frame_size = atoi(optarg);
+            break;
+        case 'b':
+            base = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            read_len = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            goto usage;
+        }
     }
-    stm32_fd = open(argv[1], O_RDWR);
-    if (-1 == stm32_fd)
+    if (argc - optind < 2)
     {
-        perror("Error: ");
+usage:
+        puts("./update_firmware [-f] [-z] [-H] [-E] [-u] [-v] [-j] [-n] [-w window-size] [-F frame-size] [-b bin-base-address] + <path-to-device-file|'/dev/stm32-*'>... + <hex|bin|elf-file-name>");
+        puts("./update_firmware -r length [-b address] + <path-to-device-file> + <bin-file-name>");
         return -1;
     }
-    hex_fd = open(argv[2], O_RDONLY);
+    if (read_len)
+    {
+        return read_back(argv[optind], argv[argc - 1], base, read_len);
+    }
+    /* Every argument but the last names devices, patterns are expanded here too */
+    memset(&devices, 0, sizeof(devices));
+    for (int i = optind; i < argc - 1; i++)
+    {
+        glob(argv[i], GLOB_NOCHECK | (i > optind ? GLOB_APPEND : 0), NULL, &devices);
+    }
+    n_dev = devices.gl_pathc;
+    hex_fd = open(argv[argc - 1], O_RDONLY);
     if (-1 == hex_fd)
     {
         perror("Error opening file");
-        close(stm32_fd);
+        globfree(&devices);
         return -1;
     }
-    if (fstat(hex_fd, &hex_file) < 0)
+    /* Parsed once, shared read-only by every device, and kept for the next run */
+    if (use_cache)
+    {
+        cached = cache_load(&img, &plan, hex_fd, argv[argc - 1], base, opts.compress);
+    }
+    else if ((cached = image_load(&img, hex_fd, argv[argc - 1], base)) == 0 &&
+             (cached = plan_build(&plan, &img, opts.compress)) < 0)
+    {
+        image_free(&img);
+    }
+    if (cached < 0)
     {
+        perror("Error loading file");
         goto exit;
     }
-
-    while ((bytesRead = read(hex_fd, buffer, sizeof(buffer) - 1)) > 0)
+    if (!json)
     {
-        buffer[bytesRead] = '\0';
-
-        for (int i = 0; i < bytesRead; i++)
-        {
-            if (buffer[i] == '\n')
-            {
-                line_rd[lineLength - 1] = '\0';
-                ascii_2_hex(line_rd, hex, strlen(line_rd));
-                total_len += strlen(line_rd);
-                printf("Writting %ld/%ld bytes of hex file!\n", total_len, hex_file.st_size);
-                if (usb_request(stm32_fd, &send_task, MSG_PROGRAM_DATA, hex, strlen(line_rd) / 2) < 0)
-                {
-                    perror("Error: ");
-                    goto exit;
-                }
-                if (usb_recv(stm32_fd, &recv_task) < 0)
-                {
-                    perror("Error: ");
-                    goto exit;
-                }
-                if (usb_err_check(&recv_task) < 0)
-                {
-                    goto exit;
-                }
-                else
-                {
-                    if (recv_task.msg_error == MSG_SUCCESS)
-                    {
-                        puts("Device send ACK!");
-                    }
-                    else
-                    {
-                        puts("Device send NACK!");
-                    }
-                }
-                sleep(0.5);
-                lineLength = 0;
-            }
-            else if (buffer[i] == ':')
-            {
-                lineLength = 0;
-            }
-            else
-            {
-                line_rd[lineLength] = buffer[i];
-                lineLength++;
-            }
-        }
+        printf("Image: %lu bytes in %u segment(s)%s\n", img.size, img.n_seg, cached ? " (cached)" : "");
     }
-
-    if (bytesRead == -1)
+    dev = calloc(n_dev, sizeof(*dev));
+    if (!dev)
     {
-        perror("Error reading file");
-        close(hex_fd);
-        return -1;
+        perror("Error: ");
+        goto free_plan;
     }
-
-    if (lineLength)
+    for (int i = 0; i < n_dev; i++)
     {
-        line_rd[lineLength] = '\0';
-        ascii_2_hex(line_rd, hex, strlen(line_rd));
-        total_len += strlen(line_rd);
-        printf("Writting %ld/%ld bytes of hex file!\n", total_len, hex_file.st_size);
-        if (usb_request(stm32_fd, &send_task, MSG_PROGRAM_DATA, hex, strlen(line_rd) / 2) < 0)
-        {
-            perror("Error: ");
-            goto exit;
-        }
-        if (usb_recv(stm32_fd, &recv_task) < 0)
-        {
-            perror("Error: ");
-            goto exit;
-        }
-        if (usb_err_check(&recv_task) < 0)
-        {
-            goto exit;
-        }
-        else
+        session_open(&dev[i], devices.gl_pathv[i]);
+    }
+    start = usb_now();
+    failed = session_run(dev, n_dev, &plan, &opts);
+    if (failed < 0)
+    {
+        perror("Error: ");
+    }
+    /* Statistics only, everything else on stdout stays out of the JSON */
+    session_report(dev, n_dev, json);
+    if (!json && opts.compress && n_dev == 1)
+    {
+        printf("Compressed stream: %lu bytes\n", dev[0].stream_len);
+    }
+    if (!json)
+    {
+        printf("%d/%d device(s) failed, %.3f s\n", failed, n_dev, (usb_now() - start) / 1000.0);
+    }
+    for (int i = 0; i < n_dev; i++)
+    {
+        if (dev[i].fd >= 0)
         {
-            if (recv_task.msg_error == MSG_SUCCESS)
-            {
-                puts("Device send ACK!");
-            }
-            else
-            {
-                puts("Device send NACK!");
-            }
+            close(dev[i].fd);
         }
     }
-    sleep(0.5);
-    usb_request(stm32_fd, &send_task, MSG_GOTO_APP, NULL, 0);
+    free(dev);
+free_plan:
+    plan_free(&plan);
+    image_free(&img);
 exit:
-    close(stm32_fd);
     close(hex_fd);
-    return 0;
+    globfree(&devices);
+    return failed ? -1 : 0;
 }
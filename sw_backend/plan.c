@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "plan.h"
+#include "window.h"
+#include "lz.h"
+
+struct record_ctx {
+    struct plan *plan;
+    u32 upper;
+};
+
+static void *plan_alloc(size_t len) {
+    void *p = mmap(NULL, len ? len : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+static void plan_seal(void *p, size_t len) {
+    if (p) {
+        mprotect(p, len ? len : 1, PROT_READ);
+    }
+}
+
+static void plan_release(void *p, size_t len) {
+    if (p) {
+        munmap(p, len ? len : 1);
+    }
+}
+
+static int count_record(void *ctx, const uint8_t *record, int len, uint64_t done) {
+    (void)record;
+    (void)len;
+    (void)done;
+    ((struct record_ctx *)ctx)->plan->n_record++;
+    return 0;
+}
+
+static int add_record(void *ctx, const uint8_t *record, int len, uint64_t done) {
+    struct record_ctx *rec = ctx;
+    struct plan_record *r = &rec->plan->record[rec->plan->n_record++];
+
+    (void)done;
+    if (record[3] != HEX_DATA_RECORD) {
+        rec->upper = (u32)record[4] << 24 | (u32)record[5] << 16;
+        /* Address records change how the device places the following data */
+        r->flags = FRAME_BARRIER;
+    } else {
+        r->flags = 0;
+    }
+    r->addr = rec->upper | (u32)record[1] << 8 | record[2];
+    r->len = (u8)len;
+    memcpy(r->data, record, len);
+    r->crc = usb_data_crc(r->data, r->len);
+    return 0;
+}
+
+static int plan_hex(struct plan *plan) {
+    struct record_ctx rec = { plan, 0 };
+
+    image_to_hex(plan->img, HEX_BLOCK_SIZE, count_record, &rec);
+    plan->record = (struct plan_record *)plan_alloc(plan->n_record * sizeof(*plan->record));
+    if (!plan->record) {
+        return -1;
+    }
+    plan->n_record = 0;
+    return image_to_hex(plan->img, HEX_BLOCK_SIZE, add_record, &rec);
+}
+
+/* Blocks of at most PLAN_LZ_BLOCK bytes, aligned so none straddles a sector */
+static int plan_lz(struct plan *plan) {
+    const struct fw_image *img = plan->img;
+    struct plan_block *b;
+    size_t used = 0;
+
+    for (u32 i = 0; i < img->n_seg; i++) {
+        u64 end = (u64)img->seg[i].addr + img->seg[i].len;
+        for (u64 addr = img->seg[i].addr; addr < end; addr = (addr | (PLAN_LZ_BLOCK - 1)) + 1) {
+            plan->n_block++;
+        }
+    }
+    plan->block = (struct plan_block *)calloc(plan->n_block + 1, sizeof(*plan->block));
+    plan->pool_len = LZ_BOUND(img->size) + (size_t)plan->n_block * 16;
+    plan->pool = (u8 *)plan_alloc(plan->pool_len);
+    if (!plan->block || !plan->pool) {
+        return -1;
+    }
+    b = plan->block;
+    for (u32 i = 0; i < img->n_seg; i++) {
+        const struct fw_segment *seg = &img->seg[i];
+        u64 end = (u64)seg->addr + seg->len;
+        for (u64 addr = seg->addr; addr < end; addr = (addr | (PLAN_LZ_BLOCK - 1)) + 1, b++) {
+            u64 block_end = (addr | (PLAN_LZ_BLOCK - 1)) + 1;
+            int size;
+
+            b->addr = (u32)addr;
+            b->len = (u32)(((block_end < end) ? block_end : end) - addr);
+            /* The segment before the block is in flash when the device decodes it */
+            size = lz_compress(seg->data + (addr - seg->addr), b->len, (u32)(addr - seg->addr), plan->pool + used);
+            if (size < 0) {
+                return -1;
+            }
+            b->size = (u32)size;
+            b->data = plan->pool + used;
+            used += size;
+        }
+    }
+    return 0;
+}
+
+/* Word aligned span of the image, bytes it does not cover read as erased */
+static void plan_verify(struct plan *plan) {
+    const struct fw_image *img = plan->img;
+    u64 end;
+
+    if (!img->n_seg) {
+        return;
+    }
+    end = ((u64)img->seg[img->n_seg - 1].addr + img->seg[img->n_seg - 1].len + 3) & ~3ULL;
+    plan->verify_addr = img->seg[0].addr & ~3u;
+    plan->verify_len = (u32)(end - plan->verify_addr);
+    plan->verify_crc = image_crc32(img, plan->verify_addr, plan->verify_len);
+}
+
+/* What MSG_SECTOR_CRC reports of the default layout once the image is written */
+static void plan_sectors(struct plan *plan) {
+    const struct fw_image *img = plan->img;
+
+    plan->sector_base = PLAN_SECTOR_BASE;
+    plan->sector_size = PLAN_SECTOR_SIZE;
+    plan->n_sector = PLAN_SECTORS;
+    for (u32 i = 0; i < PLAN_SECTORS; i++) {
+        u32 addr = PLAN_SECTOR_BASE + i * PLAN_SECTOR_SIZE;
+        plan->sector_crc[i] = image_crc32(img, addr, PLAN_SECTOR_SIZE);
+        for (u32 n = 0; n < img->n_seg; n++) {
+            if (img->seg[n].addr < addr + PLAN_SECTOR_SIZE && (u64)img->seg[n].addr + img->seg[n].len > addr) {
+                plan->footprint |= 1UL << i;
+            }
+        }
+    }
+}
+
+/**
+  * @brief  CRC32 of a flash region once the image is written, precomputed for the sectors of the default layout
+  * @retval CRC-32/MPEG-2 of the region
+*/
+u32 plan_sector_crc(const struct plan *plan, u32 addr, u32 len) {
+    if (len == plan->sector_size && addr >= plan->sector_base && !((addr - plan->sector_base) % len) &&
+        (addr - plan->sector_base) / len < plan->n_sector) {
+        return plan->sector_crc[(addr - plan->sector_base) / len];
+    }
+    return image_crc32(plan->img, addr, len);
+}
+
+/**
+  * @brief  Prepare the frames of an image once for any number of devices
+  * @param  compress: 0: HEX records, 1: compressed blocks
+  * @retval 0: success, -1: failed
+*/
+int plan_build(struct plan *plan, const struct fw_image *img, int compress) {
+    int ret;
+
+    memset(plan, 0, sizeof(*plan));
+    plan->img = img;
+    ret = compress ? plan_lz(plan) : plan_hex(plan);
+    if (ret < 0) {
+        plan_free(plan);
+        return -1;
+    }
+    plan_verify(plan);
+    plan_sectors(plan);
+    plan_seal(plan->record, plan->n_record * sizeof(*plan->record));
+    plan_seal(plan->pool, plan->pool_len);
+    return 0;
+}
+
+void plan_free(struct plan *plan) {
+    if (!plan->borrowed) {
+        plan_release(plan->record, plan->n_record * sizeof(*plan->record));
+        plan_release(plan->pool, plan->pool_len);
+    }
+    free(plan->block);
+    memset(plan, 0, sizeof(*plan));
+}
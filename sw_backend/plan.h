@@ -0,0 +1,58 @@
+#ifndef __PLAN_H__
+#define __PLAN_H__
+#include "protocol.h"
+#include "image.h"
+
+/* Compressed blocks never straddle a sector: 16 KB is the smallest STM32F4 sector */
+#define PLAN_LZ_BLOCK		0x4000
+/* Data bytes per synthesized HEX record, kept word aligned */
+#define HEX_BLOCK_SIZE		((sizeof(((struct task_struct *)0)->data) - 5) & ~3u)
+/* Application region of the bootloader: sector CRCs are precomputed for it */
+#define PLAN_SECTOR_BASE	IMAGE_BIN_BASE
+#define PLAN_SECTOR_SIZE	0x20000
+#define PLAN_SECTORS		7	/* sectors 5 to 11, to the end of the 1 MB flash */
+
+/* Synthesized HEX record */
+struct plan_record {
+	u32 addr;		/* address of the first data byte, data records only */
+	u8 flags;		/* FRAME_BARRIER for address records */
+	u8 len;
+	u8 data[HEX_BLOCK_SIZE + 5];
+	u32 crc;		/* frame check of data, what usb_fill() would calculate */
+};
+
+/* Compressed block, sent as u32 address, u32 length, then data[size] */
+struct plan_block {
+	u32 addr;
+	u32 len;
+	u32 size;
+	const u8 *data;
+};
+
+/* Everything sent to the devices, built once and read-only afterwards */
+struct plan {
+	const struct fw_image *img;
+	struct plan_record *record;
+	u32 n_record;
+	struct plan_block *block;
+	u32 n_block;
+	u8 *pool;		/* compressed data of every block */
+	size_t pool_len;
+	/* What MSG_VERIFY_IMAGE must report once the image is written */
+	u32 verify_addr;
+	u32 verify_len;
+	u32 verify_crc;
+	/* CRC32 of every sector of the default layout once the image is written */
+	u32 sector_base;
+	u32 sector_size;
+	u32 n_sector;
+	u32 sector_crc[PLAN_SECTORS];
+	u32 footprint;	/* bit n: sector n holds image bytes */
+	int borrowed;	/* record and pool belong to a mapped cache file */
+};
+
+int plan_build(struct plan *plan, const struct fw_image *img, int compress);
+void plan_free(struct plan *plan);
+u32 plan_sector_crc(const struct plan *plan, u32 addr, u32 len);
+
+#endif
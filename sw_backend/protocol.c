@@ -3,33 +3,116 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <string.h>
+#include <poll.h>
 #include "protocol.h"
 #include "CRC.h"
 
-int usb_request(int dev_fd, struct task_struct *task, u16 msg_type, const u8 *data, u16 data_len) {
-    int ret;
-    u8 *wdata = (u8 *)task;
+/* What the device's CRC unit calculates */
+static u32 usb_crc(const struct task_struct *task) {
+    return CRC_CalculateCRC32Mpeg2(task->data, sizeof(task->data) / 4);
+}
+
+/* Frame check of a data field holding data_len bytes, the rest zero */
+u32 usb_data_crc(const u8 *data, u16 data_len) {
+    struct task_struct task;
+
+    memcpy(task.data, data, data_len);
+    memset(task.data + data_len, 0, sizeof(task.data) - data_len);
+    return usb_crc(&task);
+}
+
+/* Like usb_fill(), with the frame check known beforehand, see usb_data_crc() */
+void usb_fill_crc(struct task_struct *task, u16 msg_type, u16 seq, const u8 *data, u16 data_len, u32 crc) {
     task->msg_head[0]       = 0xFA;
     task->msg_head[1]       = 0xFB;
     task->msg_error         = MSG_SUCCESS;
     task->msg_type          = msg_type;
+    task->seq               = seq;
     task->data_length       = data_len;
     memcpy(task->data, data, data_len);
-    task->crc               = CRC_CalculateCRC16(task->data, task->data_length);
+    memset(task->data + data_len, 0, sizeof(task->data) - data_len);
+    task->crc               = crc;
     task->msg_tail[0]       = 0xFC;
     task->msg_tail[1]       = 0xFD;
-    
-    ret = write(dev_fd, task, sizeof(struct task_struct));
-    return ret;
+}
+
+void usb_fill(struct task_struct *task, u16 msg_type, u16 seq, const u8 *data, u16 data_len) {
+    usb_fill_crc(task, msg_type, seq, data, data_len, 0);
+    task->crc               = usb_crc(task);
+}
+
+/* Frame check of the frame usb_fill_frame() builds: data_len decides the version */
+u32 usb_frame_crc(const u8 *data, u16 data_len) {
+    u8 tail[4] = { 0 };
+    u32 words = data_len / 4;
+
+    if (data_len <= FRAME_V1_DATA) {
+        return usb_data_crc(data, data_len);
+    }
+    memcpy(tail, data + words * 4, data_len % 4);
+    return CRC_UpdateCRC32Mpeg2(CRC_CalculateCRC32Mpeg2(data, words), tail, (data_len % 4) ? 1 : 0);
+}
+
+/**
+  * @brief  Build a v1 frame when the data fits, a v2 frame otherwise
+  * @param  frame: FRAME_V2_MAX bytes
+  * @param  crc: usb_frame_crc() of the data
+  * @retval bytes to write
+*/
+u32 usb_fill_frame(u8 *frame, u16 msg_type, u16 seq, const u8 *data, u16 data_len, u32 crc) {
+    struct task_struct *task = (struct task_struct *)frame;
+    u32 padded = (data_len + 3) & ~3u;
+
+    if (data_len <= FRAME_V1_DATA) {
+        usb_fill_crc(task, msg_type, seq, data, data_len, crc);
+        return sizeof(*task);
+    }
+    usb_fill_crc(task, msg_type, seq, NULL, 0, crc);
+    task->msg_head[1] = FRAME_V2_MARK;
+    task->data_length = data_len;
+    memcpy(frame + FRAME_HEAD_SIZE, data, data_len);
+    memset(frame + FRAME_HEAD_SIZE + data_len, 0, padded - data_len);
+    memcpy(frame + FRAME_HEAD_SIZE + padded, &crc, sizeof(crc));
+    frame[FRAME_HEAD_SIZE + padded + 4] = 0xFC;
+    frame[FRAME_HEAD_SIZE + padded + 5] = 0xFD;
+    return FRAME_V2_SIZE(data_len);
+}
+
+int usb_request(int dev_fd, struct task_struct *task, u16 msg_type, u16 seq, const u8 *data, u16 data_len) {
+    usb_fill(task, msg_type, seq, data, data_len);
+    return write(dev_fd, task, sizeof(struct task_struct));
 }
 int usb_recv(int dev_fd, struct task_struct *task) {
     return read(dev_fd, task, sizeof(struct task_struct));
 }
 
-int usb_err_check(struct task_struct *task) {
+/**
+  * @brief  Like usb_recv() but never waits longer than timeout_ms
+  * @retval > 0: bytes read, 0: timeout, -1: failed
+*/
+int usb_recv_timeout(int dev_fd, struct task_struct *task, int timeout_ms) {
+    struct pollfd pfd = { .fd = dev_fd, .events = POLLIN };
+    int ret = poll(&pfd, 1, timeout_ms);
+    if (ret <= 0) {
+        return ret;
+    }
+    return read(dev_fd, task, sizeof(struct task_struct));
+}
+
+int usb_fmt_check(struct task_struct *task) {
 	if (task->msg_head[0] != 0xFA || task->msg_head[1] != 0xFB || task->msg_tail[0] != 0xFC || task->msg_tail[1] != 0xFD) {
 		return -1;
-	} else if (CRC_CalculateCRC16(task->data, task->data_length) != task->crc) {
+	} else if (task->data_length > sizeof(task->data)) {
+		return -1;
+	} else if (usb_crc(task) != task->crc) {
+		return -1;
+	} else {
+		return 0;
+	}
+}
+
+int usb_err_check(struct task_struct *task) {
+	if (usb_fmt_check(task) < 0) {
 		return -1;
 	} else if (task->msg_error != MSG_SUCCESS) {
         return -1;
@@ -3,15 +3,34 @@
 #include <stdint.h>
 
 /* Message type */
-#define MSG_REQUEST_DATA	0x2002
-#define MSG_GOTO_APP		0x1979
-#define MSG_PROGRAM_DATA    0x2001
+#define MSG_REQUEST_DATA	0x2001
+#define MSG_GOTO_APP		0x2002
+#define MSG_PROGRAM_DATA    0x2003
+#define MSG_DEV_ERASE		0x2004
+#define MSG_SECTOR_CRC		0x2005
+#define MSG_PROGRAM_LZ		0x2006
+#define MSG_VERIFY_IMAGE	0x2007
+#define MSG_READ_MEMORY		0x2008
+#define MSG_HELLO			0x2009
+#define MSG_WRITE_BLOCK		0x200A	/* u32 address, u32 length, data: word aligned, back to back */
+#define MSG_ERASE_STATUS	0x200B	/* u32 sectors not erased yet, u32 the one being erased, u32 sectors erased */
 /* Error Code */
 #define	MSG_SUCCESS			0x3230
 #define MSG_INVALID			0x3231
 #define MSG_WFORMAT			0x3232
 #define MSG_FAILED			0x3233
 #define MSG_WRONG_CRC		0x3234
+/* Handshake: what MSG_HELLO reports, bootloaders without it answer MSG_INVALID */
+#define PROTOCOL_VERSION	2
+#define FEATURE_LARGE_FRAME	0x01	/* v2 frames of the program messages */
+#define FEATURE_LZ			0x02
+#define FEATURE_READ_MEMORY	0x04
+#define FEATURE_ERASE_MAP	0x08	/* MSG_DEV_ERASE takes a sector bitmap or an address range */
+#define FEATURE_WRITE_BLOCK	0x10
+#define FEATURE_ERASE_DEFER	0x20	/* ERASE_ON_DEMAND and MSG_ERASE_STATUS */
+/* MSG_DEV_ERASE: bit 31 of the bitmap, or a u32 after the range. Each sector is erased
+ * when it is first written, or ahead of the writes, the response does not wait */
+#define ERASE_ON_DEMAND		0x80000000UL
 /* Type Definition */
 typedef uint8_t u8;
 typedef uint16_t u16;
@@ -22,14 +41,30 @@ struct task_struct {
 	u8 msg_head[2];
 	u16 msg_error;
 	u16 msg_type;
+	u16 seq;
 	u16 data_length;
-	u8 data[52];
-	u16 crc;
+	u8 data[48];
+	u32 crc;			/* CRC-32/MPEG-2 of the whole data field, as 12 words */
 	u8 msg_tail[2];
 } __attribute__((packed));
+/* Protocol v2 frame: the same header, data_length bytes of data padded to words, then
+ * crc and tail. It spans several USB packets, the device reassembles it */
+#define FRAME_V2_MARK		0xFE	/* msg_head[1], 0xFB: a v1 frame */
+#define FRAME_HEAD_SIZE		10
+#define FRAME_V2_MAX		1024
+#define FRAME_V2_SIZE(len)	(FRAME_HEAD_SIZE + (((u32)(len) + 3) & ~3u) + 6)
+#define FRAME_V2_MAX_DATA	(FRAME_V2_MAX - FRAME_HEAD_SIZE - 6)
+#define FRAME_V1_DATA		sizeof(((struct task_struct *)0)->data)
 /* Function Prototype */
-int usb_request(int dev_fd, struct task_struct *task, u16 msg_type, const u8 *data, u16 data_len);
+u32 usb_data_crc(const u8 *data, u16 data_len);
+void usb_fill(struct task_struct *task, u16 msg_type, u16 seq, const u8 *data, u16 data_len);
+void usb_fill_crc(struct task_struct *task, u16 msg_type, u16 seq, const u8 *data, u16 data_len, u32 crc);
+u32 usb_frame_crc(const u8 *data, u16 data_len);
+u32 usb_fill_frame(u8 *frame, u16 msg_type, u16 seq, const u8 *data, u16 data_len, u32 crc);
+int usb_request(int dev_fd, struct task_struct *task, u16 msg_type, u16 seq, const u8 *data, u16 data_len);
 int usb_recv(int dev_fd, struct task_struct *task);
+int usb_recv_timeout(int dev_fd, struct task_struct *task, int timeout_ms);
+int usb_fmt_check(struct task_struct *task);
 int usb_err_check(struct task_struct *task);
 
 #endif
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include "readback.h"
+#include "session.h"
+#include "transport.h"
+
+/**
+  * @brief  Read a flash region with one MSG_READ_MEMORY request, the device streams
+  * it back in frames of 48 bytes numbered from 0 without waiting for the host
+  * @param  dev_fd: device, blocking or not
+  * @param  addr: word aligned start address
+  * @param  len: number of bytes, multiple of 4
+  * @param  out: len bytes
+  * @retval 0: success, -1: failed (errno ERANGE: region outside the flash), a running stream is cancelled
+*/
+int usb_read_memory(int dev_fd, u32 addr, u32 len, u8 *out) {
+    struct task_struct buf[READBACK_BATCH], send_task;
+    struct pollfd pfd = { .fd = dev_fd, .events = POLLIN };
+    u32 region[2] = { addr, len }, done = 0;
+    size_t have = 0;
+    u16 seq = 0;
+    int64_t deadline;
+
+    if ((addr | len) & 3) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (usb_request(dev_fd, &send_task, MSG_READ_MEMORY, 0, (const u8 *)region, sizeof(region)) < 0) {
+        return -1;
+    }
+    deadline = usb_now() + SESSION_TIMEOUT_MS;
+    while (done < len) {
+        ssize_t ret;
+        size_t i;
+
+        if (usb_now() > deadline) {
+            errno = ETIMEDOUT;
+            goto cancel;
+        }
+        ret = read(dev_fd, (u8 *)buf + have, sizeof(buf) - have);
+        if (ret < 0 && errno != EAGAIN) {
+            goto cancel;
+        }
+        /* The driver returns 0 when its read times out */
+        if (ret <= 0) {
+            poll(&pfd, 1, deadline - usb_now() > 0 ? deadline - usb_now() : 0);
+            continue;
+        }
+        have += ret;
+        for (i = 0; (i + 1) * sizeof(struct task_struct) <= have; i++) {
+            struct task_struct *task = &buf[i];
+            u32 want = (len - done < sizeof(task->data)) ? len - done : sizeof(task->data);
+
+            if (usb_fmt_check(task) < 0) {
+                errno = EPROTO;
+                goto cancel;
+            }
+            /* Late responses to an earlier session, e.g. its MSG_GOTO_APP */
+            if (task->msg_type != MSG_READ_MEMORY) {
+                continue;
+            }
+            /* A refused request is answered by a single frame, nothing follows it */
+            if (task->msg_error != MSG_SUCCESS) {
+                errno = (task->msg_error == MSG_INVALID) ? ERANGE : EPROTO;
+                return -1;
+            }
+            if (task->seq != seq || task->data_length != want) {
+                errno = EPROTO;
+                goto cancel;
+            }
+            memcpy(out + done, task->data, want);
+            done += want;
+            seq++;
+        }
+        have -= i * sizeof(struct task_struct);
+        memmove(buf, &buf[i], have);
+        deadline = usb_now() + SESSION_TIMEOUT_MS;
+    }
+    return 0;
+cancel:
+    /* Length 0 stops what is still being streamed */
+    region[1] = 0;
+    usb_request(dev_fd, &send_task, MSG_READ_MEMORY, 0, (const u8 *)region, sizeof(region));
+    return -1;
+}
@@ -0,0 +1,10 @@
+#ifndef __READBACK_H__
+#define __READBACK_H__
+#include "protocol.h"
+
+/* Frames buffered per read(), a pty or socket returns many at once */
+#define READBACK_BATCH		64
+
+int usb_read_memory(int dev_fd, u32 addr, u32 len, u8 *out);
+
+#endif
@@ -0,0 +1,769 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "session.h"
+
+/* A Unix socket stands for a device too, the emulator (stm32_emu -s) listens on one */
+static int session_connect(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+  * @brief  Open a device for the event loop
+  * @retval 0: success, -1: failed
+*/
+int session_open(struct session *s, const char *path) {
+    memset(s, 0, sizeof(*s));
+    s->path = path;
+    s->fd = open(path, O_RDWR | O_NONBLOCK);
+    if (s->fd < 0 && errno == ENXIO) {
+        s->fd = session_connect(path);
+    }
+    if (s->fd < 0) {
+        s->state = SESSION_FAILED;
+        s->status = strerror(errno);
+        return -1;
+    }
+    return 0;
+}
+
+static void session_finish(struct session *s, enum session_state state, const char *status) {
+    s->state = state;
+    s->status = status;
+    s->end = usb_now();
+    usb_link_remove(&s->link);
+    if (s->on_done) {
+        s->on_done(s);
+    }
+}
+
+static int session_request(struct session *s, u16 msg_type, const u8 *data, u16 len) {
+    s->timeouts = 0;
+    usb_link_expire(&s->link, SESSION_TIMEOUT_MS);
+    if (usb_link_send(&s->link, msg_type, 0, data, len) < 0 && errno != EAGAIN) {
+        session_finish(s, SESSION_FAILED, "write failed");
+        return -1;
+    }
+    return 0;
+}
+
+/* Whether the byte at addr has to be written */
+static int sector_dirty(const struct session *s, u32 addr) {
+    const struct flash_layout *layout = &s->layout;
+
+    if (!s->has_layout || addr < layout->base ||
+        addr - layout->base >= (u64)layout->n_sector * layout->sector_size) {
+        return 1;
+    }
+    return (s->dirty >> ((addr - layout->base) / layout->sector_size)) & 1;
+}
+
+/* Where the layout sector holding addr ends, blocks never cross it */
+static u64 sector_end(const struct session *s, u32 addr) {
+    const struct flash_layout *layout = &s->layout;
+
+    if (!s->has_layout) {
+        return 1ULL << 32;
+    }
+    if (addr < layout->base) {
+        return layout->base;
+    }
+    return layout->base + ((u64)(addr - layout->base) / layout->sector_size + 1) * layout->sector_size;
+}
+
+/* The device answers MSG_GOTO_APP before it jumps, or refuses to jump. A frame the
+ * full queue dropped (EAGAIN) goes again with the next timeout */
+static void session_start_app(struct session *s) {
+    usb_link_expire(&s->link, SESSION_TIMEOUT_MS);
+    if (usb_link_send(&s->link, MSG_GOTO_APP, 0, NULL, 0) == 0) {
+        s->start_sent = 1;
+    } else if (errno != EAGAIN) {
+        session_finish(s, SESSION_FAILED, "write failed");
+    }
+}
+
+static void session_goto_app(struct session *s, const char *status) {
+    s->state = SESSION_START;
+    s->status = status;
+    s->timeouts = 0;
+    s->start_sent = 0;
+    session_start_app(s);
+}
+
+static void session_started(struct session *s, struct task_struct *recv) {
+    if (usb_fmt_check(recv) < 0 || recv->msg_error == MSG_WFORMAT || recv->msg_error == MSG_WRONG_CRC) {
+        /* The request did not arrive intact, nothing was started */
+        s->start_sent = 0;
+        session_start_app(s);
+    } else if (recv->msg_error == MSG_INVALID) {
+        session_finish(s, SESSION_FAILED, "no valid application");
+    } else if (recv->msg_error != MSG_SUCCESS) {
+        session_finish(s, SESSION_FAILED, "flash failed");
+    } else {
+        session_finish(s, SESSION_DONE, s->status);
+    }
+}
+
+/* The sectors that changed, or without a layout every sector the image touches.
+ * A device that can erases them on demand, while the image is written */
+static void session_erase(struct session *s) {
+    u32 range[3] = { s->plan->verify_addr, s->plan->verify_len, ERASE_ON_DEMAND };
+    u32 bitmap = s->dirty | ERASE_ON_DEMAND;
+
+    s->state = SESSION_ERASE;
+    s->erase_deferred = !s->opts->erase_first && (s->features & FEATURE_ERASE_DEFER);
+    if (!s->erase_deferred) {
+        bitmap = s->dirty;
+    }
+    if (s->has_layout) {
+        session_request(s, MSG_DEV_ERASE, (const u8 *)&bitmap, sizeof(bitmap));
+    } else {
+        session_request(s, MSG_DEV_ERASE, (const u8 *)range, s->erase_deferred ? sizeof(range) : 2 * sizeof(u32));
+    }
+}
+
+/* Progress of a deferred erase, asked for whenever the device is slow to acknowledge */
+static void session_erase_status(struct session *s, struct task_struct *recv) {
+    u32 info[3];
+
+    if (usb_err_check(recv) < 0 || recv->data_length != sizeof(info)) {
+        return;
+    }
+    memcpy(info, recv->data, sizeof(info));
+    if (s->opts->verbose) {
+        printf("Erased %u sector(s), %d to go%s\n", info[2], __builtin_popcount(info[0]),
+               info[1] ? ", erasing one" : "");
+    }
+}
+
+/* Delta update: rewrite only the sectors whose content would change */
+static void session_layout(struct session *s, struct task_struct *recv) {
+    struct flash_layout *layout = &s->layout;
+
+    s->dirty = 0xFFFFFFFF;
+    if (recv && usb_err_check(recv) == 0 && recv->data_length >= 8 && recv->data_length % 4 == 0) {
+        memcpy(&layout->base, &recv->data[0], sizeof(u32));
+        memcpy(&layout->sector_size, &recv->data[4], sizeof(u32));
+        layout->n_sector = (recv->data_length - 8) / 4;
+        memcpy(layout->crc, &recv->data[8], layout->n_sector * sizeof(u32));
+        s->has_layout = (layout->sector_size != 0);
+    }
+    if (s->has_layout) {
+        s->dirty = 0;
+        for (u32 i = 0; i < layout->n_sector; i++) {
+            if (plan_sector_crc(s->plan, layout->base + i * layout->sector_size, layout->sector_size) != layout->crc[i]) {
+                s->dirty |= 1UL << i;
+            }
+        }
+        if (s->opts->verbose) {
+            printf("%d/%u sector(s) changed\n", __builtin_popcount(s->dirty), layout->n_sector);
+        }
+        if (!s->dirty) {
+            session_goto_app(s, "up to date");
+            return;
+        }
+    }
+    session_erase(s);
+}
+
+/* Protocol version and features, large frames when both ends have them */
+static void session_hello(struct session *s, struct task_struct *recv) {
+    u16 info[2];
+
+    s->version = 1;
+    s->features = 0;
+    s->frame_data = FRAME_V1_DATA;
+    s->msg_type = s->opts->compress ? MSG_PROGRAM_LZ : MSG_PROGRAM_DATA;
+    if (recv && usb_err_check(recv) == 0 && recv->data_length >= sizeof(info) + sizeof(u32)) {
+        memcpy(info, recv->data, sizeof(info));
+        memcpy(&s->features, recv->data + sizeof(info), sizeof(u32));
+        s->version = info[0];
+        if (s->features & FEATURE_LARGE_FRAME) {
+            u16 size = (s->opts->frame_size && s->opts->frame_size < info[1]) ? s->opts->frame_size : info[1];
+            size = (size > FRAME_V2_MAX) ? FRAME_V2_MAX : size;
+            /* Whole words of data, anything smaller than a v1 frame stays one */
+            if (size > FRAME_V2_SIZE(FRAME_V1_DATA)) {
+                s->frame_data = (size - FRAME_HEAD_SIZE - 6) & ~3u;
+            }
+        }
+    }
+    /* Binary blocks leave the HEX parsing to this side */
+    if (!s->opts->compress && !s->opts->records && (s->features & FEATURE_WRITE_BLOCK)) {
+        s->msg_type = MSG_WRITE_BLOCK;
+    }
+    if (s->opts->verbose) {
+        printf("Protocol v%u, features 0x%x, %u data bytes per frame%s\n", s->version, s->features, s->frame_data,
+               (s->msg_type == MSG_WRITE_BLOCK) ? ", binary blocks" : "");
+    }
+    if (s->opts->full) {
+        session_layout(s, NULL);
+    } else {
+        s->state = SESSION_LAYOUT;
+        session_request(s, MSG_SECTOR_CRC, NULL, 0);
+    }
+}
+
+/* Next record to send, records never cross a 64 KB boundary, hence never a sector boundary */
+static const struct plan_record *next_record(struct session *s) {
+    const struct plan *plan = s->plan;
+
+    while (s->next < plan->n_record && !(plan->record[s->next].flags & FRAME_BARRIER) &&
+           !sector_dirty(s, plan->record[s->next].addr)) {
+        s->next++;
+    }
+    return (s->next < plan->n_record) ? &plan->record[s->next] : NULL;
+}
+
+/* Pack records into a v2 frame, an address record only ever starts one */
+static void fill_records(struct session *s) {
+    const struct plan_record *r;
+
+    while ((r = next_record(s))) {
+        if (s->frame_len && ((r->flags & FRAME_BARRIER) || s->frame_len + r->len > s->frame_data)) {
+            break;
+        }
+        if (!s->frame_len) {
+            s->frame_flags = r->flags;
+        }
+        memcpy(s->frame + s->frame_len, r->data, r->len);
+        s->frame_len += r->len;
+        s->next++;
+        if (!(r->flags & FRAME_BARRIER)) {
+            s->written += r->data[0];
+            if (s->opts->verbose) {
+                printf("Writting %lu/%lu bytes of image!\n", s->written, s->total);
+            }
+        }
+    }
+}
+
+/* The next run of a segment to write, word aligned, bytes no segment covers read as erased */
+static u32 next_block(struct session *s, u32 *addr, u32 room) {
+    const struct fw_image *img = s->plan->img;
+
+    while (s->next < img->n_seg) {
+        const struct fw_segment *seg = &img->seg[s->next];
+        u64 end = ((u64)seg->addr + seg->len + 3) & ~3ULL;
+        u64 stop;
+
+        *addr = (seg->addr & ~3u) + s->offset;
+        if (*addr >= end) {
+            s->next++;
+            s->offset = 0;
+            continue;
+        }
+        stop = sector_end(s, *addr);
+        stop = (stop < end) ? stop : end;
+        if (!sector_dirty(s, *addr)) {
+            s->offset += stop - *addr;
+            continue;
+        }
+        return (stop - *addr < room) ? stop - *addr : room;
+    }
+    return 0;
+}
+
+/* Pack binary blocks (u32 address, u32 length, data) into a frame, each one stands on its own */
+static void fill_blocks(struct session *s) {
+    const struct fw_segment *seg;
+    u32 header[2], n, room;
+
+    while ((room = (u32)(s->frame_data - s->frame_len)) > sizeof(header) &&
+           (n = next_block(s, &header[0], (room - sizeof(header)) & ~3u))) {
+        u8 *out = s->frame + s->frame_len + sizeof(header);
+
+        seg = &s->plan->img->seg[s->next];
+        header[1] = n;
+        memcpy(s->frame + s->frame_len, header, sizeof(header));
+        memset(out, 0xFF, n);
+        for (u32 i = 0; i < n; i++) {
+            if (header[0] + i >= seg->addr && header[0] + i - seg->addr < seg->len) {
+                out[i] = seg->data[header[0] + i - seg->addr];
+            }
+        }
+        s->frame_len += sizeof(header) + n;
+        s->offset += n;
+        s->written += n;
+    }
+    if (s->frame_len && s->opts->verbose) {
+        printf("Writting %lu/%lu bytes of image!\n", s->written, s->total);
+    }
+}
+
+/* Cut the stream of dirty blocks (u32 address, u32 length, data) into a frame */
+static void fill_frame(struct session *s) {
+    const struct plan *plan = s->plan;
+
+    while (s->frame_len < s->frame_data && s->next < plan->n_block) {
+        const struct plan_block *b = &plan->block[s->next];
+        u32 header[2] = { b->addr, b->len };
+        u32 n, room = s->frame_data - s->frame_len;
+
+        if (!s->offset && !sector_dirty(s, b->addr)) {
+            s->next++;
+            continue;
+        }
+        if (s->offset < sizeof(header)) {
+            n = sizeof(header) - s->offset;
+            n = (n > room) ? room : n;
+            memcpy(s->frame + s->frame_len, (const u8 *)header + s->offset, n);
+        } else {
+            n = b->size - (s->offset - sizeof(header));
+            n = (n > room) ? room : n;
+            memcpy(s->frame + s->frame_len, b->data + (s->offset - sizeof(header)), n);
+        }
+        s->frame_len += n;
+        s->offset += n;
+        s->stream_len += n;
+        if (s->offset == sizeof(header) + b->size) {
+            s->written += b->len;
+            s->next++;
+            s->offset = 0;
+            if (s->opts->verbose) {
+                printf("Writting %lu/%lu bytes of image!\n", s->written, s->total);
+            }
+        }
+    }
+}
+
+/* Acknowledged frames only prove they arrived, the device's CRC of the flash proves the image */
+static void session_verify(struct session *s) {
+    u32 region[2] = { s->plan->verify_addr, s->plan->verify_len };
+
+    s->state = SESSION_VERIFY;
+    session_request(s, MSG_VERIFY_IMAGE, (const u8 *)region, sizeof(region));
+}
+
+static void session_verified(struct session *s, struct task_struct *recv) {
+    u32 region[3];
+
+    if (usb_err_check(recv) < 0 || recv->data_length != sizeof(region)) {
+        session_finish(s, SESSION_FAILED, "verify failed");
+        return;
+    }
+    memcpy(region, recv->data, sizeof(region));
+    if (region[0] != s->plan->verify_addr || region[1] != s->plan->verify_len || region[2] != s->plan->verify_crc) {
+        session_finish(s, SESSION_FAILED, "image mismatch");
+        return;
+    }
+    session_goto_app(s, "updated, verified");
+}
+
+/* Keep the window full, verify the image once everything is acknowledged */
+static void session_pump(struct session *s) {
+    const struct plan_record *r;
+
+    if (s->opts->compress) {
+        for (;;) {
+            fill_frame(s);
+            if (!s->frame_len || !window_can_queue(&s->win, FRAME_ORDERED)) {
+                break;
+            }
+            if (window_queue(&s->win, s->frame, s->frame_len, FRAME_ORDERED) < 0) {
+                session_finish(s, SESSION_FAILED, "write failed");
+                return;
+            }
+            s->frame_len = 0;
+        }
+        if (s->frame_len || s->next < s->plan->n_block) {
+            return;
+        }
+    } else if (s->msg_type == MSG_WRITE_BLOCK) {
+        for (;;) {
+            fill_blocks(s);
+            if (!s->frame_len || !window_can_queue(&s->win, 0)) {
+                break;
+            }
+            if (window_queue(&s->win, s->frame, s->frame_len, 0) < 0) {
+                session_finish(s, SESSION_FAILED, "write failed");
+                return;
+            }
+            s->frame_len = 0;
+        }
+        if (s->frame_len) {
+            return;
+        }
+    } else if (s->frame_data > FRAME_V1_DATA) {
+        for (;;) {
+            fill_records(s);
+            if (!s->frame_len || !window_can_queue(&s->win, s->frame_flags)) {
+                break;
+            }
+            if (window_queue(&s->win, s->frame, s->frame_len, s->frame_flags) < 0) {
+                session_finish(s, SESSION_FAILED, "write failed");
+                return;
+            }
+            s->frame_len = 0;
+        }
+        if (s->frame_len) {
+            return;
+        }
+    } else {
+        while ((r = next_record(s)) && window_can_queue(&s->win, r->flags)) {
+            if (window_queue_crc(&s->win, r->data, r->len, r->flags, r->crc) < 0) {
+                session_finish(s, SESSION_FAILED, "write failed");
+                return;
+            }
+            s->next++;
+            if (!(r->flags & FRAME_BARRIER)) {
+                s->written += r->data[0];
+                if (s->opts->verbose) {
+                    printf("Writting %lu/%lu bytes of image!\n", s->written, s->total);
+                }
+            }
+        }
+        if (r) {
+            return;
+        }
+    }
+    if (window_idle(&s->win)) {
+        session_verify(s);
+    }
+}
+
+static void session_program(struct session *s) {
+    const struct plan *plan = s->plan;
+
+    s->state = SESSION_PROGRAM;
+    s->timeouts = 0;
+    usb_link_expire(&s->link, SESSION_TIMEOUT_MS);
+    window_init(&s->win, s->fd, s->msg_type, s->opts->window_size);
+    window_attach(&s->win, &s->link);
+    s->next = 0;
+    s->offset = 0;
+    if (s->msg_type == MSG_WRITE_BLOCK) {
+        u32 addr, n;
+        /* A dry run of fill_blocks() */
+        while ((n = next_block(s, &addr, UINT32_MAX))) {
+            s->total += n;
+            s->offset += n;
+        }
+    } else {
+        for (u32 i = 0; i < plan->n_record; i++) {
+            if (!(plan->record[i].flags & FRAME_BARRIER) && sector_dirty(s, plan->record[i].addr)) {
+                s->total += plan->record[i].data[0];
+            }
+        }
+        for (u32 i = 0; i < plan->n_block; i++) {
+            s->total += sector_dirty(s, plan->block[i].addr) ? plan->block[i].len : 0;
+        }
+    }
+    s->next = 0;
+    s->offset = 0;
+    session_pump(s);
+}
+
+static void session_response(struct session *s, struct task_struct *recv) {
+    s->timeouts = 0;
+    usb_link_expire(&s->link, SESSION_TIMEOUT_MS);
+    switch (s->state) {
+    case SESSION_HELLO:
+        if (recv->msg_type == MSG_HELLO) {
+            session_hello(s, recv);
+        }
+        break;
+    case SESSION_LAYOUT:
+        if (recv->msg_type == MSG_SECTOR_CRC) {
+            session_layout(s, recv);
+        }
+        break;
+    case SESSION_ERASE:
+        if (recv->msg_type != MSG_DEV_ERASE) {
+            break;
+        }
+        if (usb_err_check(recv) < 0) {
+            session_finish(s, SESSION_FAILED, "erase failed");
+        } else {
+            session_program(s);
+        }
+        break;
+    case SESSION_PROGRAM:
+        if (recv->msg_type == MSG_ERASE_STATUS) {
+            session_erase_status(s, recv);
+        } else if (window_on_response(&s->win, recv) < 0) {
+            session_finish(s, SESSION_FAILED, "no acknowledge");
+        } else {
+            session_pump(s);
+        }
+        break;
+    case SESSION_VERIFY:
+        if (recv->msg_type == MSG_VERIFY_IMAGE) {
+            session_verified(s, recv);
+        }
+        break;
+    case SESSION_START:
+        if (recv->msg_type == MSG_GOTO_APP) {
+            session_started(s, recv);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void session_timeout(struct session *s) {
+    s->timeouts++;
+    usb_link_expire(&s->link, SESSION_TIMEOUT_MS);
+    switch (s->state) {
+    case SESSION_HELLO:
+        if (s->timeouts >= HELLO_WAIT) {
+            session_hello(s, NULL);
+        }
+        break;
+    case SESSION_LAYOUT:
+        /* Bootloader without MSG_SECTOR_CRC, or a slow one: full update */
+        if (s->timeouts >= CRC_WAIT) {
+            session_layout(s, NULL);
+        }
+        break;
+    case SESSION_ERASE:
+        if (s->timeouts >= ERASE_WAIT) {
+            session_finish(s, SESSION_FAILED, "erase timed out");
+        }
+        break;
+    case SESSION_PROGRAM:
+        if (window_on_timeout(&s->win) < 0) {
+            session_finish(s, SESSION_FAILED, "no acknowledge");
+        } else if (s->erase_deferred) {
+            /* Most likely erasing */
+            usb_link_send(&s->link, MSG_ERASE_STATUS, 0, NULL, 0);
+        }
+        break;
+    case SESSION_VERIFY:
+        /* The device first erases what a deferred erase left */
+        if (s->timeouts >= (s->erase_deferred ? ERASE_WAIT : VERIFY_WAIT)) {
+            session_finish(s, SESSION_FAILED, "verify timed out");
+        }
+        break;
+    case SESSION_START:
+        /* The bootloader is gone before its answer made it out: the application runs */
+        if (s->start_sent) {
+            session_finish(s, SESSION_DONE, s->status);
+        } else if (s->timeouts >= START_WAIT) {
+            session_finish(s, SESSION_FAILED, "write failed");
+        } else {
+            session_start_app(s);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void session_on_recv(struct usb_link *link, struct task_struct *recv) {
+    session_response((struct session *)link->ctx, recv);
+}
+
+static void session_on_timeout(struct usb_link *link) {
+    session_timeout((struct session *)link->ctx);
+}
+
+static void session_on_error(struct usb_link *link, const char *status) {
+    struct session *s = link->ctx;
+
+    /* A device that jumps to the application leaves the bus */
+    if (s->state == SESSION_START && s->start_sent) {
+        session_finish(s, SESSION_DONE, s->status);
+    } else {
+        session_finish(s, SESSION_FAILED, status);
+    }
+}
+
+static const struct usb_link_ops session_ops = {
+    .recv = session_on_recv,
+    .timeout = session_on_timeout,
+    .error = session_on_error,
+};
+
+static void session_start(struct session *s, const struct plan *plan, const struct session_opts *opts) {
+    s->plan = plan;
+    s->opts = opts;
+    s->start = usb_now();
+    if (opts->frame_size && opts->frame_size <= sizeof(struct task_struct)) {
+        session_hello(s, NULL);
+    } else {
+        s->state = SESSION_HELLO;
+        session_request(s, MSG_HELLO, NULL, 0);
+    }
+}
+
+/**
+  * @brief  Start updating a device from an event loop the caller runs
+  * @param  s: prepared with session_open(), on_done and ctx may be set since
+  * @retval 0: started, -1: session_open() had failed, or the start failed and on_done() was called
+*/
+int session_attach(struct session *s, struct usb_loop *loop, const struct plan *plan, const struct session_opts *opts) {
+    if (s->state == SESSION_FAILED) {
+        return -1;
+    }
+    if (usb_link_add(loop, &s->link, s->fd, &session_ops, s) < 0) {
+        session_finish(s, SESSION_FAILED, strerror(errno));
+        return -1;
+    }
+    session_start(s, plan, opts);
+    return 0;
+}
+
+/**
+  * @brief  Update every opened device concurrently from one event loop
+  * @param  s: sessions prepared with session_open(), failed ones are skipped
+  * @retval number of devices that failed, -1: event loop error
+*/
+int session_run(struct session *s, int n, const struct plan *plan, const struct session_opts *opts) {
+    struct usb_loop loop;
+    int ret, failed = 0;
+
+    if (usb_loop_init(&loop, opts->backend) < 0) {
+        if (opts->backend != USB_BACKEND_URING) {
+            return -1;
+        }
+        fprintf(stderr, "io_uring unavailable (%s), using epoll\n", strerror(errno));
+        if (usb_loop_init(&loop, USB_BACKEND_EPOLL) < 0) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        session_attach(&s[i], &loop, plan, opts);
+    }
+    ret = usb_loop_run(&loop);
+    usb_loop_close(&loop);
+    if (ret < 0) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        failed += (s[i].state == SESSION_FAILED);
+    }
+    return failed;
+}
+
+/* One line of the report: a device, or every device together */
+struct report_row {
+    const char *name;
+    const char *status;
+    char sectors[16];
+    u64 frames;
+    u64 retries;
+    u64 nacks;
+    u64 bytes;
+    double sec;
+    const struct hist *rtt;
+};
+
+static void report_row_of(struct report_row *row, const struct session *s) {
+    memset(row, 0, sizeof(*row));
+    row->name = s->path;
+    row->status = s->status ? s->status : "-";
+    snprintf(row->sectors, sizeof(row->sectors), "all");
+    if (s->has_layout) {
+        snprintf(row->sectors, sizeof(row->sectors), "%d/%u", __builtin_popcount(s->dirty), s->layout.n_sector);
+    }
+    row->frames = s->win.frames;
+    row->retries = s->win.retries;
+    row->nacks = s->win.nacks;
+    row->bytes = s->written;
+    row->sec = (s->end > s->start) ? (s->end - s->start) / 1000.0 : 0.0;
+    row->rtt = &s->win.rtt;
+}
+
+static void report_print(const struct report_row *row) {
+    printf("%-20s %-24s %8s %8lu %6lu %6lu %8lu %8lu %8lu %9.0f %8.1f %9.3f\n", row->name, row->status,
+           row->sectors, row->frames, row->retries, row->nacks, hist_percentile(row->rtt, 50),
+           hist_percentile(row->rtt, 99), row->rtt->max, (row->sec > 0) ? row->frames / row->sec : 0.0,
+           (row->sec > 0) ? row->bytes / row->sec / 1024 : 0.0, row->sec);
+}
+
+static void json_string(const char *str) {
+    putchar('"');
+    for (; str && *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            printf("\\%c", *str);
+        } else if ((u8)*str < 0x20) {
+            printf("\\u%04x", *str);
+        } else {
+            putchar(*str);
+        }
+    }
+    putchar('"');
+}
+
+static void report_json(const struct report_row *row) {
+    printf("{\"device\": ");
+    json_string(row->name);
+    printf(", \"status\": ");
+    json_string(row->status);
+    printf(", \"sectors\": ");
+    json_string(row->sectors);
+    printf(", \"frames\": %lu, \"retries\": %lu, \"nacks\": %lu, \"bytes\": %lu, \"seconds\": %.6f, "
+           "\"frames_per_s\": %.1f, \"bytes_per_s\": %.1f, \"rtt_us\": {\"count\": %lu, \"min\": %lu, "
+           "\"mean\": %.1f, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}}",
+           row->frames, row->retries, row->nacks, row->bytes, row->sec,
+           (row->sec > 0) ? row->frames / row->sec : 0.0, (row->sec > 0) ? row->bytes / row->sec : 0.0,
+           row->rtt->total, row->rtt->min, row->rtt->total ? (double)row->rtt->sum / row->rtt->total : 0.0,
+           hist_percentile(row->rtt, 50), hist_percentile(row->rtt, 90), hist_percentile(row->rtt, 99),
+           hist_percentile(row->rtt, 99.9), row->rtt->max);
+}
+
+/**
+  * @brief  Print what every device did: frames, retransmissions, NACKs, the round trip
+  * time of the window frames and the throughput, with a total line for several devices
+  * @param  json: one JSON object instead of the table
+*/
+void session_report(const struct session *s, int n, int json) {
+    static struct hist rtt;
+    struct report_row row, total = { .name = "total", .status = "-", .sectors = "-", .rtt = &rtt };
+    int64_t start = 0, end = 0;
+
+    hist_reset(&rtt);
+    if (json) {
+        printf("{\"devices\": [");
+    } else {
+        printf("%-20s %-24s %8s %8s %6s %6s %8s %8s %8s %9s %8s %9s\n", "Device", "Status", "Sectors", "Frames",
+               "Retx", "NACK", "p50 us", "p99 us", "max us", "Frames/s", "KB/s", "Time (s)");
+    }
+    for (int i = 0; i < n; i++) {
+        report_row_of(&row, &s[i]);
+        if (json) {
+            printf("%s", i ? ",\n  " : "\n  ");
+            report_json(&row);
+        } else {
+            report_print(&row);
+        }
+        total.frames += row.frames;
+        total.retries += row.retries;
+        total.nacks += row.nacks;
+        total.bytes += row.bytes;
+        hist_merge(&rtt, row.rtt);
+        if (s[i].end > s[i].start) {
+            start = (!start || s[i].start < start) ? s[i].start : start;
+            end = (s[i].end > end) ? s[i].end : end;
+        }
+    }
+    total.sec = (end > start) ? (end - start) / 1000.0 : 0.0;
+    if (json) {
+        printf("\n], \"total\": ");
+        report_json(&total);
+        printf("}\n");
+    } else if (n > 1) {
+        report_print(&total);
+    }
+}
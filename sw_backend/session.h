@@ -0,0 +1,89 @@
+#ifndef __SESSION_H__
+#define __SESSION_H__
+#include "protocol.h"
+#include "window.h"
+#include "transport.h"
+#include "plan.h"
+
+#define SESSION_TIMEOUT_MS	1000	/* the driver's read timeout */
+#define ERASE_WAIT			16		/* timeouts to wait for the erase to finish, 2 s a 128 KB sector at worst */
+#define CRC_WAIT			2
+#define HELLO_WAIT			2
+#define VERIFY_WAIT			2
+#define START_WAIT			2		/* timeouts to get MSG_GOTO_APP out, silence after it means started */
+#define MAX_SECTORS			((sizeof(((struct task_struct *)0)->data) - 8) / 4)
+
+/* Application region of the device, as reported by MSG_SECTOR_CRC */
+struct flash_layout {
+	u32 base;
+	u32 sector_size;
+	u32 n_sector;
+	u32 crc[MAX_SECTORS];
+};
+
+enum session_state {
+	SESSION_HELLO,
+	SESSION_LAYOUT,
+	SESSION_ERASE,
+	SESSION_PROGRAM,
+	SESSION_VERIFY,
+	SESSION_START,
+	SESSION_DONE,
+	SESSION_FAILED
+};
+
+struct session_opts {
+	int full;			/* skip the sector comparison, rewrite everything */
+	int compress;		/* the plan holds compressed blocks */
+	int records;		/* HEX records even if the device takes MSG_WRITE_BLOCK */
+	int erase_first;	/* wait for the erase before writing even if the device can defer it */
+	u16 window_size;
+	u16 frame_size;		/* largest frame, 0: what the device offers, 64: v1 frames only */
+	int verbose;		/* print progress, a line per record or block */
+	int backend;		/* USB_BACKEND_EPOLL or USB_BACKEND_URING */
+};
+
+/* One device being updated */
+struct session {
+	const char *path;
+	int fd;
+	struct usb_link link;
+	enum session_state state;
+	const char *status;
+	const struct plan *plan;
+	const struct session_opts *opts;
+	struct flash_layout layout;
+	int has_layout;
+	/* MSG_HELLO, version 1 and no features when the bootloader does not know it */
+	u16 version;
+	u32 features;
+	u16 frame_data;		/* data bytes of a program frame */
+	u16 msg_type;		/* of the program frames */
+	u32 dirty;			/* bit n: sector n of the layout gets rewritten */
+	int erase_deferred;	/* ERASE_ON_DEMAND: the device erases while the image is written */
+	int start_sent;		/* MSG_GOTO_APP went out, the status to finish with is kept in status */
+	struct tx_window win;
+	/* Position in the plan */
+	u32 next;			/* next record, block or segment */
+	u32 offset;			/* bytes of the current block sent, header included, or of the segment */
+	u8 frame[FRAME_V2_MAX_DATA];
+	u16 frame_len;
+	u8 frame_flags;
+	int timeouts;
+	/* Statistic */
+	int64_t start;
+	int64_t end;
+	u64 total;			/* image bytes to write */
+	u64 written;
+	u64 stream_len;
+	/* Called once the session is done or failed, its link is already removed */
+	void (*on_done)(struct session *s);
+	void *ctx;
+};
+
+int session_open(struct session *s, const char *path);
+int session_attach(struct session *s, struct usb_loop *loop, const struct plan *plan, const struct session_opts *opts);
+int session_run(struct session *s, int n, const struct plan *plan, const struct session_opts *opts);
+void session_report(const struct session *s, int n, int json);
+
+#endif
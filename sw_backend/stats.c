@@ -0,0 +1,74 @@
+#include <string.h>
+#include "stats.h"
+
+static u32 hist_index(u64 value) {
+    u32 shift;
+
+    if (value < HIST_SUB) {
+        return value;
+    }
+    shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    if (shift >= HIST_MAX_BITS - HIST_SUB_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    return (shift + 1) * HIST_SUB + (u32)(value >> shift) - HIST_SUB;
+}
+
+/* Largest value that lands in bucket index */
+static u64 hist_value(u32 index) {
+    u32 shift;
+
+    if (index < HIST_SUB) {
+        return index;
+    }
+    shift = index / HIST_SUB - 1;
+    return ((u64)(index % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+void hist_reset(struct hist *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+void hist_record(struct hist *h, u64 value) {
+    h->count[hist_index(value)]++;
+    h->min = (!h->total || value < h->min) ? value : h->min;
+    h->max = (value > h->max) ? value : h->max;
+    h->sum += value;
+    h->total++;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src) {
+    if (!src->total) {
+        return;
+    }
+    for (u32 i = 0; i < HIST_BUCKETS; i++) {
+        dst->count[i] += src->count[i];
+    }
+    dst->min = (!dst->total || src->min < dst->min) ? src->min : dst->min;
+    dst->max = (src->max > dst->max) ? src->max : dst->max;
+    dst->sum += src->sum;
+    dst->total += src->total;
+}
+
+/**
+  * @brief  Value below which the given share of the recorded values lies
+  * @param  percentile: 0 to 100
+  * @retval upper bound of the bucket it falls into, never above the largest value, 0: empty
+*/
+u64 hist_percentile(const struct hist *h, double percentile) {
+    u64 rank, seen = 0;
+
+    if (!h->total) {
+        return 0;
+    }
+    rank = (u64)(percentile / 100.0 * h->total + 0.5);
+    rank = (rank < 1) ? 1 : (rank > h->total) ? h->total : rank;
+    for (u32 i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen >= rank) {
+            u64 value = (i == HIST_BUCKETS - 1) ? h->max : hist_value(i);
+            return (value > h->max) ? h->max : (value < h->min) ? h->min : value;
+        }
+    }
+    return h->max;
+}
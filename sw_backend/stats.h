@@ -0,0 +1,25 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+#include "protocol.h"
+
+/* Log-linear latency histogram (HDR style): values below HIST_SUB are exact, above
+ * that every power of two is split into HIST_SUB buckets, about 3 % resolution */
+#define HIST_SUB_BITS		5
+#define HIST_SUB			(1u << HIST_SUB_BITS)
+#define HIST_MAX_BITS		32	/* values up to 2^32 us, larger ones land in the last bucket */
+#define HIST_BUCKETS		((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	u64 count[HIST_BUCKETS];
+	u64 total;			/* number of values */
+	u64 sum;
+	u64 min;
+	u64 max;
+};
+
+void hist_reset(struct hist *h);
+void hist_record(struct hist *h, u64 value);
+void hist_merge(struct hist *dst, const struct hist *src);
+u64 hist_percentile(const struct hist *h, double percentile);
+
+#endif
@@ -0,0 +1,526 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "transport.h"
+
+#define OP_READ			0
+#define OP_WRITE		1
+#define OP_CANCEL		2
+
+/* What a submitted request belongs to, user_data is its index */
+struct usb_op {
+    struct usb_link *link;
+    int type;
+    int next_free;
+};
+
+/* io_uring without liburing: the rings are mapped straight from the kernel */
+struct usb_ring {
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned to_submit;
+    int in_flight;
+    int free_op;
+    struct usb_op op[USB_URING_ENTRIES];
+};
+
+int64_t usb_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Same clock in microseconds, for latency measurements */
+int64_t usb_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *ring_map(int fd, size_t len, off_t offset) {
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+static int ring_setup(struct usb_loop *loop) {
+    struct io_uring_params p;
+    struct usb_ring *ring;
+
+    memset(&p, 0, sizeof(p));
+    loop->fd = syscall(__NR_io_uring_setup, USB_URING_ENTRIES, &p);
+    if (loop->fd < 0) {
+        return -1;
+    }
+    /* Waiting with a timeout needs IORING_ENTER_EXT_ARG (Linux 5.11) */
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOSYS;
+        return -1;
+    }
+    ring = (struct usb_ring *)calloc(1, sizeof(*ring));
+    if (!ring) {
+        return -1;
+    }
+    loop->ring = ring;
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_len = (ring->cq_len > ring->sq_len) ? ring->cq_len : ring->sq_len;
+        ring->cq_len = ring->sq_len;
+    }
+    ring->sq_ptr = ring_map(loop->fd, ring->sq_len, IORING_OFF_SQ_RING);
+    if (!ring->sq_ptr) {
+        return -1;
+    }
+    ring->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ptr : ring_map(loop->fd, ring->cq_len, IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe *)ring_map(loop->fd, ring->sqes_len, IORING_OFF_SQES);
+    if (!ring->cq_ptr || !ring->sqes) {
+        return -1;
+    }
+    ring->sq_tail = (unsigned *)((u8 *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((u8 *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((u8 *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *)((u8 *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((u8 *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((u8 *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((u8 *)ring->cq_ptr + p.cq_off.cqes);
+    /* Requests in flight never exceed the SQ size, so the SQ never overflows */
+    for (int i = 0; i < USB_URING_ENTRIES; i++) {
+        ring->op[i].next_free = i + 1;
+    }
+    ring->op[USB_URING_ENTRIES - 1].next_free = -1;
+    return 0;
+}
+
+static void ring_release(struct usb_ring *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    if (ring->sq_ptr) {
+        munmap(ring->sq_ptr, ring->sq_len);
+    }
+    free(ring);
+}
+
+/* Queue a request, it is submitted with the next wait */
+static struct io_uring_sqe *ring_prep(struct usb_loop *loop, struct usb_link *link, int type) {
+    struct usb_ring *ring = loop->ring;
+    struct io_uring_sqe *sqe;
+    unsigned tail = *ring->sq_tail, idx = tail & *ring->sq_mask;
+    int op = ring->free_op;
+
+    if (op < 0) {
+        errno = EAGAIN;
+        return NULL;
+    }
+    ring->free_op = ring->op[op].next_free;
+    ring->op[op].link = link;
+    ring->op[op].type = type;
+    ring->in_flight++;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = op;
+    ring->sq_array[idx] = idx;
+    /* Only io_uring_enter() from this thread reads the SQE, after it is filled */
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+static int ring_read(struct usb_loop *loop, struct usb_link *link) {
+    struct io_uring_sqe *sqe = ring_prep(loop, link, OP_READ);
+
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = link->fd;
+    sqe->addr = (u64)(uintptr_t)(link->rx + link->rx_len);
+    sqe->len = sizeof(link->rx) - link->rx_len;
+    sqe->off = (u64)-1;
+    link->read_op = (int)sqe->user_data;
+    return 0;
+}
+
+/* Submit the oldest queued frame of a link. One write at a time keeps the frames in
+ * order: concurrent writes may overtake each other, and an IOSQE_IO_LINK chain fails
+ * as a whole when one write is interrupted */
+static int ring_write(struct usb_loop *loop, struct usb_link *link) {
+    struct io_uring_sqe *sqe = ring_prep(loop, link, OP_WRITE);
+
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = link->fd;
+    sqe->addr = (u64)(uintptr_t)link->tx[link->tx_sent % USB_LINK_TX_SLOTS];
+    sqe->len = link->tx_len[link->tx_sent % USB_LINK_TX_SLOTS];
+    sqe->off = (u64)-1;
+    link->tx_sent++;
+    return 0;
+}
+
+static void link_fail(struct usb_link *link, const char *status) {
+    usb_link_remove(link);
+    link->ops->error(link, status);
+}
+
+static void link_frame(struct usb_link *link, int len) {
+    link->rx_len += len;
+    if (link->rx_len == sizeof(link->rx)) {
+        link->rx_len = 0;
+        link->ops->recv(link, (struct task_struct *)link->rx);
+    }
+}
+
+static void ring_complete(struct usb_loop *loop, struct usb_op *op, int res) {
+    struct usb_link *link = op->link;
+
+    switch (op->type) {
+    case OP_READ:
+        link->read_op = -1;
+        if (link->loop != loop) {
+            break;
+        }
+        if (res < 0) {
+            link_fail(link, strerror(-res));
+            break;
+        }
+        /* 0: the driver's read timed out, nothing arrived */
+        link_frame(link, res);
+        if (link->loop == loop && ring_read(loop, link) < 0) {
+            link_fail(link, strerror(errno));
+        }
+        break;
+    case OP_WRITE:
+        if (res == -EINTR || res == -EAGAIN) {
+            /* Issued while task work was pending, a tty gives up on its lock: write it again */
+            link->tx_sent = link->tx_head;
+            ring_write(loop, link);
+            break;
+        }
+        link->tx_head++;
+        if (res < 0) {
+            if (link->loop == loop) {
+                link_fail(link, strerror(-res));
+            }
+        } else if (link->tx_head == link->tx_sent && link->tx_sent != link->tx_tail) {
+            ring_write(loop, link);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static int ring_wait(struct usb_loop *loop, int64_t wait) {
+    struct usb_ring *ring = loop->ring;
+    struct __kernel_timespec ts = { .tv_sec = wait / 1000, .tv_nsec = (wait % 1000) * 1000000 };
+    struct io_uring_getevents_arg arg = {
+        .sigmask_sz = _NSIG / 8,
+        .ts = (wait >= 0) ? (u64)(uintptr_t)&ts : 0,
+    };
+    unsigned head;
+    int ret;
+
+    ret = syscall(__NR_io_uring_enter, loop->fd, ring->to_submit, 1,
+                  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret < 0 && errno != ETIME && errno != EINTR) {
+        return -1;
+    }
+    if (ret > 0) {
+        ring->to_submit -= ret;
+    }
+    head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        int index = (int)cqe->user_data, res = cqe->res;
+        struct usb_op op = ring->op[index];
+
+        __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+        ring->op[index].next_free = ring->free_op;
+        ring->free_op = index;
+        ring->in_flight--;
+        ring_complete(loop, &op, res);
+        head = *ring->cq_head;
+    }
+    return 0;
+}
+
+/* Read what the device sent, responses may arrive in pieces */
+static void link_readable(struct usb_link *link) {
+    while (link->loop) {
+        ssize_t ret = read(link->fd, link->rx + link->rx_len, sizeof(link->rx) - link->rx_len);
+        if (ret < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (ret <= 0) {
+            link_fail(link, ret ? strerror(errno) : "device closed");
+            return;
+        }
+        link_frame(link, ret);
+    }
+}
+
+static int epoll_dispatch(struct usb_loop *loop, int64_t wait) {
+    struct epoll_event ev[USB_LOOP_EVENTS];
+    int ready = epoll_wait(loop->fd, ev, USB_LOOP_EVENTS, (int)wait);
+
+    if (ready < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+    for (int i = 0; i < ready; i++) {
+        struct usb_link *link = ev[i].data.ptr;
+        /* Watches are tagged in bit 0, links and watches are at least word aligned */
+        if (ev[i].data.u64 & 1) {
+            struct usb_watch *watch = (struct usb_watch *)(uintptr_t)(ev[i].data.u64 & ~1ull);
+            if (watch->loop) {
+                watch->ready(watch);
+            }
+            continue;
+        }
+        if (!link->loop) {
+            continue;
+        }
+        if (ev[i].events & EPOLLIN) {
+            link_readable(link);
+        } else if (ev[i].events & (EPOLLERR | EPOLLHUP)) {
+            link_fail(link, "device lost");
+        }
+    }
+    return 0;
+}
+
+/**
+  * @brief  Create an event loop
+  * @param  backend: USB_BACKEND_EPOLL or USB_BACKEND_URING
+  * @retval 0: success, -1: failed (ENOSYS: io_uring is too old or missing)
+*/
+int usb_loop_init(struct usb_loop *loop, int backend) {
+    int err;
+
+    memset(loop, 0, sizeof(*loop));
+    loop->backend = backend;
+    if (backend == USB_BACKEND_URING) {
+        if (ring_setup(loop) == 0) {
+            return 0;
+        }
+        err = errno;
+        usb_loop_close(loop);
+        errno = err;
+        return -1;
+    }
+    loop->fd = epoll_create1(EPOLL_CLOEXEC);
+    return (loop->fd < 0) ? -1 : 0;
+}
+
+void usb_loop_close(struct usb_loop *loop) {
+    if (loop->ring) {
+        ring_release(loop->ring);
+        loop->ring = NULL;
+    }
+    if (loop->fd >= 0) {
+        close(loop->fd);
+    }
+    loop->fd = -1;
+}
+
+/**
+  * @brief  Dispatch reads, writes and deadlines until every link and watch is removed
+  * @note   Removed links must stay allocated until it returns, io_uring may still complete on them
+  * @retval 0: success, -1: failed
+*/
+int usb_loop_run(struct usb_loop *loop) {
+    struct usb_link *link, *next;
+
+    while (loop->n_link || loop->n_watch || (loop->ring && loop->ring->in_flight)) {
+        int64_t now = usb_now(), wait = -1;
+        int ret;
+
+        for (link = loop->links; link; link = link->next) {
+            if (link->deadline && (wait < 0 || link->deadline - now < wait)) {
+                wait = (link->deadline > now) ? link->deadline - now : 0;
+            }
+        }
+        ret = (loop->backend == USB_BACKEND_URING) ? ring_wait(loop, wait) : epoll_dispatch(loop, wait);
+        if (ret < 0) {
+            return -1;
+        }
+        now = usb_now();
+        for (link = loop->links; link; link = next) {
+            next = link->next;
+            if (link->deadline && link->deadline <= now) {
+                link->deadline = 0;
+                link->ops->timeout(link);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+  * @brief  Watch a device, its callbacks run from usb_loop_run()
+  * @param  ctx: anything the callbacks need, stored in link->ctx
+  * @retval 0: success, -1: failed
+*/
+int usb_link_add(struct usb_loop *loop, struct usb_link *link, int fd, const struct usb_link_ops *ops, void *ctx) {
+    int flags = fcntl(fd, F_GETFL);
+
+    memset(link, 0, sizeof(*link));
+    link->fd = fd;
+    link->ops = ops;
+    link->ctx = ctx;
+    link->read_op = -1;
+    if (flags < 0) {
+        return -1;
+    }
+    if (loop->backend == USB_BACKEND_URING) {
+        /* The read waits in the kernel instead of failing with EAGAIN */
+        if (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0 || ring_read(loop, link) < 0) {
+            return -1;
+        }
+    } else {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = link };
+        if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 || epoll_ctl(loop->fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            return -1;
+        }
+    }
+    link->loop = loop;
+    link->next = loop->links;
+    loop->links = link;
+    loop->n_link++;
+    return 0;
+}
+
+/* Stop watching a device, frames it already queued still go out */
+void usb_link_remove(struct usb_link *link) {
+    struct usb_loop *loop = link->loop;
+    struct usb_link **p;
+
+    if (!loop) {
+        return;
+    }
+    for (p = &loop->links; *p; p = &(*p)->next) {
+        if (*p == link) {
+            *p = link->next;
+            break;
+        }
+    }
+    loop->n_link--;
+    link->loop = NULL;
+    link->deadline = 0;
+    if (loop->backend == USB_BACKEND_URING) {
+        if (link->read_op >= 0) {
+            struct io_uring_sqe *sqe = ring_prep(loop, NULL, OP_CANCEL);
+            if (sqe) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = (u64)link->read_op;
+            }
+        }
+    } else {
+        epoll_ctl(loop->fd, EPOLL_CTL_DEL, link->fd, NULL);
+    }
+}
+
+/**
+  * @brief  Send a frame without waiting
+  * @retval 0: success, -1: failed (EAGAIN: the queue is full, the frame is lost)
+*/
+int usb_link_send(struct usb_link *link, u16 msg_type, u16 seq, const u8 *data, u16 data_len) {
+    return usb_link_send_crc(link, msg_type, seq, data, data_len, usb_frame_crc(data, data_len));
+}
+
+/* Like usb_link_send(), with the frame check known beforehand: data beyond a v1 frame goes as a v2 frame */
+int usb_link_send_crc(struct usb_link *link, u16 msg_type, u16 seq, const u8 *data, u16 data_len, u32 crc) {
+    struct usb_loop *loop = link->loop;
+    u16 slot = link->tx_tail % USB_LINK_TX_SLOTS;
+
+    if (!loop) {
+        errno = ENODEV;
+        return -1;
+    }
+    if (data_len > FRAME_V2_MAX_DATA) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (loop->backend != USB_BACKEND_URING) {
+        u32 len = usb_fill_frame(link->tx[0], msg_type, seq, data, data_len, crc);
+        return (write(link->fd, link->tx[0], len) < 0) ? -1 : 0;
+    }
+    if ((u16)(link->tx_tail - link->tx_head) == USB_LINK_TX_SLOTS) {
+        errno = EAGAIN;
+        return -1;
+    }
+    link->tx_len[slot] = usb_fill_frame(link->tx[slot], msg_type, seq, data, data_len, crc);
+    link->tx_tail++;
+    /* Frames queued behind a write in flight go out as it completes */
+    if (link->tx_head == link->tx_sent) {
+        return ring_write(loop, link);
+    }
+    return 0;
+}
+
+/* Call the timeout callback after timeout_ms, a negative timeout clears the deadline */
+void usb_link_expire(struct usb_link *link, int timeout_ms) {
+    link->deadline = (timeout_ms < 0) ? 0 : usb_now() + timeout_ms;
+}
+
+/**
+  * @brief  Call ready() whenever fd is readable, from usb_loop_run()
+  * @retval 0: success, -1: failed (EOPNOTSUPP with io_uring)
+*/
+int usb_watch_add(struct usb_loop *loop, struct usb_watch *watch, int fd, void (*ready)(struct usb_watch *watch), void *ctx) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = (uintptr_t)watch | 1 };
+
+    memset(watch, 0, sizeof(*watch));
+    watch->fd = fd;
+    watch->ready = ready;
+    watch->ctx = ctx;
+    if (loop->backend != USB_BACKEND_EPOLL) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (epoll_ctl(loop->fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        return -1;
+    }
+    watch->loop = loop;
+    watch->next = loop->watches;
+    loop->watches = watch;
+    loop->n_watch++;
+    return 0;
+}
+
+/* Stop watching, the descriptor stays open */
+void usb_watch_remove(struct usb_watch *watch) {
+    struct usb_loop *loop = watch->loop;
+    struct usb_watch **p;
+
+    if (!loop) {
+        return;
+    }
+    for (p = &loop->watches; *p; p = &(*p)->next) {
+        if (*p == watch) {
+            *p = watch->next;
+            break;
+        }
+    }
+    loop->n_watch--;
+    watch->loop = NULL;
+    epoll_ctl(loop->fd, EPOLL_CTL_DEL, watch->fd, NULL);
+}
@@ -0,0 +1,77 @@
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+#include "protocol.h"
+
+/* Backends of the event loop */
+#define USB_BACKEND_EPOLL	0
+#define USB_BACKEND_URING	1
+
+#define USB_LOOP_EVENTS		16
+#define USB_URING_ENTRIES	256
+#define USB_LINK_TX_SLOTS	32	/* frames a link queues with io_uring, one per window frame */
+
+struct usb_link;
+struct usb_ring;
+struct usb_watch;
+
+/* Called from usb_loop_run(), a callback may remove its own link but no other */
+struct usb_link_ops {
+	void (*recv)(struct usb_link *link, struct task_struct *recv);	/* a whole frame arrived */
+	void (*timeout)(struct usb_link *link);							/* the deadline passed, it is cleared */
+	void (*error)(struct usb_link *link, const char *status);		/* the link is already removed */
+};
+
+/* One device in the event loop */
+struct usb_link {
+	int fd;
+	const struct usb_link_ops *ops;
+	void *ctx;
+	struct usb_loop *loop;		/* NULL once removed */
+	struct usb_link *next;
+	int64_t deadline;			/* 0: none */
+	/* Frame being received, it may arrive in pieces */
+	u8 rx[sizeof(struct task_struct)];
+	u16 rx_len;
+	/* io_uring only, queued frames are written one at a time */
+	int read_op;				/* -1: no read submitted */
+	u16 tx_head;				/* oldest frame not written yet */
+	u16 tx_sent;				/* first frame not submitted */
+	u16 tx_tail;				/* next free slot */
+	u8 tx[USB_LINK_TX_SLOTS][FRAME_V2_MAX];	/* v1 or v2 frames */
+	u16 tx_len[USB_LINK_TX_SLOTS];
+};
+
+/* Any other descriptor the loop waits on, the sockets of a daemon. epoll backend only */
+struct usb_watch {
+	int fd;
+	void (*ready)(struct usb_watch *watch);	/* readable or hung up, level triggered */
+	void *ctx;
+	struct usb_loop *loop;		/* NULL once removed */
+	struct usb_watch *next;
+};
+
+/* Many links, one thread */
+struct usb_loop {
+	int backend;
+	int fd;						/* epoll or io_uring instance */
+	struct usb_link *links;
+	int n_link;
+	struct usb_watch *watches;
+	int n_watch;
+	struct usb_ring *ring;
+};
+
+int64_t usb_now(void);
+int64_t usb_now_us(void);
+int usb_loop_init(struct usb_loop *loop, int backend);
+void usb_loop_close(struct usb_loop *loop);
+int usb_loop_run(struct usb_loop *loop);
+int usb_link_add(struct usb_loop *loop, struct usb_link *link, int fd, const struct usb_link_ops *ops, void *ctx);
+void usb_link_remove(struct usb_link *link);
+int usb_link_send(struct usb_link *link, u16 msg_type, u16 seq, const u8 *data, u16 data_len);
+int usb_link_send_crc(struct usb_link *link, u16 msg_type, u16 seq, const u8 *data, u16 data_len, u32 crc);
+void usb_link_expire(struct usb_link *link, int timeout_ms);
+int usb_watch_add(struct usb_loop *loop, struct usb_watch *watch, int fd, void (*ready)(struct usb_watch *watch), void *ctx);
+void usb_watch_remove(struct usb_watch *watch);
+
+#endif
@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "window.h"
+#include "transport.h"
+
+#define SLOT(win, seq)		(&(win)->slot[(u16)(seq) % WINDOW_MAX])
+
+static u16 window_in_flight(struct tx_window *win) {
+    return (u16)(win->next - win->base);
+}
+
+static int window_send(struct tx_window *win, struct tx_frame *frame) {
+    int ret;
+
+    if (frame->tries++ > WINDOW_RETRIES) {
+        fprintf(stderr, "Frame %u was not acknowledged after %d retries\n", frame->seq, WINDOW_RETRIES);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (frame->tries > 1) {
+        win->retries++;
+    }
+    frame->sent_us = usb_now_us();
+    frame->sent_order = ++win->sends;
+    /* A full driver queue loses the frame like the link would, it goes again on timeout */
+    if (win->link) {
+        ret = usb_link_send_crc(win->link, win->msg_type, frame->seq, frame->data, frame->len, frame->crc);
+    } else {
+        u32 len = usb_fill_frame(win->send_buf, win->msg_type, frame->seq, frame->data, frame->len, frame->crc);
+        ret = write(win->dev_fd, win->send_buf, len);
+    }
+    if (ret < 0 && errno != EAGAIN) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Resend unacknowledged frames, up to (not including) seq 'until' */
+static int window_resend(struct tx_window *win, u16 until) {
+    for (u16 seq = win->base; seq != until; seq++) {
+        struct tx_frame *frame = SLOT(win, seq);
+        if (!frame->acked && window_send(win, frame) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Only a frame sent once tells its round trip, a later ACK may answer any copy */
+static void window_acked(struct tx_window *win, struct tx_frame *frame, int64_t now) {
+    if (!frame->acked && frame->tries == 1) {
+        hist_record(&win->rtt, now - frame->sent_us);
+    }
+    frame->acked = 1;
+}
+
+static void window_ack(struct tx_window *win, u16 cum_ack, u32 sack) {
+    int16_t delta = (int16_t)(cum_ack - win->base);
+    int64_t now = usb_now_us();
+
+    if (delta >= 0 && delta < window_in_flight(win)) {
+        for (u16 seq = win->base; seq != (u16)(cum_ack + 1); seq++) {
+            window_acked(win, SLOT(win, seq), now);
+        }
+    }
+    /* Bit n: frame cum_ack + 2 + n, cum_ack + 1 is the hole */
+    for (int i = 0; i < WINDOW_MAX; i++) {
+        u16 seq = cum_ack + 2 + i;
+        if ((sack & (1UL << i)) && (u16)(seq - win->base) < window_in_flight(win)) {
+            window_acked(win, SLOT(win, seq), now);
+        }
+    }
+    while (win->base != win->next && SLOT(win, win->base)->acked) {
+        win->base++;
+    }
+}
+
+/* Frames sent before the newest one the device holds are lost: the link keeps the
+ * order. A copy sent after it is still on its way, it goes again on timeout only */
+static int window_resend_lost(struct tx_window *win, u16 cum_ack, u32 sack) {
+    struct tx_frame *newest = NULL;
+
+    for (int i = WINDOW_MAX - 1; i >= 0; i--) {
+        u16 seq = cum_ack + 2 + i;
+        if ((sack & (1UL << i)) && (u16)(seq - win->base) < window_in_flight(win)) {
+            newest = SLOT(win, seq);
+            break;
+        }
+    }
+    if (!newest) {
+        return 0;
+    }
+    for (u16 seq = win->base; seq != newest->seq; seq++) {
+        struct tx_frame *frame = SLOT(win, seq);
+        if (!frame->acked && (int32_t)(frame->sent_order - newest->sent_order) < 0 && window_send(win, frame) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+  * @brief  Process a response of the device: acknowledge and retransmit what it is missing
+  * @retval 0: success (including responses that do not belong to the window), -1: failed
+*/
+int window_on_response(struct tx_window *win, struct task_struct *recv) {
+    u32 sack;
+    u16 newest;
+
+    if (usb_fmt_check(recv) < 0 || recv->msg_type != win->msg_type || recv->data_length != sizeof(u32)) {
+        return 0;
+    }
+    memcpy(&sack, recv->data, sizeof(u32));
+    window_ack(win, recv->seq, sack);
+    if (recv->msg_error != MSG_SUCCESS) {
+        win->nacks++;
+        if (SLOT(win, win->base)->flags & FRAME_ORDERED) {
+            /* Go back N: everything after the hole was dropped as well, a frame dropped
+             * out of order (MSG_INVALID) tells the hole is lost. Once per hole, the
+             * answers to the frames sent before the resend are still coming */
+            if (win->resent && win->resent_base == win->base) {
+                return 0;
+            }
+            win->resent = 1;
+            win->resent_base = win->base;
+            return window_resend(win, win->next);
+        }
+        if (recv->msg_error == MSG_INVALID) {
+            /* Dropped out of order, goes again with the frame it waited for */
+            return 0;
+        }
+        /* Resend only the holes below the newest frame the device holds */
+        newest = win->base + 1;
+        for (int i = WINDOW_MAX - 1; i >= 0; i--) {
+            if (sack & (1UL << i)) {
+                newest = recv->seq + 2 + i;
+                break;
+            }
+        }
+        if ((u16)(newest - win->base) > window_in_flight(win)) {
+            newest = win->next;
+        }
+        return window_resend(win, newest);
+    }
+    return window_resend_lost(win, recv->seq, sack);
+}
+
+/**
+  * @brief  No response in time: the whole window may be lost
+  * @retval 0: success, -1: a frame ran out of retries (errno = ETIMEDOUT)
+*/
+int window_on_timeout(struct tx_window *win) {
+    return window_resend(win, win->next);
+}
+
+/* Wait for one response */
+static int window_service(struct tx_window *win) {
+    int ret = usb_recv_timeout(win->dev_fd, &win->recv_task, WINDOW_TIMEOUT_MS);
+    if (ret < 0) {
+        return -1;
+    }
+    return ret ? window_on_response(win, &win->recv_task) : window_on_timeout(win);
+}
+
+/**
+  * @brief  Initialize a window sender, sequence numbers restart from 0
+  * @param  size: number of frames in flight, 1 gives stop-and-wait
+*/
+void window_init(struct tx_window *win, int dev_fd, u16 msg_type, u16 size) {
+    memset(win, 0, sizeof(*win));
+    win->dev_fd = dev_fd;
+    win->msg_type = msg_type;
+    win->size = (size == 0) ? 1 : (size > WINDOW_MAX) ? WINDOW_MAX : size;
+}
+
+/* Send through an event loop link instead of writing the device directly */
+void window_attach(struct tx_window *win, struct usb_link *link) {
+    win->link = link;
+}
+
+/* Whether window_queue() can take a frame with these flags right now */
+int window_can_queue(struct tx_window *win, u8 flags) {
+    u16 in_flight = window_in_flight(win);
+    if (flags & FRAME_BARRIER) {
+        return in_flight == 0;
+    }
+    return in_flight < win->size && !(in_flight && (SLOT(win, win->base)->flags & FRAME_BARRIER));
+}
+
+/* Whether every queued frame is acknowledged */
+int window_idle(struct tx_window *win) {
+    return window_in_flight(win) == 0;
+}
+
+/**
+  * @brief  Send a new frame without waiting, only when window_can_queue() allows it
+  * @retval 0: success, -1: failed
+*/
+int window_queue(struct tx_window *win, const u8 *data, u16 len, u8 flags) {
+    if (len > sizeof(win->slot[0].data)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return window_queue_crc(win, data, len, flags, usb_frame_crc(data, len));
+}
+
+/* Like window_queue(), crc: usb_frame_crc() of the frame, e.g. from a plan */
+int window_queue_crc(struct tx_window *win, const u8 *data, u16 len, u8 flags, u32 crc) {
+    struct tx_frame *frame;
+
+    if (len > sizeof(frame->data)) {
+        errno = EINVAL;
+        return -1;
+    }
+    frame = SLOT(win, win->next);
+    memcpy(frame->data, data, len);
+    frame->len = len;
+    frame->crc = crc;
+    frame->seq = win->next;
+    frame->flags = flags;
+    frame->acked = 0;
+    frame->tries = 0;
+    win->next++;
+    win->frames++;
+    return window_send(win, frame);
+}
+
+/**
+  * @brief  Queue a frame, blocks while the window is full
+  * @retval 0: success, -1: failed
+*/
+int window_push(struct tx_window *win, const u8 *data, u16 len, u8 flags) {
+    while (!window_can_queue(win, flags)) {
+        if (window_service(win) < 0) {
+            return -1;
+        }
+    }
+    return window_queue(win, data, len, flags);
+}
+
+/**
+  * @brief  Wait until every queued frame is acknowledged
+  * @retval 0: success, -1: failed
+*/
+int window_flush(struct tx_window *win) {
+    while (window_in_flight(win)) {
+        if (window_service(win) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
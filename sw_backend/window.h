@@ -0,0 +1,63 @@
+#ifndef __WINDOW_H__
+#define __WINDOW_H__
+#include "protocol.h"
+#include "stats.h"
+
+#define WINDOW_MAX			32	/* width of the device's selective ACK bitmap */
+#define WINDOW_DEFAULT		8	/* the kernel driver keeps 8 writes in flight */
+#define WINDOW_RETRIES		8
+#define WINDOW_TIMEOUT_MS	1000	/* blocking use: how long to wait for a response */
+/* Frame flags */
+#define FRAME_BARRIER		0x01	/* nothing else in flight while this frame is */
+#define FRAME_ORDERED		0x02	/* the device drops it unless every earlier frame arrived */
+
+struct usb_link;
+
+struct tx_frame {
+	u8 data[FRAME_V2_MAX_DATA];	/* more than a v1 frame holds goes as a v2 frame */
+	u16 len;
+	u16 seq;
+	u32 crc;			/* frame check, calculated once for every transmission */
+	u8 flags;
+	u8 acked;
+	u8 tries;
+	int64_t sent_us;	/* last transmission */
+	u32 sent_order;		/* of the last transmission, the link keeps the order */
+};
+
+/* Sliding window sender, frames are acknowledged cumulatively (seq) and
+ * selectively (bitmap of the 32 frames after seq) by the device */
+struct tx_window {
+	int dev_fd;
+	struct usb_link *link;	/* frames go through the event loop when set */
+	u16 msg_type;
+	u16 size;
+	u16 base;	/* oldest unacknowledged sequence number */
+	u16 next;	/* sequence number of the next new frame */
+	u32 sends;	/* transmissions so far, orders them */
+	u16 resent_base;	/* go back N was done for this base, valid with resent */
+	u8 resent;
+	struct tx_frame slot[WINDOW_MAX];
+	u8 send_buf[FRAME_V2_MAX];
+	struct task_struct recv_task;
+	/* Statistic */
+	u64 frames;
+	u64 retries;
+	u64 nacks;
+	struct hist rtt;	/* us from sending a frame to its acknowledgement, retransmitted ones excluded */
+};
+
+void window_init(struct tx_window *win, int dev_fd, u16 msg_type, u16 size);
+void window_attach(struct tx_window *win, struct usb_link *link);
+/* Non-blocking use: the caller reads the device and reports what happened */
+int window_can_queue(struct tx_window *win, u8 flags);
+int window_idle(struct tx_window *win);
+int window_queue(struct tx_window *win, const u8 *data, u16 len, u8 flags);
+int window_queue_crc(struct tx_window *win, const u8 *data, u16 len, u8 flags, u32 crc);
+int window_on_response(struct tx_window *win, struct task_struct *recv);
+int window_on_timeout(struct tx_window *win);
+/* Blocking use */
+int window_push(struct tx_window *win, const u8 *data, u16 len, u8 flags);
+int window_flush(struct tx_window *win);
+
+#endif
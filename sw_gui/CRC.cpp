@@ -16,14 +16,15 @@
   along with program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <stdio.h>
+#include <string.h>
 #include "CRC.h"
 #include "CRC_Cfg.h"
 
 
 //---- Prototypes ----//
 static void CRC_CalculateCRC8Table(void);
-static void CRC_CalculateCRC16Table(void);
 static void CRC_CalculateCRC32Table(void);
+static void CRC_CalculateCRC32Mpeg2Table(void);
 
 static uint8_t CRC_ReverseBitOrder8(uint8_t value);
 static uint32_t CRC_ReverseBitOrder32(uint32_t value);
@@ -34,20 +35,74 @@ static uint32_t CRC_ReverseBitOrder32(uint32_t value);
 static uint8_t CRC8Table[256u];
 #endif
 
+#if (CRC_16_MODE == TABLE) || (CRC_16_MODE == SLICING_BY_8)
+/* The tables are built by the compiler and stay in flash: row k holds the CRC of
+ * byte i followed by k zero bytes. The CRC is linear, so an entry is the XOR of
+ * the entries of its set bits and only these 8 per row need computing. */
+#define CRC16_STEP(v)       ((((v) << 1u) ^ (((v) & 0x8000u) ? CRC_16_POLYNOMIAL : 0u)) & 0xFFFFu)
+#define CRC16_STEP8(v)      CRC16_STEP(CRC16_STEP(CRC16_STEP(CRC16_STEP(CRC16_STEP(CRC16_STEP(CRC16_STEP(CRC16_STEP(v))))))))
+#define CRC16_ENTRY(k, i)   ((((i) & 0x01u) ? CRC16_B##k##_0 : 0u) ^ (((i) & 0x02u) ? CRC16_B##k##_1 : 0u) ^ \
+                             (((i) & 0x04u) ? CRC16_B##k##_2 : 0u) ^ (((i) & 0x08u) ? CRC16_B##k##_3 : 0u) ^ \
+                             (((i) & 0x10u) ? CRC16_B##k##_4 : 0u) ^ (((i) & 0x20u) ? CRC16_B##k##_5 : 0u) ^ \
+                             (((i) & 0x40u) ? CRC16_B##k##_6 : 0u) ^ (((i) & 0x80u) ? CRC16_B##k##_7 : 0u))
+/* One more zero byte: entry of row k from the entry of row k - 1 */
+#define CRC16_NEXT(v)       ((((v) << 8u) ^ CRC16_ENTRY(0, (v) >> 8u)) & 0xFFFFu)
+#define CRC16_BASIS(k, p)   CRC16_B##k##_0 = CRC16_NEXT(CRC16_B##p##_0), CRC16_B##k##_1 = CRC16_NEXT(CRC16_B##p##_1), \
+                            CRC16_B##k##_2 = CRC16_NEXT(CRC16_B##p##_2), CRC16_B##k##_3 = CRC16_NEXT(CRC16_B##p##_3), \
+                            CRC16_B##k##_4 = CRC16_NEXT(CRC16_B##p##_4), CRC16_B##k##_5 = CRC16_NEXT(CRC16_B##p##_5), \
+                            CRC16_B##k##_6 = CRC16_NEXT(CRC16_B##p##_6), CRC16_B##k##_7 = CRC16_NEXT(CRC16_B##p##_7)
+#define CRC16_R4(k, n)      CRC16_ENTRY(k, n), CRC16_ENTRY(k, n + 1u), CRC16_ENTRY(k, n + 2u), CRC16_ENTRY(k, n + 3u)
+#define CRC16_R16(k, n)     CRC16_R4(k, n), CRC16_R4(k, n + 4u), CRC16_R4(k, n + 8u), CRC16_R4(k, n + 12u)
+#define CRC16_R64(k, n)     CRC16_R16(k, n), CRC16_R16(k, n + 16u), CRC16_R16(k, n + 32u), CRC16_R16(k, n + 48u)
+#define CRC16_ROW(k)        { CRC16_R64(k, 0u), CRC16_R64(k, 64u), CRC16_R64(k, 128u), CRC16_R64(k, 192u) }
+
+enum
+{
+    CRC16_B0_0 = CRC16_STEP8(0x0100u), CRC16_B0_1 = CRC16_STEP8(0x0200u),
+    CRC16_B0_2 = CRC16_STEP8(0x0400u), CRC16_B0_3 = CRC16_STEP8(0x0800u),
+    CRC16_B0_4 = CRC16_STEP8(0x1000u), CRC16_B0_5 = CRC16_STEP8(0x2000u),
+    CRC16_B0_6 = CRC16_STEP8(0x4000u), CRC16_B0_7 = CRC16_STEP8(0x8000u),
+    CRC16_BASIS(1, 0), CRC16_BASIS(2, 1), CRC16_BASIS(3, 2), CRC16_BASIS(4, 3),
+    CRC16_BASIS(5, 4), CRC16_BASIS(6, 5), CRC16_BASIS(7, 6)
+};
+#endif
+
 #if (CRC_16_MODE == TABLE)
-static uint16_t CRC16Table[256u];
+	static const uint16_t CRC16Table[1u][256u] = { CRC16_ROW(0) };
+#elif (CRC_16_MODE == SLICING_BY_8)
+	static const uint16_t CRC16Table[8u][256u] = {
+	    CRC16_ROW(0), CRC16_ROW(1), CRC16_ROW(2), CRC16_ROW(3),
+	    CRC16_ROW(4), CRC16_ROW(5), CRC16_ROW(6), CRC16_ROW(7)
+	};
+#endif
+
+#if (CRC_16_MODE == SLICING_BY_8) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CRC_HAVE_CLMUL
 #endif
 
 #if (CRC_32_MODE == TABLE)
 static uint32_t CRC32Table[256u];
 #endif
 
+#if (CRC_32_MPEG2_MODE == TABLE)
+static uint32_t CRC32Mpeg2Table[4u][256u];
+static uint8_t CRC32Mpeg2TableReady;
+#elif (CRC_32_MPEG2_MODE == HARDWARE)
+#include "stm32f4xx_hal.h"
+/* Shorter or unaligned regions are written to the CRC unit by the CPU */
+#define CRC_32_MPEG2_DMA_WORDS              256u
+#define CRC_32_MPEG2_DMA_TIMEOUT_MS         100u
+static DMA_HandleTypeDef CRC32Mpeg2Dma;
+#endif
+
 
 void CRC_Init(void)
 {
     CRC_CalculateCRC8Table();
-    CRC_CalculateCRC16Table();
+    (void)CRC_SelectCRC16(CRC_16_ENGINE_AUTO);
     CRC_CalculateCRC32Table();
+    CRC_CalculateCRC32Mpeg2Table();
 }
 
 
@@ -103,56 +158,200 @@ uint8_t CRC_CalculateCRC8(const uint8_t *Buffer, uint16_t Length)
 }
 
 
-uint16_t CRC_CalculateCRC16(const uint8_t *Buffer, uint16_t Length)
-{
-    uint16_t retVal = 0u;
-    uint16_t byteIndex = 0u;
+typedef uint16_t (*CRC16_Engine)(uint16_t crc, const uint8_t *Buffer, size_t Length);
 
-    if (Buffer != NULL)
+static CRC16_Engine CRC16_Update;
+
+
+static uint16_t CRC16_Bitwise(uint16_t crc, const uint8_t *Buffer, size_t Length)
+{
+    /* Do calculation procedure for each byte */
+    for (size_t byteIndex = 0u; byteIndex < Length; byteIndex++)
     {
-#if (CRC_16_MODE == RUNTTIME)
-        retVal = CRC_16_INIT_VALUE;
+        /* XOR new byte with temp result */
+        crc ^= (Buffer[byteIndex] << (CRC_16_RESULT_WIDTH - 8u));
 
-        /* Do calculation procedure for each byte */
-        for (byteIndex = 0u; byteIndex < Length; byteIndex++)
+        /* Do calculation for current data */
+        for (uint8_t bitIndex = 0u; bitIndex < 8u; bitIndex++)
         {
-            /* XOR new byte with temp result */
-            retVal ^= (Buffer[byteIndex] << (CRC_16_RESULT_WIDTH - 8u));
-
-            uint8_t bitIndex = 0u;
-            /* Do calculation for current data */
-            for (bitIndex = 0u; bitIndex < 8u; bitIndex++)
+            if (crc & (1u << (CRC_16_RESULT_WIDTH - 1u)))
             {
-                if (retVal & (1u << (CRC_16_RESULT_WIDTH - 1u)))
-                {
-                    retVal = (retVal << 1u) ^ CRC_16_POLYNOMIAL;
-                }
-                else
-                {
-                    retVal = (retVal << 1u);
-                }
+                crc = (crc << 1u) ^ CRC_16_POLYNOMIAL;
+            }
+            else
+            {
+                crc = (crc << 1u);
             }
         }
+    }
 
-        /* XOR result with specified value */
-        retVal ^= CRC_16_XOR_VALUE;
+    return crc;
+}
 
-#elif (CRC_16_MODE == TABLE)
-        retVal = CRC_16_INIT_VALUE;
 
-        /* Update the CRC using the data */
-        for (byteIndex = 0u; byteIndex < Length; byteIndex++)
+#if (CRC_16_MODE == TABLE) || (CRC_16_MODE == SLICING_BY_8)
+static uint16_t CRC16_Table(uint16_t crc, const uint8_t *Buffer, size_t Length)
+{
+    /* Update the CRC using the data */
+    for (size_t byteIndex = 0u; byteIndex < Length; byteIndex++)
+    {
+        crc = (crc << 8u) ^ CRC16Table[0][(crc >> 8u) ^ Buffer[byteIndex]];
+    }
+
+    return crc;
+}
+#endif
+
+
+#if (CRC_16_MODE == SLICING_BY_8)
+static uint16_t CRC16_Slice8(uint16_t crc, const uint8_t *Buffer, size_t Length)
+{
+    /* 8 bytes per step: byte j of the block is followed by 7 - j bytes */
+    for (; Length >= 8u; Buffer += 8u, Length -= 8u)
+    {
+        crc ^= (uint16_t)((Buffer[0] << 8u) | Buffer[1]);
+        crc = CRC16Table[7][crc >> 8u] ^ CRC16Table[6][crc & 0xFFu] ^
+              CRC16Table[5][Buffer[2]] ^ CRC16Table[4][Buffer[3]] ^
+              CRC16Table[3][Buffer[4]] ^ CRC16Table[2][Buffer[5]] ^
+              CRC16Table[1][Buffer[6]] ^ CRC16Table[0][Buffer[7]];
+    }
+
+    return CRC16_Table(crc, Buffer, Length);
+}
+#endif
+
+
+#if defined(CRC_HAVE_CLMUL)
+/* x^576, x^512, x^192 and x^128 modulo the polynomial */
+static uint64_t CRC16_FoldConst[4u];
+
+
+static uint64_t CRC_PowerMod16(uint32_t n)
+{
+    uint32_t remainder = 1u;
+
+    while (n--)
+    {
+        remainder <<= 1u;
+        if (remainder & 0x10000u)
         {
-            retVal = (retVal << 8u) ^ CRC16Table[(retVal >> 8u) ^ Buffer[byteIndex]];
+            remainder ^= 0x10000u | CRC_16_POLYNOMIAL;
         }
+    }
 
-        /* XOR result with specified value */
-        retVal ^= CRC_16_XOR_VALUE;
-#else
-        /* Mode not implemented */
-        retVal = 0x0000u;
+    return remainder;
+}
+
+
+/* x * x^n + next, with k holding x^(n + 64) and x^n modulo the polynomial */
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i CRC16_Fold(__m128i x, __m128i k, __m128i next)
+{
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), _mm_clmulepi64_si128(x, k, 0x00)), next);
+}
+
+
+/* Carry-less multiplication folds 4 x 16 bytes in parallel down to 16 bytes
+ * with the same remainder, the tables finish from there */
+__attribute__((target("pclmul,ssse3")))
+static uint16_t CRC16_Clmul(uint16_t crc, const uint8_t *Buffer, size_t Length)
+{
+    /* First byte in the most significant position */
+    const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i k512 = _mm_set_epi64x((long long)CRC16_FoldConst[0], (long long)CRC16_FoldConst[1]);
+    const __m128i k128 = _mm_set_epi64x((long long)CRC16_FoldConst[2], (long long)CRC16_FoldConst[3]);
+    __m128i x0, x1, x2, x3;
+    uint8_t rest[16u];
+
+    if (Length < 64u)
+    {
+        return CRC16_Slice8(crc, Buffer, Length);
+    }
+    /* The CRC so far is XORed into the first two bytes */
+    x0 = _mm_xor_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)Buffer), swap),
+                       _mm_slli_si128(_mm_cvtsi32_si128(crc), 14));
+    x1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(Buffer + 16u)), swap);
+    x2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(Buffer + 32u)), swap);
+    x3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(Buffer + 48u)), swap);
+    for (Buffer += 64u, Length -= 64u; Length >= 64u; Buffer += 64u, Length -= 64u)
+    {
+        x0 = CRC16_Fold(x0, k512, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)Buffer), swap));
+        x1 = CRC16_Fold(x1, k512, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(Buffer + 16u)), swap));
+        x2 = CRC16_Fold(x2, k512, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(Buffer + 32u)), swap));
+        x3 = CRC16_Fold(x3, k512, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(Buffer + 48u)), swap));
+    }
+    x0 = CRC16_Fold(CRC16_Fold(CRC16_Fold(x0, k128, x1), k128, x2), k128, x3);
+    for (; Length >= 16u; Buffer += 16u, Length -= 16u)
+    {
+        x0 = CRC16_Fold(x0, k128, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)Buffer), swap));
+    }
+    _mm_storeu_si128((__m128i *)rest, _mm_shuffle_epi8(x0, swap));
 
+    return CRC16_Slice8(CRC16_Slice8(0u, rest, sizeof(rest)), Buffer, Length);
+}
 #endif
+
+
+int CRC_SelectCRC16(int engine)
+{
+    (void)engine;   /* RUNTTIME builds only have the bitwise one */
+#if defined(CRC_HAVE_CLMUL)
+    __builtin_cpu_init();
+    if (engine == CRC_16_ENGINE_AUTO)
+    {
+        engine = (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3")) ?
+                 CRC_16_ENGINE_CLMUL : CRC_16_ENGINE_SLICE8;
+    }
+    if ((engine == CRC_16_ENGINE_CLMUL) && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3"))
+    {
+        CRC16_FoldConst[0] = CRC_PowerMod16(576u);
+        CRC16_FoldConst[1] = CRC_PowerMod16(512u);
+        CRC16_FoldConst[2] = CRC_PowerMod16(192u);
+        CRC16_FoldConst[3] = CRC_PowerMod16(128u);
+        CRC16_Update = CRC16_Clmul;
+        return CRC_16_ENGINE_CLMUL;
+    }
+#endif
+#if (CRC_16_MODE == SLICING_BY_8)
+    if ((engine == CRC_16_ENGINE_AUTO) || (engine >= CRC_16_ENGINE_SLICE8))
+    {
+        CRC16_Update = CRC16_Slice8;
+        return CRC_16_ENGINE_SLICE8;
+    }
+#endif
+#if (CRC_16_MODE == TABLE) || (CRC_16_MODE == SLICING_BY_8)
+    if ((engine == CRC_16_ENGINE_AUTO) || (engine >= CRC_16_ENGINE_TABLE))
+    {
+        CRC16_Update = CRC16_Table;
+        return CRC_16_ENGINE_TABLE;
+    }
+#endif
+    CRC16_Update = CRC16_Bitwise;
+    return CRC_16_ENGINE_BITWISE;
+}
+
+
+uint16_t CRC_UpdateCRC16(uint16_t crc, const uint8_t *Buffer, uint32_t Length)
+{
+    if (CRC16_Update == NULL)
+    {
+        (void)CRC_SelectCRC16(CRC_16_ENGINE_AUTO);
+    }
+
+    return CRC16_Update(crc, Buffer, Length);
+}
+
+
+uint16_t CRC_CalculateCRC16(const uint8_t *Buffer, uint16_t Length)
+{
+    uint16_t retVal = 0u;
+
+    if (Buffer != NULL)
+    {
+        retVal = CRC_UpdateCRC16(CRC_16_INIT_VALUE, Buffer, Length);
+
+        /* XOR result with specified value */
+        retVal ^= CRC_16_XOR_VALUE;
     }
 
     return retVal;
@@ -221,6 +420,132 @@ uint32_t CRC_CalculateCRC32(const uint8_t *Buffer, uint16_t Length)
 }
 
 
+#if (CRC_32_MPEG2_MODE == HARDWARE)
+static HAL_StatusTypeDef CRC32Mpeg2_Dma(const uint8_t *Buffer, uint32_t Words)
+{
+    if (CRC32Mpeg2Dma.Instance == NULL)
+    {
+        __HAL_RCC_DMA2_CLK_ENABLE();
+
+        /* Only DMA2 copies memory to memory, the source is its peripheral side */
+        CRC32Mpeg2Dma.Instance                 = DMA2_Stream0;
+        CRC32Mpeg2Dma.Init.Channel             = DMA_CHANNEL_0;
+        CRC32Mpeg2Dma.Init.Direction           = DMA_MEMORY_TO_MEMORY;
+        CRC32Mpeg2Dma.Init.PeriphInc           = DMA_PINC_ENABLE;
+        CRC32Mpeg2Dma.Init.MemInc              = DMA_MINC_DISABLE;
+        CRC32Mpeg2Dma.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+        CRC32Mpeg2Dma.Init.MemDataAlignment    = DMA_MDATAALIGN_WORD;
+        CRC32Mpeg2Dma.Init.Mode                = DMA_NORMAL;
+        CRC32Mpeg2Dma.Init.Priority            = DMA_PRIORITY_HIGH;
+        CRC32Mpeg2Dma.Init.FIFOMode            = DMA_FIFOMODE_ENABLE;
+        CRC32Mpeg2Dma.Init.FIFOThreshold       = DMA_FIFO_THRESHOLD_FULL;
+        CRC32Mpeg2Dma.Init.MemBurst            = DMA_MBURST_SINGLE;
+        CRC32Mpeg2Dma.Init.PeriphBurst         = DMA_PBURST_SINGLE;
+        if (HAL_DMA_Init(&CRC32Mpeg2Dma) != HAL_OK)
+        {
+            CRC32Mpeg2Dma.Instance = NULL;
+            return HAL_ERROR;
+        }
+    }
+
+    /* At most 65535 items per transfer */
+    while (Words > 0u)
+    {
+        uint32_t count = (Words > 0xFFFFu) ? 0xFFFFu : Words;
+
+        if ((HAL_DMA_Start(&CRC32Mpeg2Dma, (uint32_t)Buffer, (uint32_t)&CRC->DR, count) != HAL_OK) ||
+            (HAL_DMA_PollForTransfer(&CRC32Mpeg2Dma, HAL_DMA_FULL_TRANSFER, CRC_32_MPEG2_DMA_TIMEOUT_MS) != HAL_OK))
+        {
+            (void)HAL_DMA_Abort(&CRC32Mpeg2Dma);
+            return HAL_ERROR;
+        }
+        Buffer += 4u * count;
+        Words -= count;
+    }
+
+    return HAL_OK;
+}
+#endif
+
+
+uint32_t CRC_CalculateCRC32Mpeg2(const uint8_t *Buffer, uint32_t Words)
+{
+    uint32_t retVal = 0u;
+
+    if (Buffer != NULL)
+    {
+#if (CRC_32_MPEG2_MODE == HARDWARE)
+        uint32_t word = 0u;
+
+        __HAL_RCC_CRC_CLK_ENABLE();
+        CRC->CR = CRC_CR_RESET;
+        if ((Words < CRC_32_MPEG2_DMA_WORDS) || (((uintptr_t)Buffer & 3u) != 0u) ||
+            (CRC32Mpeg2_Dma(Buffer, Words) != HAL_OK))
+        {
+            /* A failed transfer left an unknown part in the unit, start over */
+            CRC->CR = CRC_CR_RESET;
+            for (uint32_t wordIndex = 0u; wordIndex < Words; wordIndex++)
+            {
+                memcpy(&word, Buffer + 4u * wordIndex, sizeof(word));
+                CRC->DR = word;
+            }
+        }
+        retVal = CRC->DR;
+
+#else
+        retVal = CRC_UpdateCRC32Mpeg2(CRC_32_MPEG2_INIT_VALUE, Buffer, Words);
+
+#endif
+    }
+
+    return retVal;
+}
+
+
+uint32_t CRC_UpdateCRC32Mpeg2(uint32_t crc, const uint8_t *Buffer, uint32_t Words)
+{
+    uint32_t word = 0u;
+
+    if (Buffer == NULL)
+    {
+        return crc;
+    }
+#if (CRC_32_MPEG2_MODE == TABLE)
+    if (CRC32Mpeg2TableReady == 0u)
+    {
+        CRC_CalculateCRC32Mpeg2Table();
+    }
+#endif
+
+    for (uint32_t wordIndex = 0u; wordIndex < Words; wordIndex++)
+    {
+        /* The unit shifts a word in from bit 31, the CPU loads it little endian */
+        memcpy(&word, Buffer + 4u * wordIndex, sizeof(word));
+        crc ^= word;
+
+#if (CRC_32_MPEG2_MODE == TABLE)
+        /* The top byte is followed by 3 more, the bottom one by none */
+        crc = CRC32Mpeg2Table[3][crc >> 24u] ^ CRC32Mpeg2Table[2][(crc >> 16u) & 0xFFu] ^
+              CRC32Mpeg2Table[1][(crc >> 8u) & 0xFFu] ^ CRC32Mpeg2Table[0][crc & 0xFFu];
+#else
+        for (uint8_t bitIndex = 0u; bitIndex < 32u; bitIndex++)
+        {
+            if (crc & 0x80000000u)
+            {
+                crc = (crc << 1u) ^ CRC_32_MPEG2_POLYNOMIAL;
+            }
+            else
+            {
+                crc = (crc << 1u);
+            }
+        }
+#endif
+    }
+
+    return crc;
+}
+
+
 static void CRC_CalculateCRC8Table(void)
 {
 #if (CRC_8_MODE == TABLE)
@@ -249,52 +574,49 @@ static void CRC_CalculateCRC8Table(void)
 }
 
 
-static void CRC_CalculateCRC16Table(void)
+static void CRC_CalculateCRC32Table(void)
 {
-#if (CRC_16_MODE==TABLE)
-    uint16_t i = 0u, j = 0u;
-    uint16_t result = 0u;
-    uint16_t xor_flag = 0u;
+#if (CRC_32_MODE==TABLE)
+    uint32_t remainder = 0u;
 
 
-    for(i = 0u; i < 256u; i++)
+    for(uint32_t dividend = 0u; dividend < 256u; ++dividend)
     {
-        result = i << 8u;
+        remainder = dividend << (CRC_32_RESULT_WIDTH - 8u);
 
-        for(j = 0u; j < 8u; j++)
+        for(uint8_t bit = 8u; bit > 0u; --bit)
         {
-            /* Flag for XOR if leftmost bit is set */
-            xor_flag = result & 0x8000u;
-
-            /* Shift CRC */
-            result <<= 1u;
-
-            /* Perform the XOR */
-            if(xor_flag != 0u)
-                result ^= CRC_16_POLYNOMIAL;
+            if(remainder & (1u << (CRC_32_RESULT_WIDTH - 1u)))
+            {
+                remainder = (remainder << 1u) ^ CRC_32_POLYNOMIAL;
+            }
+            else
+            {
+                remainder = (remainder << 1u);
+            }
         }
 
-        CRC16Table[i] = result;
+        CRC32Table[dividend] = remainder;
     }
 #endif
 }
 
 
-static void CRC_CalculateCRC32Table(void)
+static void CRC_CalculateCRC32Mpeg2Table(void)
 {
-#if (CRC_32_MODE==TABLE)
+#if (CRC_32_MPEG2_MODE == TABLE)
     uint32_t remainder = 0u;
 
 
-    for(uint32_t dividend = 0u; dividend < 256u; ++dividend)
+    for (uint32_t dividend = 0u; dividend < 256u; ++dividend)
     {
-        remainder = dividend << (CRC_32_RESULT_WIDTH - 8u);
+        remainder = dividend << 24u;
 
-        for(uint8_t bit = 8u; bit > 0u; --bit)
+        for (uint8_t bit = 8u; bit > 0u; --bit)
         {
-            if(remainder & (1u << (CRC_32_RESULT_WIDTH - 1u)))
+            if (remainder & 0x80000000u)
             {
-                remainder = (remainder << 1u) ^ CRC_32_POLYNOMIAL;
+                remainder = (remainder << 1u) ^ CRC_32_MPEG2_POLYNOMIAL;
             }
             else
             {
@@ -302,8 +624,20 @@ static void CRC_CalculateCRC32Table(void)
             }
         }
 
-        CRC32Table[dividend] = remainder;
+        CRC32Mpeg2Table[0][dividend] = remainder;
     }
+
+    /* Row k: the byte is followed by k zero bytes */
+    for (uint32_t row = 1u; row < 4u; ++row)
+    {
+        for (uint32_t dividend = 0u; dividend < 256u; ++dividend)
+        {
+            remainder = CRC32Mpeg2Table[row - 1u][dividend];
+            CRC32Mpeg2Table[row][dividend] = (remainder << 8u) ^ CRC32Mpeg2Table[0][remainder >> 24u];
+        }
+    }
+
+    CRC32Mpeg2TableReady = 1u;
 #endif
 }
 
@@ -81,14 +81,14 @@ ApplicationWindow {
                     spacing: 2
                     Text {
                         height: parent.height * 0.3
-                        text: "Hex File"
+                        text: "Firmware File"
                     }
                     Row {
                         id: hex
                         width: parent.width
                         height: parent.height * 0.7
                         Frame {
-                            width: parent.width * 0.8
+                            width: parent.width * 0.6
                             height: parent.height
                             Rectangle {
                                 anchors.fill: parent
@@ -100,6 +100,20 @@ ApplicationWindow {
                             }
                         }
 
+                        Frame {
+                            width: parent.width * 0.2
+                            height: parent.height
+                            /* Load address of a .bin file, HEX and ELF files carry their own */
+                            TextField {
+                                id: binBase
+                                anchors.centerIn: parent
+                                width: parent.width
+                                text: stm32.binBase()
+                                placeholderText: "Base address (.bin)"
+                                enabled: url.text.endsWith(".bin")
+                            }
+                        }
+
                         Frame {
                             width: parent.width * 0.2
                             height: parent.height
@@ -121,11 +135,16 @@ ApplicationWindow {
                 highlighted: true
                 onClicked: {
                     if (devfs != "" && fileDialog.selectedFile != "") {
+                        if (!stm32.startUpdateFirmware(devfs, fileDialog.selectedFile, binBase.enabled ? binBase.text : stm32.binBase())) {
+                            progress_txt.text = "Invalid base address, e.g. " + stm32.binBase()
+                            progress_txt.color = "Red"
+                            progress_txt.font.italic = true
+                            return
+                        }
                         progress.indeterminate = true
                         progress.visible = true
                         progress_txt.color = "Black"
                         progress_txt.text = "Wait for erase memory!"
-                        stm32.startUpdateFirmware(devfs, fileDialog.selectedFile)
                     } else {
                         progress_txt.text = "Device or Binary not found, Please try again!"
                         progress_txt.color = "Red"
@@ -168,6 +187,7 @@ ApplicationWindow {
     FileDialog {
         id: fileDialog
         title: "Select a File"
+        nameFilters: ["Firmware (*.hex *.bin *.elf)", "All files (*)"]
         currentFile: "file:/home/nam/usb_dfu/sw_backend/Blynk_led.hex"
         onAccepted: {
             url.text = fileDialog.selectedFile
@@ -1,10 +1,19 @@
 #include "stm32_usb_dev.h"
 #include <QDir>
+#include <QStandardPaths>
 #include "CRC.h"
+#include "image.h"
 #include <stdio.h>
+#include <errno.h>
 #include <sys/stat.h>
 
-#define TIMING  50000
+/* Data bytes per synthesized HEX record, kept word aligned */
+#define HEX_BLOCK_SIZE  ((sizeof(((struct task_struct *)0)->data) - 5) & ~3u)
+
+/* Frame check: what the device's CRC unit calculates */
+static u32 usb_crc(const struct task_struct *task) {
+    return CRC_CalculateCRC32Mpeg2(task->data, sizeof(task->data) / 4);
+}
 
 stm32_usb_dev::stm32_usb_dev(QObject *parent)
     : QObject{parent}, update_progress(0), total_len(0)
@@ -33,109 +42,292 @@ uint8_t stm32_usb_dev::getProgress() {
     return update_progress;
 }
 
-void stm32_usb_dev::startUpdateFirmware(QString dev, QString hex){
+/* Default load address of a .bin file, the start of the application */
+QString stm32_usb_dev::binBase(void) {
+    return QString("0x%1").arg(IMAGE_BIN_BASE, 8, 16, QChar('0'));
+}
+
+/**
+  * @brief  Update the device in a thread of its own
+  * @param  base: where a .bin file goes, decimal or 0x hexadecimal
+  * @retval false: base is not a word aligned address, nothing started
+*/
+bool stm32_usb_dev::startUpdateFirmware(QString dev, QString hex, QString base){
     QString devfs = "/dev/" + dev;
+    bool ok;
+    u32 bin_base = base.trimmed().toUInt(&ok, 0);
+
+    if (!ok || (bin_base & 3)) {
+        return false;
+    }
     hex.replace("file://", "");
     QThread *thread = QThread::create([=]() {
         FirmwareUpdateWorker worker;
         connect(&worker, &FirmwareUpdateWorker::updateCompleted, this, &::stm32_usb_dev::updateCompleted);
         connect(&worker, &FirmwareUpdateWorker::progressChanged, this, &stm32_usb_dev::setProgress);
         connect(&worker, &FirmwareUpdateWorker::eraseCompleted, this, &stm32_usb_dev::eraseCompleted);
-        worker.startUpdate(devfs, hex);
+        worker.startUpdate(devfs, hex, bin_base);
     });
     connect(thread, &QThread::finished, thread, &QObject::deleteLater);
     thread->start();
+    return true;
+}
 
+/**
+  * @brief  Send one record until the device acknowledges it, only this frame is
+  * retransmitted: the device ACKs a sequence number it already handled again
+  * @retval 0: acknowledged, -1: failed FRAME_RETRIES times or the device is gone
+*/
+int FirmwareUpdateWorker::program_frame(const uint8_t *record, int len) {
+    if (usb_request(MSG_PROGRAM_DATA, record, len) < 0) {
+        return -1;
+    }
+    for (int tries = 1; ; tries++) {
+        if (usb_recv() <= 0) {
+            qDebug()<<"No response to frame "<<send_task.seq;
+        } else if (usb_err_check() < 0) {
+            qDebug()<<"Device send NACK, Error Code: "<<recv_task.msg_error;
+        } else if ((int16_t)(recv_task.seq - send_task.seq) >= 0) {
+            return 0;
+        }
+        if (lost || tries == FRAME_RETRIES || usb_resend() < 0) {
+            return -1;
+        }
+    }
 }
 
-void FirmwareUpdateWorker::update_fw(){
-    char buffer[1024] = { 0 };
-    char line_rd[50] = {0};
-    ssize_t bytesRead;
-    int lineLength = 0;
-    u8 hex[50] = { 0 };
-    u32 prog = 0;
-    struct stat hex_file;
-
-    if (fstat(hex_desc, &hex_file) < 0) {
-        goto exit;
-    }
-    while ((bytesRead = read(hex_desc, buffer, sizeof(buffer) - 1)) > 0) {
-        buffer[bytesRead] = '\0';
-
-        for (int i = 0; i < bytesRead; i++) {
-            if (buffer[i] == '\n') {
-                line_rd[lineLength - 1] = '\0';
-                ascii_2_hex(line_rd, hex, strlen(line_rd));
-                total_len += strlen(line_rd) + 1;
-                prog = total_len * 100 / hex_file.st_size;
-                qDebug()<<"Writting: "<<total_len<<"/"<<hex_file.st_size<<" bytes of hex file!";
-                emit progressChanged((u8)prog);
-                if (usb_request(MSG_PROGRAM_DATA, hex, strlen(line_rd) / 2) < 0) {
-                    qDebug()<<__func__<<", "<<__LINE__;
-                    goto exit;
-                }
-                if (usb_recv() < 0) {
-                    qDebug()<<__func__<<", "<<__LINE__;
-                    goto exit;
-                }
-                if (usb_err_check() < 0) {
-                    goto exit;
-                } else {
-                    if (recv_task.msg_error == MSG_SUCCESS) {
-                        qDebug()<<("Device send ACK!");
-                    } else {
-                        qDebug()<<"Device send NACK, Error Code: "<<recv_task.msg_error;
-                    }
-                    usleep(TIMING);
-                }
-                lineLength = 0;
-            } else if (buffer[i] == ':') {
-                lineLength = 0;
-                total_len ++;
-            } else {
-                line_rd[lineLength] = buffer[i];
-                lineLength++;
-            }
+int FirmwareUpdateWorker::program_record(void *ctx, const uint8_t *record, int len, uint64_t done) {
+    FirmwareUpdateWorker *worker = static_cast<FirmwareUpdateWorker *>(ctx);
+    u32 prog = done * 100 / worker->total_len;
+    u32 addr = worker->upper | (u32)record[1] << 8 | record[2];
+
+    if (record[3] == HEX_EXTENDED_LINEAR_ADDR) {
+        worker->upper = (u32)record[4] << 24 | (u32)record[5] << 16;
+    }
+    if (record[3] == HEX_DATA_RECORD) {
+        emit worker->progressChanged((u8)prog);
+        /* Acknowledged before the update was interrupted, address records are always sent again */
+        if ((u64)addr + record[0] <= worker->journal.end) {
+            return 0;
+        }
+        qDebug()<<"Writting: "<<done<<"/"<<worker->total_len<<" bytes of image!";
+    }
+    if (worker->program_frame(record, len) < 0) {
+        qDebug()<<__func__<<", "<<__LINE__;
+        return -1;
+    }
+    if (record[3] == HEX_DATA_RECORD) {
+        worker->journal.end = addr + record[0];
+        worker->journal.done = done;
+        worker->journal_save();
+    }
+    return 0;
+}
+
+/* The device's CRC of the written flash against the image, bytes it does not cover read as erased */
+int FirmwareUpdateWorker::verify_image(const struct fw_image *img) {
+    u32 region[3];
+    u64 end;
+
+    if (!img->n_seg) {
+        return 0;
+    }
+    end = ((u64)img->seg[img->n_seg - 1].addr + img->seg[img->n_seg - 1].len + 3) & ~3ULL;
+    region[0] = img->seg[0].addr & ~3u;
+    region[1] = (u32)(end - region[0]);
+    if (usb_request(MSG_VERIFY_IMAGE, (const u8 *)region, 2 * sizeof(u32)) < 0 || usb_recv() <= 0 ||
+        usb_err_check() < 0 || recv_task.data_length != sizeof(region)) {
+        qDebug()<<"Device can not verify the image, Error Code: "<<recv_task.msg_error;
+        return -1;
+    }
+    memcpy(&region[2], &recv_task.data[8], sizeof(u32));
+    if (region[2] != image_crc32(img, region[0], region[1])) {
+        qDebug()<<"Image mismatch after programming!";
+        return -1;
+    }
+    return 0;
+}
+
+/* Image identity for the journal, independent of the file format */
+static u64 journal_hash(const struct fw_image *img) {
+    u64 hash = 0xcbf29ce484222325ULL;
+
+    for (u32 i = 0; i < img->n_seg; i++) {
+        hash = (hash ^ img->seg[i].addr) * 0x100000001b3ULL;
+        for (u32 n = 0; n < img->seg[i].len; n++) {
+            hash = (hash ^ img->seg[i].data[n]) * 0x100000001b3ULL;
         }
     }
+    return hash;
+}
 
-    if (bytesRead == -1) {
-        perror("Error reading file");
-        goto exit;
+/* Pick up the journal of an earlier, interrupted update of the same image */
+void FirmwareUpdateWorker::journal_open(const struct fw_image *img) {
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    u64 hash = journal_hash(img);
+
+    QDir().mkpath(dir);
+    journal_path = dir + QString("/%1.journal").arg(hash, 16, 16, QChar('0'));
+    journal_fd = open(journal_path.toUtf8().constData(), O_RDWR | O_CREAT, 0644);
+    if (journal_fd < 0 || pread(journal_fd, &journal, sizeof(journal), 0) != sizeof(journal) ||
+        journal.magic != JOURNAL_MAGIC || journal.hash != hash || journal.size != img->size) {
+        memset(&journal, 0, sizeof(journal));
+        journal.magic = JOURNAL_MAGIC;
+        journal.hash = hash;
+        journal.size = img->size;
+    } else {
+        qDebug()<<"Journal: "<<journal.done<<" bytes acknowledged up to "<<Qt::hex<<journal.end;
     }
+}
 
-    if (lineLength) {
-        line_rd[lineLength] = '\0';
-        ascii_2_hex(line_rd, hex, strlen(line_rd));
-        total_len += strlen(line_rd) + 1;
-        prog = total_len * 100 / hex_file.st_size;
-        qDebug()<<"Writting: "<<total_len<<"/"<<hex_file.st_size<<" bytes of hex file!";
-        emit progressChanged((u8)prog);
-        if (usb_request(MSG_PROGRAM_DATA, hex, strlen(line_rd) / 2) < 0) {
-            qDebug()<<__func__<<", "<<__LINE__;
-            goto exit;
+void FirmwareUpdateWorker::journal_save(void) {
+    if (journal_fd >= 0 && pwrite(journal_fd, &journal, sizeof(journal), 0) != sizeof(journal)) {
+        qDebug()<<"Can not write the journal!";
+    }
+}
+
+/* A finished update leaves no journal behind */
+void FirmwareUpdateWorker::journal_close(bool finished) {
+    if (journal_fd >= 0) {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+    if (finished) {
+        unlink(journal_path.toUtf8().constData());
+    }
+}
+
+/**
+  * @brief  Continue after the journal's last acknowledged record when the device's
+  * flash still holds the image up to there, erase the sectors the image spans otherwise
+  * @retval 0: ready to program, -1: failed
+*/
+int FirmwareUpdateWorker::erase_or_resume(const struct fw_image *img) {
+    u32 region[3] = { 0, 0, 0 };
+    u32 none = 0;
+    int ret, tries;
+
+    if (journal.end && img->n_seg) {
+        region[0] = img->seg[0].addr & ~3u;
+        region[1] = (journal.end & ~3u) - region[0];
+        if (usb_request(MSG_VERIFY_IMAGE, (const u8 *)region, 2 * sizeof(u32)) < 0 || usb_recv() <= 0 ||
+            usb_err_check() < 0 || recv_task.data_length != sizeof(region)) {
+            return -1;
         }
-        if (usb_recv() < 0) {
+        memcpy(&region[2], &recv_task.data[8], sizeof(u32));
+        if (region[2] != image_crc32(img, region[0], region[1])) {
+            qDebug()<<"Flash differs from the journal, erasing";
+            journal.end = 0;
+            journal.done = 0;
+            journal_save();
+        }
+    }
+    /* An erase of no sector only restarts the device's receive window */
+    if (journal.end) {
+        ret = usb_request(MSG_DEV_ERASE, (const u8 *)&none, sizeof(none));
+    } else if (img->n_seg) {
+        const struct fw_segment *last = &img->seg[img->n_seg - 1];
+        region[0] = img->seg[0].addr & ~3u;
+        region[1] = (u32)((((u64)last->addr + last->len + 3) & ~3ULL) - region[0]);
+        ret = usb_request(MSG_DEV_ERASE, (const u8 *)region, 2 * sizeof(u32));
+    } else {
+        ret = usb_request(MSG_DEV_ERASE, NULL, 0);
+    }
+    if (ret < 0) {
+        qDebug()<<__func__<<", "<<__LINE__;
+        return -1;
+    }
+    /* The answer comes once the last sector is erased, every read timeout until then counts */
+    for (tries = 1; usb_recv() <= 0; tries++) {
+        if (lost || tries == ERASE_WAIT) {
             qDebug()<<__func__<<", "<<__LINE__;
-            goto exit;
+            return -1;
         }
-        if (usb_err_check() < 0) {
-            goto exit;
-        } else {
-            if (recv_task.msg_error == MSG_SUCCESS) {
-                qDebug()<<("Device send ACK!");
-            } else {
-                qDebug()<<"Device send NACK, Error Code: "<<recv_task.msg_error;
+    }
+    if (usb_err_check() < 0) {
+        qDebug()<<"Erase failed, Error Code: "<<recv_task.msg_error;
+        return -1;
+    }
+    /* Device restarts its receive window after an erase */
+    tx_seq = 0;
+    upper = 0;
+    emit eraseCompleted();
+    return 0;
+}
+
+/**
+  * @brief  Wait for the device to come back after it was lost: under the same name
+  * or as a stm32-* node that was not there before
+  * @retval 0: opened again, -1: it did not come back within RESUME_WAIT_MS
+*/
+int FirmwareUpdateWorker::reconnect(void) {
+    QDir devDir("/dev");
+    QStringList before = devDir.entryList(QStringList() << "stm32-*", QDir::Files | QDir::System);
+
+    close(dev_desc);
+    dev_desc = -1;
+    lost = false;
+    for (int waited = 0; waited < RESUME_WAIT_MS; waited += 100) {
+        QStringList now = devDir.entryList(QStringList() << "stm32-*", QDir::Files | QDir::System);
+        QStringList candidates;
+
+        candidates << QString(dev_path);
+        for (const QString &node : now) {
+            if (!before.contains(node)) {
+                candidates << "/dev/" + node;
+            }
+        }
+        for (const QString &path : candidates) {
+            dev_desc = open(path.toUtf8().constData(), O_RDWR);
+            if (dev_desc < 0) {
+                continue;
             }
-            usleep(TIMING);
+            /* A node of the device that went away only fails */
+            if (usb_request(MSG_REQUEST_DATA, NULL, 0) >= 0 && usb_recv() > 0 && usb_err_check() == 0) {
+                qDebug()<<"Device back as "<<path;
+                dev_path = path.toUtf8();
+                return 0;
+            }
+            close(dev_desc);
+            dev_desc = -1;
+            lost = false;
         }
+        usleep(100000);
+    }
+    qDebug()<<"Device did not come back!";
+    return -1;
+}
+
+void FirmwareUpdateWorker::update_fw(){
+    struct fw_image img;
+
+    if (image_load(&img, hex_desc, fw_name.constData(), bin_base) < 0) {
+        qDebug()<<"Invalid firmware file!";
+        return;
     }
+    total_len = img.size;
+    journal_open(&img);
+    for (int tries = 1; ; tries++) {
+        if (erase_or_resume(&img) == 0 && image_to_hex(&img, HEX_BLOCK_SIZE, program_record, this) == 0) {
+            if (verify_image(&img) == 0) {
+                break;
+            }
+            /* Written but wrong: nothing in flash can be trusted */
+            journal.end = 0;
+            journal.done = 0;
+            journal_save();
+        }
+        if (tries == RESUME_TRIES || (lost && reconnect() < 0)) {
+            journal_close(false);
+            image_free(&img);
+            return;
+        }
+        qDebug()<<"Resuming the update, attempt "<<tries + 1;
+    }
+    journal_close(true);
+    image_free(&img);
     usb_request(MSG_GOTO_APP, NULL, 0);
     emit updateCompleted();
-exit:
-    close(dev_desc);
-    close(hex_desc);
 }
 
 int stm32_usb_dev::usb_request(u16 msg_type, const u8 *data, u16 data_len) {
@@ -143,9 +335,11 @@ int stm32_usb_dev::usb_request(u16 msg_type, const u8 *data, u16 data_len) {
     send_task.msg_head[1]       = 0xFB;
     send_task.msg_error         = MSG_SUCCESS;
     send_task.msg_type          = msg_type;
+    send_task.seq               = 0;
     send_task.data_length       = data_len;
     memcpy(send_task.data, data, data_len);
-    send_task.crc               = CRC_CalculateCRC16(send_task.data, send_task.data_length);
+    memset(send_task.data + data_len, 0, sizeof(send_task.data) - data_len);
+    send_task.crc               = usb_crc(&send_task);
     send_task.msg_tail[0]       = 0xFC;
     send_task.msg_tail[1]       = 0xFD;
 
@@ -156,26 +350,38 @@ int FirmwareUpdateWorker::usb_request(u16 msg_type, const u8 *data, u16 data_len
     send_task.msg_head[1]       = 0xFB;
     send_task.msg_error         = MSG_SUCCESS;
     send_task.msg_type          = msg_type;
+    send_task.seq               = (msg_type == MSG_PROGRAM_DATA) ? tx_seq++ : 0;
     send_task.data_length       = data_len;
     memcpy(send_task.data, data, data_len);
-    send_task.crc               = CRC_CalculateCRC16(send_task.data, send_task.data_length);
+    memset(send_task.data + data_len, 0, sizeof(send_task.data) - data_len);
+    send_task.crc               = usb_crc(&send_task);
     send_task.msg_tail[0]       = 0xFC;
     send_task.msg_tail[1]       = 0xFD;
 
-    return write(dev_desc, &send_task, sizeof(struct task_struct));
+    return usb_resend();
+}
+
+/* The last frame again, sequence number included */
+int FirmwareUpdateWorker::usb_resend() {
+    int ret = write(dev_desc, &send_task, sizeof(struct task_struct));
+    lost = lost || (ret < 0 && errno == ENODEV);
+    return ret;
 }
 
 int stm32_usb_dev::usb_recv() {
     return read(dev_desc, &recv_task, sizeof(struct task_struct));
 }
+/* Bytes of the frame read, 0: the driver's read timed out without one */
 int FirmwareUpdateWorker::usb_recv() {
-    return read(dev_desc, &recv_task, sizeof(struct task_struct));
+    int ret = read(dev_desc, &recv_task, sizeof(struct task_struct));
+    lost = lost || (ret < 0 && errno == ENODEV);
+    return ret;
 }
 
 int stm32_usb_dev::usb_err_check() {
     if (recv_task.msg_head[0] != 0xFA || recv_task.msg_head[1] != 0xFB || recv_task.msg_tail[0] != 0xFC || recv_task.msg_tail[1] != 0xFD) {
         return -1;
-    } else if (CRC_CalculateCRC16(recv_task.data, recv_task.data_length) != recv_task.crc) {
+    } else if (usb_crc(&recv_task) != recv_task.crc) {
         return -1;
     } else if (recv_task.msg_error != MSG_SUCCESS) {
         return -1;
@@ -186,7 +392,7 @@ int stm32_usb_dev::usb_err_check() {
 int FirmwareUpdateWorker::usb_err_check() {
     if (recv_task.msg_head[0] != 0xFA || recv_task.msg_head[1] != 0xFB || recv_task.msg_tail[0] != 0xFC || recv_task.msg_tail[1] != 0xFD) {
         return -1;
-    } else if (CRC_CalculateCRC16(recv_task.data, recv_task.data_length) != recv_task.crc) {
+    } else if (usb_crc(&recv_task) != recv_task.crc) {
         return -1;
     } else if (recv_task.msg_error != MSG_SUCCESS) {
         return -1;
@@ -195,52 +401,24 @@ int FirmwareUpdateWorker::usb_err_check() {
     }
 }
 
-void FirmwareUpdateWorker::ascii_2_hex(char *asc_code, unsigned char *hex_code, unsigned int len) {
-    int idx = 0;
-    for (int i = 0; i < len; i += 2) {
-        sscanf(&asc_code[i], "%2hhx", &hex_code[idx]);
-        idx++;
-    }
-}
-
-void FirmwareUpdateWorker::startUpdate(QString dev, QString hex) {
-    u8 try_count = 8;
-    dev_desc = open(dev.toUtf8().constData(), O_RDWR);
+void FirmwareUpdateWorker::startUpdate(QString dev, QString hex, u32 base) {
+    bin_base = base;
+    dev_path = dev.toUtf8();
+    dev_desc = open(dev_path.constData(), O_RDWR);
     if (-1 == dev_desc) {
-        qDebug()<<"Open "<<dev.toUtf8().constData()<<" failed!";
+        qDebug()<<"Open "<<dev_path.constData()<<" failed!";
         return;
     }
-    hex_desc = open(hex.toUtf8().constData(), O_RDONLY);
+    fw_name = hex.toUtf8();
+    hex_desc = open(fw_name.constData(), O_RDONLY);
     if (-1 == hex_desc) {
-        qDebug()<<"Open "<<dev.toUtf8().constData()<<" failed!";
+        qDebug()<<"Open "<<fw_name.constData()<<" failed!";
         close(dev_desc);
         return;
     }
-retry:
-    if (--try_count == 0)
-        goto exit;
-    if (usb_request(MSG_DEV_ERASE, NULL, 0) < 0) {
-        qDebug()<<__func__<<", "<<__LINE__;
-        goto retry;
-    }
-    if (usb_recv() < 0) {
-        qDebug()<<__func__<<", "<<__LINE__;
-        goto retry;
-    }
-    if (usb_err_check() < 0) {
-        qDebug()<<__func__<<", "<<__LINE__;
-        goto retry;
-    } else {
-        if (recv_task.msg_error == MSG_SUCCESS) {
-            emit eraseCompleted();
-        } else {
-            qDebug()<<__func__<<", "<<__LINE__;
-            goto retry;
-        }
-        sleep(2);
-    }
     update_fw();
-exit:
-    close(dev_desc);
+    if (dev_desc >= 0) {
+        close(dev_desc);
+    }
     close(hex_desc);
 }
@@ -14,12 +14,20 @@
 #define MSG_GOTO_APP		0x2002
 #define MSG_PROGRAM_DATA    0x2003
 #define MSG_DEV_ERASE		0x2004
+#define MSG_SECTOR_CRC		0x2005
+#define MSG_VERIFY_IMAGE	0x2007
 /* Error Code */
 #define	MSG_SUCCESS			0x3230
 #define MSG_INVALID			0x3231
 #define MSG_WFORMAT			0x3232
 #define MSG_FAILED			0x3233
 #define MSG_WRONG_CRC		0x3234
+/* Recovery */
+#define FRAME_RETRIES		8		/* transmissions of one frame before the attempt fails */
+#define ERASE_WAIT			16		/* read timeouts to wait for the erase, 2 s a 128 KB sector at worst */
+#define RESUME_TRIES		8		/* attempts of one update, each resumes where the last stopped */
+#define RESUME_WAIT_MS		10000	/* for the device to come back after it was lost */
+#define JOURNAL_MAGIC		0x4c4e524a	/* "JRNL" */
 /* Type Definition */
 typedef uint8_t u8;
 typedef uint16_t u16;
@@ -30,34 +38,63 @@ struct task_struct {
     u8 msg_head[2];
     u16 msg_error;
     u16 msg_type;
+    u16 seq;
     u16 data_length;
-    u8 data[52];
-    u16 crc;
+    u8 data[48];
+    u32 crc;            /* CRC-32/MPEG-2 of the whole data field, as 12 words */
     u8 msg_tail[2];
 } __attribute__((packed));
 
+struct fw_image;
+
+/* What an interrupted update already got into flash, kept in a file per image */
+struct fw_journal {
+    u32 magic;
+    u32 end;            /* address after the last acknowledged data record */
+    u64 hash;           /* of the image */
+    u64 size;
+    u64 done;           /* image bytes acknowledged */
+};
+
 class FirmwareUpdateWorker : public QObject {
     Q_OBJECT
 public:
     explicit FirmwareUpdateWorker(QObject *parent = nullptr)
-        : QObject(parent), total_len(0)
+        : QObject(parent), bin_base(0), total_len(0), tx_seq(0), upper(0), lost(false), journal_fd(-1)
     {
         memset(&send_task, 0x00, sizeof(struct task_struct));
         memset(&recv_task, 0x00, sizeof(struct task_struct));
     }
 
-    void startUpdate(QString dev, QString hex);
+    void startUpdate(QString dev, QString hex, u32 base);
 private:
     int dev_desc;
     int hex_desc;
+    QByteArray fw_name;
+    u32 bin_base;       /* where a .bin file goes, HEX and ELF files carry their addresses */
     u64 total_len;
+    u16 tx_seq;
+    u32 upper;          /* of the last extended linear address record */
+    bool lost;          /* the device went away, it has to be opened again */
+    QByteArray dev_path;
+    struct fw_journal journal;
+    int journal_fd;
+    QString journal_path;
     struct task_struct send_task;
     struct task_struct recv_task;
     void update_fw(void);
+    int verify_image(const struct fw_image *img);
+    int erase_or_resume(const struct fw_image *img);
+    int reconnect(void);
+    void journal_open(const struct fw_image *img);
+    void journal_save(void);
+    void journal_close(bool finished);
     int usb_request(u16 msg_type, const u8 *data, u16 data_len);
+    int usb_resend(void);
     int usb_recv(void);
     int usb_err_check(void);
-    void ascii_2_hex(char *asc_code, unsigned char *hex_code, unsigned int len);
+    int program_frame(const uint8_t *record, int len);
+    static int program_record(void *ctx, const uint8_t *record, int len, uint64_t done);
 signals:
     void progressChanged(uint8_t progress);
     void updateCompleted();
@@ -75,7 +112,8 @@ public:
     Q_INVOKABLE QStringList findStm32Devices(void);
     Q_INVOKABLE void setProgress(uint8_t prog);
     Q_INVOKABLE uint8_t getProgress(void);
-    Q_INVOKABLE void startUpdateFirmware(QString dev, QString hex);
+    Q_INVOKABLE QString binBase(void);
+    Q_INVOKABLE bool startUpdateFirmware(QString dev, QString hex, QString base);
 
 private:
     /* Private Variable */
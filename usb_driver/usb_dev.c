@@ -8,10 +8,12 @@
 #include <linux/kref.h>
 #include <linux/errno.h>
 #include <linux/wait.h>
+#include <linux/poll.h>
 
 /* Private Macro */
 // #define DEBUG
 #define STM32_MAX_WRQ       0x0008
+#define STM32_MAX_WRITE     0x0800  /* one URB, the host splits it into bulk packets */
 /* USB Device Info */
 #define STM32_VENDOR_ID     0x1979
 #define STM32_PRODUCT_ID    0x2002
@@ -53,6 +55,7 @@ struct stm32_usb_dev {
     unsigned long disconnected:1;
     /* waitqueue */
     wait_queue_head_t bulk_in_wait;
+    wait_queue_head_t bulk_out_wait;
 } __attribute__((packed));
 
 /* Function Prototype */
@@ -72,6 +75,7 @@ static int usb_read_io(struct stm32_usb_dev *stm32, size_t len);
 static ssize_t stm32_read(struct file *filep, char __user *usr_buf, size_t size, loff_t *offset);
 void urb_tx_callback(struct urb *tx);
 static ssize_t stm32_write(struct file *filep, const char __user *usr_buf, size_t size, loff_t *offset);
+static __poll_t stm32_poll(struct file *filep, struct poll_table_struct *wait);
 
 /* Entry Point */
 static const struct file_operations stm32_fops = {
@@ -81,6 +85,7 @@ static const struct file_operations stm32_fops = {
     .read       = stm32_read,
     .write      = stm32_write,
     .flush      = stm32_flush,
+    .poll       = stm32_poll,
 };
 /* USB Class */
 static struct usb_class_driver stm32_class = {
@@ -128,6 +133,7 @@ static int stm32_probe(struct usb_interface *interface, const struct usb_device_
     spin_lock_init(&stm32->err_lock);
     init_usb_anchor(&stm32->urb_manager);
     init_waitqueue_head(&stm32->bulk_in_wait);
+    init_waitqueue_head(&stm32->bulk_out_wait);
     stm32->disconnected = 0;
     /* get config */
     stm32->interface = usb_get_intf(interface);
@@ -474,6 +480,7 @@ void urb_tx_callback(struct urb *tx) {
     usb_free_coherent(tx->dev, tx->transfer_buffer_length, 
                         tx->transfer_buffer, tx->transfer_dma);
     up(&stm32->limit_sem);
+    wake_up_interruptible(&stm32->bulk_out_wait);
 #ifdef DEBUG
     dev_info(stm32->dev, "%s called!\n", __func__);
 #endif
@@ -490,7 +497,7 @@ static ssize_t stm32_write(struct file *filep, const char __user *usr_buf, size_
     }
     if (!size)
         goto exit;
-    writesize = min_t(size_t, size, stm32->bulk_out_size);
+    writesize = min_t(size_t, size, STM32_MAX_WRITE);
     if (!(filep->f_flags & O_NONBLOCK)) {
         if (down_interruptible(&stm32->limit_sem)) {
             ret = -ERESTARTSYS;
@@ -566,6 +573,44 @@ error:
 exit:
     return ret;
 }
+/* Readable once a response is buffered, a read is started if none is ongoing */
+static __poll_t stm32_poll(struct file *filep, struct poll_table_struct *wait) {
+    __poll_t mask = 0;
+    bool idle;
+    struct stm32_usb_dev *stm32 = (struct stm32_usb_dev *)filep->private_data;
+    if (IS_ERR_OR_NULL(stm32)) {
+        return EPOLLERR;
+    }
+    poll_wait(filep, &stm32->bulk_in_wait, wait);
+    poll_wait(filep, &stm32->bulk_out_wait, wait);
+    if (stm32->disconnected) {
+        return EPOLLERR | EPOLLHUP;
+    }
+    spin_lock_irq(&stm32->err_lock);
+    idle = !stm32->ongoing_read;
+    if (stm32->errors) {
+        mask |= EPOLLERR;
+    }
+    if (idle && stm32->bulk_in_filled > stm32->bulk_in_copied) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+        idle = false;
+    }
+    spin_unlock_irq(&stm32->err_lock);
+    if (READ_ONCE(stm32->limit_sem.count)) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    /* Nothing buffered: fetch the next packet, its completion wakes us up */
+    if (idle && !(mask & EPOLLERR) && mutex_trylock(&stm32->stm32_lock)) {
+        if (!stm32->ongoing_read) {
+            usb_read_io(stm32, stm32->bulk_in_size);
+        }
+        mutex_unlock(&stm32->stm32_lock);
+    }
+#ifdef DEBUG
+    dev_info(stm32->dev, "%s called!\n", __func__);
+#endif
+    return mask;
+}
 
 static int __init stm32_init(void) {
     return usb_register(&stm32_driver);